@@ -23,10 +23,15 @@ libtouchmouse is properly used in the following manner:
 - Free the device enumeration with touchmouse_free_enumeration()
 - Put the device in full image updates mode with touchmouse_set_device_mode()
 - Set a callback for the device with touchmouse_set_image_update_callback()
-- Repeatedly call touchmouse_process_events_timeout(), which will call your callback function to get image updates.  You may wish to do this in a blocking manner in a thread.
+- Repeatedly call touchmouse_process_events_timeout(), which will call your callback function to get image updates.  You may wish to do this in a blocking manner in a thread.  If you poll instead, use touchmouse_process_pending_events(), which handles everything queued since the last call.
 - When done with the device, (optionally) set the device back in default mode with touchmouse_set_device_mode() and close the device with touchmouse_close()
 - Deinitialize the library with touchmouse_shutdown()
 
+Reports that have already been captured can be decoded without a device using
+a standalone decoder: create one with touchmouse_decoder_init(), set a callback
+with touchmouse_decoder_set_image_update_callback(), and pass each raw report to
+touchmouse_decoder_feed().
+
 See the examples for usage examples that you're free to copy and modify at will.
 
 */
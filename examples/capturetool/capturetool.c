@@ -0,0 +1,174 @@
+/*
+ * Copyright 2011 Drew Fisher (drew.m.fisher@gmail.com).
+ *
+ * The contents of this file may be used by anyone for any reason without any
+ * conditions and may be used as a starting point for your own applications
+ * which use libtouchmouse.
+*/
+
+// Indexes capture files and pulls images out of them at random, using the
+// indexed capture API.  Needs no hardware.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <libtouchmouse/libtouchmouse.h>
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s index FILE\n", argv0);
+	fprintf(stderr, "       %s info FILE\n", argv0);
+	fprintf(stderr, "       %s show FILE SECONDS\n", argv0);
+	fprintf(stderr, "       %s decode FILE [CHUNKS]\n", argv0);
+	fprintf(stderr, "  index   add an index to a capture, so the other commands can use it\n");
+	fprintf(stderr, "  info    summarize an indexed capture\n");
+	fprintf(stderr, "  show    print the image SECONDS into the capture\n");
+	fprintf(stderr, "  decode  decode every image, split into CHUNKS independent ranges\n");
+}
+
+static int images_decoded;
+static uint8_t last_image[195];
+
+static void keep_image(touchmouse_callback_info *cbinfo)
+{
+	images_decoded++;
+	memcpy(last_image, cbinfo->image, sizeof(last_image));
+}
+
+// Feed image n's reports to the decoder.  Returns the number of images
+// completed, or -1 if the capture couldn't be read.
+static int decode_frame(touchmouse_capture *capture, touchmouse_decoder *decoder, uint64_t n)
+{
+	touchmouse_capture_frame frame;
+	uint32_t i;
+	int completed = 0;
+	if (touchmouse_capture_get_frame(capture, n, &frame) != 0)
+		return -1;
+	for(i = 0; i < frame.report_count; i++) {
+		const unsigned char *report;
+		uint64_t arrival;
+		int length = touchmouse_capture_get_report(capture, &frame, i, &report, &arrival);
+		if (length < 0)
+			return -1;
+		int res = touchmouse_decoder_feed_timestamped(decoder, report, length, arrival);
+		if (res > 0)
+			completed += res;
+	}
+	return completed;
+}
+
+static int info(touchmouse_capture *capture)
+{
+	touchmouse_capture_frame first, last;
+	uint64_t count = touchmouse_capture_frame_count(capture);
+	printf("%llu images\n", (unsigned long long)count);
+	if (count == 0)
+		return 0;
+	touchmouse_capture_get_frame(capture, 0, &first);
+	touchmouse_capture_get_frame(capture, count - 1, &last);
+	printf("%.3f s from the first to the last\n", (last.host_time_ns - first.host_time_ns) * 1e-9);
+	printf("device time %llu to %llu ms, clock restarted %u times\n",
+		(unsigned long long)first.device_time_ms, (unsigned long long)last.device_time_ms, last.series - first.series);
+	return 0;
+}
+
+static int show(touchmouse_capture *capture, double seconds)
+{
+	touchmouse_capture_frame first;
+	touchmouse_decoder *decoder;
+	if (touchmouse_capture_get_frame(capture, 0, &first) != 0) {
+		fprintf(stderr, "The capture has no images\n");
+		return 1;
+	}
+	int64_t n = touchmouse_capture_find_time(capture, first.host_time_ns + (uint64_t)(seconds * 1e9));
+	if (n < 0 || touchmouse_decoder_init(&decoder) != 0)
+		return 1;
+	touchmouse_decoder_set_image_update_callback(decoder, keep_image);
+	int completed = decode_frame(capture, decoder, (uint64_t)n);
+	touchmouse_decoder_free(decoder);
+	if (completed <= 0) {
+		fprintf(stderr, "Image %lld is incomplete in the capture\n", (long long)n);
+		return 1;
+	}
+	touchmouse_capture_frame frame;
+	touchmouse_capture_get_frame(capture, (uint64_t)n, &frame);
+	printf("Image %lld, %.3f s in, device time %llu ms\n", (long long)n,
+		(frame.host_time_ns - first.host_time_ns) * 1e-9, (unsigned long long)frame.device_time_ms);
+	int row;
+	for(row = 0; row < 13 ; row++) {
+		int col;
+		for(col = 0; col < 15; col++) {
+			printf("%02X ", last_image[row * 15 + col]);
+		}
+		printf("\n");
+	}
+	return 0;
+}
+
+// Each chunk gets a decoder of its own and starts from its first image, so
+// the chunks could just as well be handed to separate threads.
+static int decode_all(touchmouse_capture *capture, int chunks)
+{
+	uint64_t count = touchmouse_capture_frame_count(capture);
+	uint64_t start = touchmouse_time_nanos();
+	int c;
+	images_decoded = 0;
+	for(c = 0; c < chunks; c++) {
+		uint64_t begin = count * c / chunks;
+		uint64_t end = count * (c + 1) / chunks;
+		uint64_t n;
+		touchmouse_decoder *decoder;
+		if (touchmouse_decoder_init(&decoder) != 0)
+			return 1;
+		touchmouse_decoder_set_image_update_callback(decoder, keep_image);
+		for(n = begin; n < end; n++) {
+			if (decode_frame(capture, decoder, n) < 0) {
+				fprintf(stderr, "Failed to read image %llu\n", (unsigned long long)n);
+				touchmouse_decoder_free(decoder);
+				return 1;
+			}
+		}
+		touchmouse_decoder_free(decoder);
+	}
+	uint64_t elapsed = touchmouse_time_nanos() - start;
+	printf("%d of %llu images decoded in %d chunks, %.1f ns per image\n", images_decoded,
+		(unsigned long long)count, chunks, count ? (double)elapsed / count : 0.0);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		usage(argv[0]);
+		return 1;
+	}
+	const char *command = argv[1];
+	const char *path = argv[2];
+	if (strcmp(command, "index") == 0) {
+		if (touchmouse_index_capture(path) != 0) {
+			fprintf(stderr, "Failed to index %s\n", path);
+			return 1;
+		}
+		return 0;
+	}
+
+	touchmouse_capture *capture;
+	if (touchmouse_capture_open(&capture, path) != 0) {
+		fprintf(stderr, "Failed to open %s; is it indexed?\n", path);
+		return 1;
+	}
+	int res;
+	if (strcmp(command, "info") == 0) {
+		res = info(capture);
+	} else if (strcmp(command, "show") == 0 && argc > 3) {
+		res = show(capture, atof(argv[3]));
+	} else if (strcmp(command, "decode") == 0) {
+		int chunks = argc > 3 ? atoi(argv[3]) : 1;
+		res = decode_all(capture, chunks > 0 ? chunks : 1);
+	} else {
+		usage(argv[0]);
+		res = 1;
+	}
+	touchmouse_capture_close(capture);
+	return res;
+}
@@ -0,0 +1,701 @@
+/*
+ * Copyright 2011 Drew Fisher (drew.m.fisher@gmail.com).
+ *
+ * The contents of this file may be used by anyone for any reason without any
+ * conditions and may be used as a starting point for your own applications
+ * which use libtouchmouse.
+*/
+
+// Microbenchmark for the image decoding path.  Needs no hardware.  With
+// --verify, checks instead that images survive encoding and decoding, and
+// that reports decode just as they did with the original decoder.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#include <libtouchmouse/libtouchmouse.h>
+#include "touchmouse-internal.h"
+#include "image_unpack.h"
+#include "mono_timer.h"
+
+#define ITERATIONS 2000000
+
+// The unpack loop as it was originally written, with the row bounds
+// recomputed on every frame.  Kept here as the baseline to compare against.
+static void unpack_switch(const uint8_t *packed, uint8_t *image)
+{
+	memset(image, 0, 195);
+	int row;
+	int i = 0;
+	int startcol;
+	int endcol;
+	for(row = 0; row < 13 ; row++) {
+		switch(row) {
+			// Note: inclusive bounds
+			case 0: startcol = 0x3;
+					endcol = 0xb;
+					break;
+			case 1: startcol = 0x2;
+					endcol = 0xc;
+					break;
+			case 2:
+			case 3: startcol = 0x1;
+					endcol = 0xd;
+					break;
+			default:
+					startcol = 0x0;
+					endcol = 0xe;
+					break;
+		}
+		int col;
+		for(col = startcol ; col <= endcol ; col++) {
+			image[row * 15 + col] = tm_decoder_table[packed[i++]];
+		}
+	}
+}
+
+static uint8_t packed[64][TM_PACKED_PIXELS + TM_PACKED_SLACK];
+
+// Returns nanoseconds per frame.
+static double bench_unpack(tm_unpack_func unpack)
+{
+	uint8_t image[TM_IMAGE_PIXELS];
+	unsigned int checksum = 0;
+	int i;
+	uint64_t start = mono_timer_nanos();
+	for(i = 0; i < ITERATIONS; i++) {
+		unpack(packed[i & 63], image);
+		checksum += image[i % TM_IMAGE_PIXELS];
+	}
+	uint64_t end = mono_timer_nanos();
+	// Keep the compiler from discarding the work.
+	if (checksum == 0xdeadbeef)
+		printf("!\n");
+	return (double)(end - start) / ITERATIONS;
+}
+
+static int check_unpack(tm_unpack_func unpack)
+{
+	uint8_t expected[TM_IMAGE_PIXELS];
+	uint8_t actual[TM_IMAGE_PIXELS];
+	int i;
+	for(i = 0; i < 64; i++) {
+		unpack_switch(packed[i], expected);
+		memset(actual, 0xff, sizeof(actual));
+		unpack(packed[i], actual);
+		if (memcmp(expected, actual, sizeof(expected)) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void report(const char *name, tm_unpack_func unpack)
+{
+	if (check_unpack(unpack) != 0) {
+		printf("%-16s output differs from the original loop!\n", name);
+		return;
+	}
+	printf("%-16s %8.2f ns/frame\n", name, bench_unpack(unpack));
+}
+
+static uint8_t reports[64 * TOUCHMOUSE_MAX_IMAGE_REPORTS][32];
+static int report_count;
+static int frames_seen;
+
+static void count_frame(touchmouse_callback_info *cbinfo)
+{
+	frames_seen++;
+}
+
+// Returns nanoseconds per frame for decoding the report stream.
+static double bench_decode(touchmouse_decoder *decoder)
+{
+	int frames = ITERATIONS / 20;
+	int i = 0;
+	frames_seen = 0;
+	uint64_t start = mono_timer_nanos();
+	while (frames_seen < frames) {
+		touchmouse_decoder_feed(decoder, reports[i], 32);
+		if (++i == report_count)
+			i = 0;
+	}
+	uint64_t end = mono_timer_nanos();
+	return (double)(end - start) / frames;
+}
+
+// Returns nanoseconds per frame for encoding images back into reports.
+static double bench_encode(uint8_t frame[][TM_PACKED_PIXELS])
+{
+	unsigned char out[TOUCHMOUSE_MAX_IMAGE_REPORTS][32];
+	int frames = ITERATIONS / 20;
+	int count = 0;
+	int i;
+	uint64_t start = mono_timer_nanos();
+	for(i = 0; i < frames; i++)
+		count += touchmouse_encode_pixels(frame[i & 63], (uint8_t)i, out);
+	uint64_t end = mono_timer_nanos();
+	if (count == 0)
+		printf("!\n");
+	return (double)(end - start) / frames;
+}
+
+// Round-trip checking: images of every shape we can think of are encoded,
+// decoded again in each decode mode, and compared with what went in.
+static uint8_t verify_expected[TM_IMAGE_PIXELS];
+static int verify_mismatches;
+
+static void check_frame(touchmouse_callback_info *cbinfo)
+{
+	frames_seen++;
+	if (memcmp(cbinfo->image, verify_expected, TM_IMAGE_PIXELS) != 0)
+		verify_mismatches++;
+}
+
+// Fill in the levels of test image number n.
+static void make_test_image(int n, uint8_t *levels)
+{
+	int i = 0;
+	switch (n % 6) {
+		case 0: // Nothing touching
+			memset(levels, 0, TM_PACKED_PIXELS);
+			break;
+		case 1: // No zeroes at all, so no runs
+			for(i = 0; i < TM_PACKED_PIXELS; i++)
+				levels[i] = 1 + rand() % 14;
+			break;
+		case 2: // Any level anywhere
+			for(i = 0; i < TM_PACKED_PIXELS; i++)
+				levels[i] = rand() % 15;
+			break;
+		case 3: { // Sparse, at a random density
+			int density = 1 + rand() % 16;
+			for(i = 0; i < TM_PACKED_PIXELS; i++)
+				levels[i] = (rand() % density == 0) ? 1 + rand() % 14 : 0;
+			break;
+		}
+		default: // Runs of zeroes of every length, long ones included
+			while (i < TM_PACKED_PIXELS) {
+				int run = rand() % 40;
+				while (run-- > 0 && i < TM_PACKED_PIXELS)
+					levels[i++] = 0;
+				if (i < TM_PACKED_PIXELS)
+					levels[i++] = 1 + rand() % 14;
+			}
+			break;
+	}
+}
+
+// Reports whose length byte is out of range have to be rejected, or cut
+// down to the 25 payload bytes a report holds, never read past.  The report
+// is allocated on its own so that memory checkers catch any overrun.
+static int check_bad_lengths(touchmouse_decoder *decoder)
+{
+	unsigned char *report = (unsigned char*)malloc(32);
+	unsigned char clamped[32];
+	int failures = 0;
+	int length;
+	for(length = 0; length < 256; length++) {
+		memset(report, 0x11, 32);
+		report[0] = 0x27;
+		report[1] = (unsigned char)length;
+		report[2] = 0x14; report[3] = 0x01; report[4] = 0x00; report[5] = 0x51;
+		report[6] = (unsigned char)length;
+		memcpy(clamped, report, 32);
+		if (clamped[1] > 26)
+			clamped[1] = 26;
+		touchmouse_decoder_reset(decoder);
+		int res = touchmouse_decoder_feed(decoder, report, 32);
+		touchmouse_decoder_reset(decoder);
+		int expected = touchmouse_decoder_feed(decoder, clamped, 32);
+		if (length == 0 ? res != -1 : res != expected)
+			failures++;
+	}
+	touchmouse_decoder_reset(decoder);
+	free(report);
+	return failures;
+}
+
+// The decoder as it was originally written, one nybble at a time, copied from
+// touchmouse.c with the logging left out.  Kept here so that the decoders can
+// be checked against the original, not only against our own encoder.
+typedef struct {
+	uint8_t timestamp_in_progress;
+	int buf_index;
+	int next_is_run_encoded;
+	uint8_t partial_image[181];
+	uint8_t image[195];
+} baseline_decoder;
+
+static void reset_decoder(baseline_decoder *state)
+{
+	state->buf_index = 0;
+	state->next_is_run_encoded = 0;
+	memset(state->partial_image, 0, sizeof(state->partial_image));
+	memset(state->image, 0, sizeof(state->image));
+}
+
+// There are 15 possible values that each pixel can take on, but we'd like to
+// scale them up to the full range of a uint8_t for convenience.
+static uint8_t decoder_table[15] = {0, 18, 36, 55, 73, 91, 109, 128, 146, 164, 182, 200, 219, 237, 255 };
+
+static int process_nybble(baseline_decoder *state, uint8_t nybble)
+{
+	if (nybble >= 16) {
+		return DECODER_ERROR;
+	}
+	if (state->next_is_run_encoded) {
+		// Previous nybble was 0xF, so this one is (the number of bytes to skip - 3)
+		if (state->buf_index + nybble + 3 > 181) {
+			// Completing this decode would overrun the buffer.  We've been
+			// given invalid data.  Abort.
+			return DECODER_ERROR;
+		}
+		int i;
+		for(i = 0 ; i < nybble + 3; i++) {
+			state->partial_image[state->buf_index] = 0;
+			state->buf_index++;
+		}
+		state->next_is_run_encoded = 0;
+	} else {
+		if (nybble == 0xf) {
+			state->next_is_run_encoded = 1;
+		} else {
+			state->partial_image[state->buf_index] = nybble;
+			state->buf_index++;
+		}
+	}
+	// If we're done collecting the data, unpack it into image as described above
+	// This could probably be reworked to unpack the image in-place reusing the
+	// image buffer, but right now I'm being lazy.
+	if (state->buf_index == 181) {
+		memset(state->image, 0, 195);
+		int row;
+		int i = 0;
+		int startcol;
+		int endcol;
+		for(row = 0; row < 13 ; row++) {
+			switch(row) {
+				// Note: inclusive bounds
+				case 0: startcol = 0x3;
+						endcol = 0xb;
+						break;
+				case 1: startcol = 0x2;
+						endcol = 0xc;
+						break;
+				case 2:
+				case 3: startcol = 0x1;
+						endcol = 0xd;
+						break;
+				default:
+						startcol = 0x0;
+						endcol = 0xe;
+						break;
+			}
+			int col;
+			for(col = startcol ; col <= endcol ; col++) {
+				state->image[row * 15 + col] = decoder_table[state->partial_image[i++]];
+			}
+		}
+		return DECODER_COMPLETE;
+	}
+	return DECODER_IN_PROGRESS;
+}
+
+// The report layout, as described in decoder.c.
+#pragma pack(1)
+typedef struct {
+	uint8_t report_id;
+	uint8_t length;
+	uint8_t magic[4];
+	uint8_t timestamp;
+	uint8_t data[25];
+} raw_report;
+#pragma pack()
+
+// The images a decoder delivered for one report.  A 25 byte payload can't
+// hold more than three.
+typedef struct {
+	int count;
+	uint8_t images[4][TM_IMAGE_PIXELS];
+} frame_log;
+
+static frame_log baseline_frames;
+
+static void log_frame(frame_log *log, const uint8_t *image)
+{
+	if (log->count < 4)
+		memcpy(log->images[log->count], image, TM_IMAGE_PIXELS);
+	log->count++;
+}
+
+static void log_decoded_frame(touchmouse_callback_info *cbinfo)
+{
+	log_frame((frame_log*)cbinfo->userdata, cbinfo->image);
+}
+
+// The per-report loop from the original touchmouse_process_events_timeout(),
+// with the callback replaced by log_frame().  It stopped at the first image
+// in a report and dropped the rest of it; with drain set it carries on
+// instead, the way touchmouse_decoder_feed() does.  Returns 0, or -1 if the
+// report couldn't be decoded.
+static int baseline_feed(baseline_decoder *dev, const unsigned char *data, int res, int drain)
+{
+	const raw_report* r = (const raw_report*)data;
+	// We only care about report ID 39 (0x27), which should be 32 bytes long
+	if (res == 32 && r->report_id == 0x27) {
+		int t;
+		// Reset the decoder if we've seen one timestamp already from earlier
+		// transfers, and this one doesn't match.  The original could only
+		// have a run pending with nothing decoded after carrying on past an
+		// image, which it never did.
+		if ((dev->buf_index != 0 || dev->next_is_run_encoded) && r->timestamp != dev->timestamp_in_progress) {
+			reset_decoder(dev); // Reset decoder for next transfer
+		}
+		dev->timestamp_in_progress = r->timestamp;
+		for(t = 0; t < r->length - 1; t++) { // We subtract one byte because the length includes the timestamp byte.
+			int res;
+			// Yes, we process the low nybble first.  Embedded systems are funny like that.
+			res = process_nybble(dev, r->data[t] & 0xf);
+			if (res == DECODER_COMPLETE) {
+				log_frame(&baseline_frames, dev->image);
+				reset_decoder(dev); // Reset decoder for next transfer
+				if (!drain)
+					return 0;
+			}
+			if (res == DECODER_ERROR) {
+				reset_decoder(dev);
+				return -1;
+			}
+			res = process_nybble(dev, (r->data[t] & 0xf0) >> 4);
+			if (res == DECODER_COMPLETE) {
+				log_frame(&baseline_frames, dev->image);
+				reset_decoder(dev); // Reset decoder for next transfer
+				if (!drain)
+					return 0;
+			}
+			if (res == DECODER_ERROR) {
+				reset_decoder(dev);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+// The payload bytes waiting to be cut into reports, packed low nybble first.
+static uint8_t payload[1024];
+static int payload_bytes;
+static int half_byte = -1;
+
+static void put_nybble(int nybble)
+{
+	if (half_byte < 0) {
+		half_byte = nybble;
+		return;
+	}
+	payload[payload_bytes++] = (uint8_t)(half_byte | nybble << 4);
+	half_byte = -1;
+}
+
+// Append the nybbles of about one image to the payload: plain noise, real
+// encoder output, or runs and literals that head for 181 pixels and then
+// fill the image exactly, overflow it, stop short, or end on a bare 0xF.
+static void put_frame(int n)
+{
+	uint8_t levels[TM_PACKED_PIXELS];
+	unsigned char out[TOUCHMOUSE_MAX_IMAGE_REPORTS][32];
+	int pixels = 0;
+	int i;
+	switch (n % 3) {
+		case 0: {
+			int count = 1 + rand() % 400;
+			for(i = 0; i < count; i++)
+				put_nybble(rand() % 16);
+			break;
+		}
+		case 1: {
+			make_test_image(n / 3, levels);
+			int count = touchmouse_encode_pixels(levels, 0, out);
+			int k;
+			for(k = 0; k < count; k++) {
+				for(i = 0; i < out[k][1] - 1; i++) {
+					put_nybble(out[k][7 + i] & 0xf);
+					put_nybble(out[k][7 + i] >> 4);
+				}
+			}
+			break;
+		}
+		default: {
+			int stop = TM_PACKED_PIXELS - rand() % 20;
+			while (pixels < stop) {
+				if (rand() % 3 == 0) {
+					int run = rand() % 16;
+					put_nybble(0xf);
+					put_nybble(run);
+					pixels += run + 3;
+				} else {
+					put_nybble(rand() % 15);
+					pixels++;
+				}
+			}
+			switch (rand() % 4) {
+				case 0:
+					put_nybble(0xf);
+					put_nybble(rand() % 16);
+					break;
+				case 1:
+					put_nybble(0xf);
+					break;
+				case 2:
+					break;
+				default:
+					for(; pixels < TM_PACKED_PIXELS; pixels++)
+						put_nybble(rand() % 15);
+					break;
+			}
+			break;
+		}
+	}
+}
+
+// Cut the next report off the payload, with anything from none to all 25
+// bytes of it.  Reports mostly continue the image in progress, but now and
+// then start a new timestamp or aren't image reports at all.  The bytes
+// past the length are junk, which no decoder should look at.
+static void next_report(unsigned char *r, uint8_t *timestamp)
+{
+	int frame = 0;
+	while (payload_bytes < 25)
+		put_frame(frame++ + rand());
+	int length = rand() % 26;
+	int i;
+	for(i = 0; i < 32; i++)
+		r[i] = (unsigned char)rand();
+	r[0] = rand() % 32 ? 0x27 : 0x26;
+	r[1] = (unsigned char)(length + 1);
+	r[2] = 0x14; r[3] = 0x01; r[4] = 0x00; r[5] = 0x51;
+	if (rand() % 8 == 0)
+		(*timestamp)++;
+	r[6] = *timestamp;
+	memcpy(r + 7, payload, length);
+	payload_bytes -= length;
+	memmove(payload, payload + length, payload_bytes);
+}
+
+// Feed the same reports to the original decoder and to ours in each decode
+// mode, both stopping at the first image in a report as
+// touchmouse_process_events_timeout() does and draining every image as
+// touchmouse_decoder_feed() does.  Every report has to give the same result
+// and the same images.  Returns the number of reports that didn't.
+static int compare_with_baseline(int reports)
+{
+	static const touchmouse_decode_mode modes[] = { TOUCHMOUSE_DECODE_BUFFERED, TOUCHMOUSE_DECODE_IN_PLACE };
+	touchmouse_decoder *decoders[2][2];
+	frame_log decoded[2];
+	baseline_decoder baseline[2];
+	unsigned char r[32];
+	uint8_t timestamp = 0;
+	int frames = 0;
+	int errors = 0;
+	int pending = 0;
+	int mismatches = 0;
+	int drain, m, i;
+	for(drain = 0; drain < 2; drain++) {
+		reset_decoder(&baseline[drain]);
+		baseline[drain].timestamp_in_progress = 0;
+		for(m = 0; m < 2; m++) {
+			if (touchmouse_decoder_init(&decoders[drain][m]) != 0 || touchmouse_decoder_set_mode(decoders[drain][m], modes[m]) != 0) {
+				printf("Failed to create a decoder\n");
+				return reports;
+			}
+			touchmouse_decoder_set_image_update_callback(decoders[drain][m], log_decoded_frame);
+			touchmouse_decoder_set_userdata(decoders[drain][m], &decoded[m]);
+		}
+	}
+	// Overflowing runs are expected, and each would be logged.
+	touchmouse_set_log_level(TOUCHMOUSE_LOG_FATAL);
+	for(i = 0; i < reports; i++) {
+		int mismatched = 0;
+		next_report(r, &timestamp);
+		for(drain = 0; drain < 2; drain++) {
+			baseline_frames.count = 0;
+			int expected = baseline_feed(&baseline[drain], r, 32, drain);
+			if (drain) {
+				frames += baseline_frames.count;
+				errors += expected < 0;
+				pending += baseline[drain].next_is_run_encoded;
+			}
+			for(m = 0; m < 2; m++) {
+				decoded[m].count = 0;
+				int res = tm_decoder_feed(decoders[drain][m], r, 32, drain, 0);
+				if ((res < 0 ? -1 : 0) != expected || decoded[m].count != baseline_frames.count ||
+						memcmp(decoded[m].images, baseline_frames.images, (baseline_frames.count < 4 ? baseline_frames.count : 4) * TM_IMAGE_PIXELS) != 0)
+					mismatched = 1;
+			}
+		}
+		mismatches += mismatched;
+	}
+	touchmouse_set_log_level(TOUCHMOUSE_LOG_INFO);
+	for(drain = 0; drain < 2; drain++) {
+		for(m = 0; m < 2; m++)
+			touchmouse_decoder_free(decoders[drain][m]);
+	}
+	printf("%d reports against the original decoder (%d images, %d overflows, %d ending on a 0xF): ", reports, frames, errors, pending);
+	if (mismatches == 0)
+		printf("all match\n");
+	else
+		printf("%d decoded differently\n", mismatches);
+	return mismatches;
+}
+
+static int verify(int images)
+{
+	static const touchmouse_decode_mode modes[] = { TOUCHMOUSE_DECODE_BUFFERED, TOUCHMOUSE_DECODE_IN_PLACE };
+	static const char *mode_names[] = { "buffered", "in place" };
+	uint8_t levels[TM_PACKED_PIXELS];
+	unsigned char out[TOUCHMOUSE_MAX_IMAGE_REPORTS][32];
+	unsigned char from_image[TOUCHMOUSE_MAX_IMAGE_REPORTS][32];
+	touchmouse_decoder *decoders[2];
+	int encode_mismatches = 0;
+	int failures = 0;
+	int m, n;
+	for(m = 0; m < 2; m++) {
+		if (touchmouse_decoder_init(&decoders[m]) != 0 || touchmouse_decoder_set_mode(decoders[m], modes[m]) != 0) {
+			printf("Failed to create a decoder\n");
+			return 1;
+		}
+		touchmouse_decoder_set_image_update_callback(decoders[m], check_frame);
+	}
+	for(n = 0; n < images; n++) {
+		make_test_image(n, levels);
+		tm_unpack_scalar(levels, verify_expected);
+		int count = touchmouse_encode_pixels(levels, (uint8_t)n, out);
+		// The decoded image has to encode to the very same reports.
+		if (touchmouse_encode_image(verify_expected, (uint8_t)n, from_image) != count ||
+				memcmp(out, from_image, count * 32) != 0)
+			encode_mismatches++;
+		for(m = 0; m < 2; m++) {
+			int k;
+			frames_seen = 0;
+			for(k = 0; k < count; k++)
+				touchmouse_decoder_feed(decoders[m], out[k], 32);
+			// Exactly one image, and nothing left over to start another.
+			if (frames_seen != 1)
+				verify_mismatches++;
+		}
+	}
+	int bad_length_failures = 0;
+	for(m = 0; m < 2; m++) {
+		bad_length_failures += check_bad_lengths(decoders[m]);
+		touchmouse_decoder_free(decoders[m]);
+	}
+	printf("every report length byte, in both decoders: %s\n", bad_length_failures ? "MISHANDLED" : "handled");
+	if (bad_length_failures)
+		failures = 1;
+	printf("%d images round-tripped through the %s and %s decoders: ", images, mode_names[0], mode_names[1]);
+	if (verify_mismatches == 0 && encode_mismatches == 0) {
+		printf("all match\n");
+	} else {
+		printf("%d decode mismatches, %d images encoded differently\n", verify_mismatches, encode_mismatches);
+		failures = 1;
+	}
+	if (compare_with_baseline(images) != 0)
+		failures = 1;
+	return failures;
+}
+
+// The logging the decoder used to do for every report even with SPEW and
+// FLOOD disabled: an out-of-line variadic call per byte, only to compare the
+// level and return.  Called through a volatile pointer so it isn't inlined.
+static int old_log_level = TOUCHMOUSE_LOG_INFO;
+static void old_tm_log(int level, const char *fmt, ...)
+{
+	va_list args;
+	if (level > old_log_level)
+		return;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+static void (*volatile old_log)(int level, const char *fmt, ...) = old_tm_log;
+
+static double bench_old_logging(void)
+{
+	int frames = ITERATIONS / 20;
+	int reports_per_frame = report_count / 64;
+	int f;
+	uint64_t start = mono_timer_nanos();
+	for(f = 0; f < frames; f++) {
+		int k;
+		for(k = 0; k < reports_per_frame; k++) {
+			const uint8_t *r = reports[(f & 63) * reports_per_frame + k];
+			int j;
+			old_log(TOUCHMOUSE_LOG_SPEW, "tm_decoder_feed: got report: %d bytes:", 32);
+			for(j = 0; j < 32; j++)
+				old_log(TOUCHMOUSE_LOG_SPEW, " %02X", r[j]);
+			old_log(TOUCHMOUSE_LOG_SPEW, "\n");
+			old_log(TOUCHMOUSE_LOG_FLOOD, "Timestamp: %02X\t%02X bytes:", r[6], r[1] - 1);
+			for(j = 0; j < r[1] - 1; j++)
+				old_log(TOUCHMOUSE_LOG_FLOOD, " %02X", r[7 + j]);
+			old_log(TOUCHMOUSE_LOG_FLOOD, "\n");
+		}
+	}
+	uint64_t end = mono_timer_nanos();
+	return (double)(end - start) / frames;
+}
+
+int main(int argc, char **argv) {
+	int i;
+	int j;
+	srand(1);
+	if (argc > 1 && strcmp(argv[1], "--verify") == 0) {
+		touchmouse_init();
+		int failed = verify(argc > 2 ? atoi(argv[2]) : 100000);
+		touchmouse_shutdown();
+		return failed;
+	}
+	if (argc > 1) {
+		fprintf(stderr, "Usage: %s [--verify [images]]\n", argv[0]);
+		return 1;
+	}
+	for(i = 0; i < 64; i++) {
+		for(j = 0; j < TM_PACKED_PIXELS + TM_PACKED_SLACK; j++) {
+			// Mostly zeroes, like a real touch image.
+			packed[i][j] = (rand() % 4 == 0) ? rand() % 15 : 0;
+		}
+	}
+
+	printf("181 -> 195 unpack, %d frames each:\n", ITERATIONS);
+	report("switch loop", unpack_switch);
+	report("index table", tm_unpack_scalar);
+	const char *name = tm_unpack_select();
+	if (tm_unpack != tm_unpack_scalar)
+		report(name, tm_unpack);
+
+	// Whole-report decoding through the public decoder, on frames shaped
+	// like the unpack ones.  Every frame is encoded to the same number of
+	// reports, so that the old logging cost can be charged per frame.
+	uint8_t frame[64][TM_PACKED_PIXELS];
+	for(i = 0; i < 64; i++) {
+		for(j = 0; j < TM_PACKED_PIXELS; j++)
+			frame[i][j] = (j % 4 == 0) ? (i + j) % 15 : 0;
+		report_count += touchmouse_encode_pixels(frame[i], (uint8_t)(i * 3), &reports[report_count]);
+	}
+	touchmouse_init();
+	touchmouse_set_log_level(TOUCHMOUSE_LOG_INFO);
+	touchmouse_decoder *decoder;
+	if (touchmouse_decoder_init(&decoder) != 0) {
+		printf("Failed to create a decoder\n");
+		return 1;
+	}
+	touchmouse_decoder_set_image_update_callback(decoder, count_frame);
+	printf("\nreport decoding, %d frames each, log level INFO:\n", ITERATIONS / 20);
+	printf("%-24s %8.2f ns/frame\n", "decoder", bench_decode(decoder));
+	printf("%-24s %8.2f ns/frame\n", "old disabled log calls", bench_old_logging());
+	printf("%-24s %8.2f ns/frame\n", "encoder", bench_encode(frame));
+	touchmouse_decoder_free(decoder);
+	touchmouse_shutdown();
+	return 0;
+}
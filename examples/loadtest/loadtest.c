@@ -0,0 +1,153 @@
+/*
+ * Copyright 2011 Drew Fisher (drew.m.fisher@gmail.com).
+ *
+ * The contents of this file may be used by anyone for any reason without any
+ * conditions and may be used as a starting point for your own applications
+ * which use libtouchmouse.
+*/
+
+// Load test: how many mice can one thread keep up with?  Opens growing
+// numbers of synthetic devices, processes their events for a while with
+// touchmouse_process_events_multi(), and reports the frame rate sustained,
+// the CPU time spent per frame, and how many frames were dropped.  Needs no
+// hardware.  The synthetic devices make up their touches when they're
+// opened, so the CPU time is what the library itself spends.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <libtouchmouse/libtouchmouse.h>
+
+static const int default_counts[] = {1, 10, 50, 100, 200, 500};
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-r frame_rate] [-s seconds] [-b backlog] [-i] [device_count...]\n", argv0);
+	fprintf(stderr, "  -r  images per second from each device (default 125)\n");
+	fprintf(stderr, "  -s  seconds to run each device count for (default 5)\n");
+	fprintf(stderr, "  -b  frame periods an image may wait before it's dropped (default 4)\n");
+	fprintf(stderr, "  -i  let the devices go idle between touches\n");
+	fprintf(stderr, "Device counts default to 1 10 50 100 200 500.\n");
+}
+
+static void count_frame(touchmouse_callback_info *cbinfo)
+{
+	// The stats count frames for us; this only has to be cheap.
+}
+
+// Run count devices for the given time and print a line of results.
+// Returns -1 if the devices couldn't be opened.
+static int run(int count, const touchmouse_synthetic_params *base, double seconds)
+{
+	touchmouse_device **devs = (touchmouse_device**)calloc(count, sizeof(touchmouse_device*));
+	int *status = (int*)calloc(count, sizeof(int));
+	touchmouse_synthetic_params params = *base;
+	int i;
+	if (!devs || !status) {
+		free(devs);
+		free(status);
+		return -1;
+	}
+	for(i = 0; i < count; i++) {
+		params.seed = i + 1;
+		if (touchmouse_open_synthetic(&devs[i], &params) != 0) {
+			fprintf(stderr, "Failed to open synthetic device %d\n", i);
+			while (i-- > 0)
+				touchmouse_close(devs[i]);
+			free(devs);
+			free(status);
+			return -1;
+		}
+		touchmouse_set_image_update_callback(devs[i], count_frame);
+	}
+
+	uint64_t start = touchmouse_time_nanos();
+	uint64_t end = start + (uint64_t)(seconds * 1e9);
+	clock_t cpu_start = clock();
+	int errors = 0;
+	// Count every device that reports trouble in a call.
+	while (touchmouse_time_nanos() < end) {
+		int res = touchmouse_process_events_multi(devs, count, 10, status);
+		if (res < 0)
+			errors++;
+		if (res == -2)
+			break;
+		for(i = 0; i < count; i++) {
+			if (status[i] < 0)
+				errors++;
+		}
+	}
+	clock_t cpu_end = clock();
+	double elapsed = (touchmouse_time_nanos() - start) * 1e-9;
+	double cpu = (double)(cpu_end - cpu_start) / CLOCKS_PER_SEC;
+
+	uint64_t frames = 0;
+	uint64_t dropped = 0;
+	uint64_t worst_p99 = 0;
+	for(i = 0; i < count; i++) {
+		touchmouse_stats stats;
+		touchmouse_latency_stats latency;
+		if (touchmouse_get_stats(devs[i], &stats) == 0) {
+			frames += stats.frames_delivered;
+			dropped += stats.frames_dropped;
+		}
+		if (touchmouse_get_latency_stats(devs[i], &latency) == 0 && latency.p99_ns > worst_p99)
+			worst_p99 = latency.p99_ns;
+		touchmouse_close(devs[i]);
+	}
+	free(devs);
+	free(status);
+
+	double rate = base->frame_rate > 0 ? base->frame_rate : 125.0;
+	printf("%7d %10.0f %10.0f %6.1f%% %10.2f %10llu %6.2f%% %9.2f %6d\n",
+		count, count * rate, frames / elapsed, 100.0 * cpu / elapsed,
+		frames ? 1e6 * cpu / frames : 0.0, (unsigned long long)dropped,
+		frames + dropped ? 100.0 * dropped / (frames + dropped) : 0.0,
+		worst_p99 * 1e-6, errors);
+	fflush(stdout);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	touchmouse_synthetic_params params;
+	double seconds = 5;
+	int *counts = (int*)malloc(argc * sizeof(int));
+	int count_count = 0;
+	int i;
+	memset(&params, 0, sizeof(params));
+	for(i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			params.frame_rate = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			seconds = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			params.backlog = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-i") == 0) {
+			params.idle = 1;
+		} else if (argv[i][0] != '-' && atoi(argv[i]) > 0) {
+			counts[count_count++] = atoi(argv[i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (touchmouse_init() != 0) {
+		fprintf(stderr, "Failed to initialize libtouchmouse, aborting\n");
+		return 1;
+	}
+	printf("%7s %10s %10s %7s %10s %10s %7s %9s %6s\n",
+		"devices", "target/s", "frames/s", "cpu", "us/frame", "dropped", "drop", "p99 ms", "errors");
+	if (count_count == 0) {
+		for(i = 0; i < (int)(sizeof(default_counts) / sizeof(default_counts[0])); i++)
+			run(default_counts[i], &params, seconds);
+	} else {
+		for(i = 0; i < count_count; i++)
+			run(counts[i], &params, seconds);
+	}
+	free(counts);
+	touchmouse_shutdown();
+	return 0;
+}
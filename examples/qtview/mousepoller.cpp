@@ -1,10 +1,12 @@
 #include "mousepoller.h"
 #include <QTimer>
+#include <QSocketNotifier>
 #include <libtouchmouse/libtouchmouse.h>
 #include <QDebug>
 
 MousePoller::MousePoller(int index, QObject* parent) : QObject(parent) {
 	touchmouse_okay = false;
+	notifier = NULL;
 	timer = new QTimer(this);
 	timer->setInterval(1);
 	connect(timer, SIGNAL(timeout()),
@@ -37,7 +39,7 @@ MousePoller::MousePoller(int index, QObject* parent) : QObject(parent) {
 		qDebug() << "Failed to open Touchmouse device";
 		return;
 	}
-	res = touchmouse_set_image_update_callback(dev, MousePoller::callback);
+	res = touchmouse_set_image_update_callback_ex(dev, MousePoller::callback);
 	if (res != 0) {
 		qDebug() << "Failed to set Touchmouse device to full updates mode";
 		return;
@@ -47,6 +49,13 @@ MousePoller::MousePoller(int index, QObject* parent) : QObject(parent) {
 		qDebug() << "Failed to set device userdata";
 		return;
 	}
+	int fd = touchmouse_get_pollable_fd(dev);
+	if (fd >= 0) {
+		notifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+		notifier->setEnabled(false);
+		connect(notifier, SIGNAL(activated(int)),
+				this, SLOT(pollMouse()));
+	}
 	touchmouse_okay = true;
 }
 
@@ -55,26 +64,34 @@ MousePoller::~MousePoller() {
 	touchmouse_shutdown();
 }
 
-void MousePoller::callback(touchmouse_callback_info *cbdata) {
+void MousePoller::callback(const touchmouse_callback_info_ex *cbdata) {
 	//qDebug() << "static callback triggered";
 	MousePoller* poller = static_cast<MousePoller*>(cbdata->userdata);
 	poller->memberCallback(cbdata);
 }
 
-void MousePoller::memberCallback(touchmouse_callback_info *cbdata) {
+void MousePoller::memberCallback(const touchmouse_callback_info_ex *cbdata) {
 	QByteArray ba((const char*)cbdata->image, 195);
-	// TODO: aggregate timestamps using mouse clock for precision.
+	// Date the image by when it arrived, not by when we got around to it.
 	QDateTime timestamp = QDateTime::currentDateTime();
+	if (cbdata->last_arrival_ns) {
+		uint64_t age = touchmouse_time_nanos() - cbdata->last_arrival_ns;
+		timestamp = timestamp.addMSecs(-(qint64)(age / 1000000));
+	}
 	emit mouseUpdate(ba, timestamp);
 }
 
 void MousePoller::pollMouse() {
 	int res;
-	res = touchmouse_process_events_timeout(dev, 0);
+	res = touchmouse_process_pending_events(dev);
 	if (res < 0) {
-		if (res != -1) // -1 is returned on recoverable errors, -2 is a fatal hid_read failure
+		if (res != -1) { // -1 is returned on recoverable errors, -2 is a fatal hid_read failure
 			// TODO: make an error enumeration
 			touchmouse_okay = false;
+			// The descriptor stays readable once the device is gone.
+			if (notifier)
+				notifier->setEnabled(false);
+		}
 	}
 }
 
@@ -87,7 +104,10 @@ void MousePoller::startPolling() {
 			touchmouse_okay = false;
 			return;
 		}
-		timer->start();
+		if (notifier)
+			notifier->setEnabled(true);
+		else
+			timer->start();
 	} else {
 		qDebug() << "MousePoller::startPolling() called, but libtouchmouse not okay";
 	}
@@ -102,7 +122,10 @@ void MousePoller::stopPolling() {
 			touchmouse_okay = false;
 			return;
 		}
-		timer->stop();
+		if (notifier)
+			notifier->setEnabled(false);
+		else
+			timer->stop();
 	} else {
 		qDebug() << "MousePoller::stopPolling() called, but libtouchmouse not okay";
 	}
@@ -7,14 +7,15 @@
 #include <libtouchmouse/libtouchmouse.h>
 
 class QTimer;
+class QSocketNotifier;
 
 class MousePoller : public QObject {
 	Q_OBJECT
 public:
 	MousePoller(int index = 0, QObject* parent = 0);
 	~MousePoller();
-	static void callback(touchmouse_callback_info *cbdata);
-	void memberCallback(touchmouse_callback_info* cbdata);
+	static void callback(const touchmouse_callback_info_ex *cbdata);
+	void memberCallback(const touchmouse_callback_info_ex* cbdata);
 
 public slots:
 	void startPolling();
@@ -26,6 +27,9 @@ signals:
 
 private:
 	QTimer* timer;
+	// Wakes us when the mouse has reports waiting; we only fall back to
+	// polling on the timer when the platform has no file descriptor for it.
+	QSocketNotifier* notifier;
 	touchmouse_device *dev;
 	bool touchmouse_okay;
 };
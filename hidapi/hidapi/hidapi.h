@@ -79,6 +79,42 @@ extern "C" {
 		};
 
 
+		/** What to do with a new input report when a device's input
+		    report queue is full. */
+		typedef enum {
+			/** Discard the oldest queued report (the default). */
+			HID_QUEUE_DROP_OLDEST = 0,
+			/** Discard the report that just arrived. */
+			HID_QUEUE_DROP_NEWEST = 1,
+			/** Discard the oldest frame: the oldest queued report and
+			    every queued report after it with the same frame key
+			    (see hid_set_input_queue()). If that was every queued
+			    report, the rest of that frame is discarded as it
+			    arrives too. */
+			HID_QUEUE_DROP_OLDEST_FRAME = 2,
+		} hid_queue_policy;
+
+		/** Counters describing a device's input report queue. */
+		struct hid_input_queue_stats {
+			/** Input reports received from the device */
+			unsigned long long reports_received;
+			/** Reports discarded by HID_QUEUE_DROP_OLDEST */
+			unsigned long long dropped_oldest;
+			/** Reports discarded by HID_QUEUE_DROP_NEWEST */
+			unsigned long long dropped_newest;
+			/** Frames discarded by HID_QUEUE_DROP_OLDEST_FRAME */
+			unsigned long long frames_dropped;
+			/** Reports in the frames discarded by
+			    HID_QUEUE_DROP_OLDEST_FRAME */
+			unsigned long long frame_reports_dropped;
+			/** Current queue capacity, in reports */
+			unsigned int capacity;
+			/** Reports queued right now */
+			unsigned int queued;
+			/** Most reports ever queued at once */
+			unsigned int high_water;
+		};
+
 		/** @brief Initialize the HIDAPI library.
 
 			This function initializes the HIDAPI library. Calling it is not
@@ -139,6 +175,47 @@ extern "C" {
 		*/
 		void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *devs);
 
+		/** @brief Set how many input transfers are kept submitted at once.
+
+			While a transfer is being processed, the next one is
+			already waiting on the device, so that no polling
+			interval is missed. Reports are still returned in the
+			order they were sent. Applies to devices opened after
+			the call. The default is 1.
+
+			Only supported by the Linux libusb backend.
+
+			@ingroup API
+			@param count Number of transfers, from 1 to 64.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_read_transfer_count(int count);
+
+		/** @brief Share event handling threads between devices.
+
+			By default each open device gets a thread of its own to
+			handle its USB events. With a count above 0, devices
+			opened afterwards are all serviced by the same @p count
+			threads instead, so the number of threads stays the
+			same however many devices are open. Only one thread
+			handles events at a time; any others stand by in case
+			it is descheduled. The threads are started when the
+			first such device is opened, and stopped when the last
+			one is closed.
+
+			Only supported by the Linux libusb backend.
+
+			@ingroup API
+			@param count Number of shared threads, from 0 to 8. 0
+				gives each device its own thread again.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_event_threads(int count);
+
 		/** @brief Open a HID device using a Vendor ID (VID), Product ID
 			(PID) and optionally a serial number.
 
@@ -220,6 +297,33 @@ extern "C" {
 		*/
 		int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds);
 
+		/** @brief Read an Input report from a HID device with timeout,
+			and find out when it arrived.
+
+			Works like hid_read_timeout(), but also reports when the
+			report reached the host: when its USB transfer completed,
+			for the libusb backend, or when it was read from the
+			kernel, for hidraw. The time is in nanoseconds on
+			CLOCK_MONOTONIC. Reports that wait in the input queue
+			keep the time they arrived.
+
+			Arrival times are only known on Linux; elsewhere they
+			are always 0.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data A buffer to put the read data into.
+			@param length The number of bytes to read.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+			@param arrival_ns Set to the arrival time of the report
+				read, or 0 if none was read or the time is unknown.
+
+			@returns
+				This function returns the actual number of bytes read and
+				-1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_timestamped(hid_device *dev, unsigned char *data, size_t length, int milliseconds, unsigned long long *arrival_ns);
+
 		/** @brief Read an Input report from a HID device.
 
 			Input reports are returned
@@ -259,6 +363,71 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_set_nonblocking(hid_device *device, int nonblock);
 
+		/** @brief Configure a device's input report queue.
+
+			Input reports are queued as they arrive until they are
+			read. When the queue is full, @p policy decides which
+			report is discarded. Reports already queued are kept
+			when the capacity changes.
+
+			This must be called from the thread that reads from
+			the device (or while no thread is reading).
+
+			Only supported by the Linux libusb backend.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param capacity Number of reports to queue (rounded up to
+				a power of two), or 0 to keep the current capacity.
+			@param policy What to discard when the queue is full.
+			@param frame_key_offset For HID_QUEUE_DROP_OLDEST_FRAME,
+				the offset of the byte that identifies which frame a
+				report belongs to: consecutive reports with the same
+				Report ID and the same value at this offset form one
+				frame. -1 if reports don't form frames.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_input_queue(hid_device *device, size_t capacity, hid_queue_policy policy, int frame_key_offset);
+
+		/** @brief Get the counters for a device's input report queue.
+
+			Only supported by the Linux libusb backend.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param stats Filled in with the current counters.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_input_queue_stats(hid_device *device, struct hid_input_queue_stats *stats);
+
+		/** @brief Get a file descriptor to poll for input reports.
+
+			The descriptor becomes readable when input reports are
+			queued, so it can be added to poll(), epoll or any
+			event loop. Don't read from it; call hid_read() (in
+			nonblocking mode) until it returns 0 instead, which also
+			makes it unreadable again. It also becomes readable if
+			the device is disconnected, in which case hid_read()
+			returns -1.
+
+			The descriptor belongs to the device and is closed by
+			hid_close().
+
+			Only supported on Linux.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns the file descriptor, or -1 on
+				error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_pollable_fd(hid_device *device);
+
 		/** @brief Send a Feature report to the device.
 
 			Feature reports are sent over the Control endpoint as a
@@ -38,8 +38,10 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <wchar.h>
 
 /* GNU / LibUSB */
@@ -66,11 +68,71 @@ Linux/libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
+/* Atomic operations on the input report queue indexes. */
+#define ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define ATOMIC_CAS(p, expected, desired) \
+	__atomic_compare_exchange_n(p, expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+/* Number of input reports queued before the overflow policy kicks in,
+   unless changed with hid_set_input_queue(). Capacities are always rounded
+   up to a power of two. */
+#define INPUT_QUEUE_CAPACITY 32
+#define INPUT_QUEUE_MAX_CAPACITY 65536
+
+/* Limit on hid_set_read_transfer_count(). */
+#define MAX_READ_TRANSFERS 64
+
+/* Limit on hid_set_event_threads(). */
+#define MAX_EVENT_THREADS 8
+
+/* libusb_interrupt_event_handler() appeared in libusb 1.0.21. Without it,
+   the shared event threads wake up once a second to check whether they
+   should stop. */
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+#endif
+
+/* Queue counters. All but queued are only ever written by read_callback();
+   queued is also lowered by the reader as it takes reports. Any thread may
+   read them, which is how hid_get_input_queue_stats() avoids touching the
+   rings themselves. */
+#define STAT_ADD(dev, field, n) __atomic_fetch_add(&(dev)->queue_stats.field, n, __ATOMIC_RELAXED)
+#define STAT_SUB(dev, field, n) __atomic_fetch_sub(&(dev)->queue_stats.field, n, __ATOMIC_RELAXED)
+#define STAT_LOAD(dev, field) __atomic_load_n(&(dev)->queue_stats.field, __ATOMIC_RELAXED)
+#define STAT_STORE(dev, field, v) __atomic_store_n(&(dev)->queue_stats.field, v, __ATOMIC_RELAXED)
+
+/* One slot in the ring of input reports received from the device. */
 struct input_report {
-	uint8_t *data;
+	uint8_t *data; /* Points into input_queue::storage */
 	size_t len;
-	struct input_report *next;
+	/* When the transfer carrying it completed (see monotonic_nanos()) */
+	unsigned long long arrival;
+};
+
+/* One of the interrupt transfers kept submitted on the input endpoint. */
+struct read_transfer {
+	struct libusb_transfer *transfer;
+	hid_device *dev;
+	/* Finished, but waiting for transfers submitted before it. */
+	int completed;
+	/* Couldn't be submitted again, so it will never complete. */
+	int retired;
+	/* When it finished */
+	unsigned long long completed_at;
+};
+
+/* A ring of input reports. The indexes increase forever and are reduced
+   modulo the capacity only to find a slot. */
+struct input_queue {
+	struct input_report *slots;
+	uint8_t *storage;
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int tail;
+	/* The ring that replaced this one, if hid_set_input_queue() has been
+	   called. Once set, nothing more is added to this ring. */
+	struct input_queue *next;
 };
 
 
@@ -95,21 +157,74 @@ struct hid_device_ {
 	int blocking; /* boolean */
 	
 	/* Read thread objects */
+	int shared_events; /* Events are handled by the shared event threads, not thread */
 	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	pthread_mutex_t mutex; /* Used only to sleep on condition */
 	pthread_cond_t condition;
 	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	int shutdown_thread;
-	struct libusb_transfer *transfer;
 
-	/* List of received input reports. */
-	struct input_report *input_reports;
+	/* Interrupt transfers on the input endpoint. They are resubmitted in
+	   the order they complete, which is always the order of
+	   transfers[], so next_transfer is the one whose report must be
+	   queued next. Only touched by the event thread, apart from
+	   hid_close() cancelling them. */
+	struct read_transfer *transfers;
+	int num_transfers;
+	int next_transfer;
+	int transfers_in_flight;
+
+	/* Received input reports. read_callback() is the only producer and
+	   hid_read_timeout() the only consumer, so neither needs a lock: the
+	   producer alone advances a ring's tail, and its head is advanced
+	   with a compare-and-swap, by the consumer as it takes reports and by
+	   the producer when the ring is full and it drops old ones.
+	   The producer fills input_queue. The consumer drains read_queue,
+	   which is the same ring unless hid_set_input_queue() has swapped in
+	   a new one, in which case the consumer finishes the old rings
+	   (linked through input_queue::next) before moving on. */
+	struct input_queue *input_queue;
+	struct input_queue *read_queue;
+	/* The ring the producer is adding to right now, if any. */
+	struct input_queue *producer_queue;
+	hid_queue_policy queue_policy;
+	int frame_key_offset;
+	/* Frame whose remaining reports are being discarded, or -1. */
+	int dropping_frame_key;
+	struct hid_input_queue_stats queue_stats;
+	/* Number of readers sleeping on condition. */
+	int waiters;
+
+	/* eventfd which is readable while reports are queued (see
+	   hid_get_pollable_fd()), and whether it has been signalled since
+	   the reader last found the queue empty. */
+	int event_fd;
+	int event_fd_signalled;
 };
 
 static int initialized = 0;
 
+/* Number of transfers submitted at once by devices opened from now on. */
+static int read_transfer_count = 1;
+
+/* Number of shared event threads for devices opened from now on, or 0 if
+   each device should have a read thread of its own. */
+static int event_thread_count = 0;
+
+/* Threads handling libusb events for every device opened with
+   shared_events set. They are started by the first such device and
+   stopped when the last one is closed. */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_t threads[MAX_EVENT_THREADS];
+	int num_threads;
+	int users;
+	int shutdown;
+} event_pool = { PTHREAD_MUTEX_INITIALIZER, };
+
 uint16_t get_usb_code_for_current_locale(void);
-static int return_data(hid_device *dev, unsigned char *data, size_t length);
+
+static void free_input_queue(struct input_queue *q);
 
 static hid_device *new_hid_device(void)
 {
@@ -124,8 +239,21 @@ static hid_device *new_hid_device(void)
 	dev->serial_index = 0;
 	dev->blocking = 1;
 	dev->shutdown_thread = 0;
-	dev->transfer = NULL;
-	dev->input_reports = NULL;
+	dev->shared_events = 0;
+	dev->transfers = NULL;
+	dev->num_transfers = 0;
+	dev->next_transfer = 0;
+	dev->transfers_in_flight = 0;
+	dev->input_queue = NULL;
+	dev->read_queue = NULL;
+	dev->producer_queue = NULL;
+	dev->queue_policy = HID_QUEUE_DROP_OLDEST;
+	dev->frame_key_offset = -1;
+	dev->dropping_frame_key = -1;
+	memset(&dev->queue_stats, 0, sizeof(dev->queue_stats));
+	dev->waiters = 0;
+	dev->event_fd = -1;
+	dev->event_fd_signalled = 0;
 	
 	pthread_mutex_init(&dev->mutex, NULL);
 	pthread_cond_init(&dev->condition, NULL);
@@ -141,6 +269,16 @@ static void free_hid_device(hid_device *dev)
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
+	if (dev->event_fd >= 0)
+		close(dev->event_fd);
+
+	/* Free the input report queues */
+	while (dev->read_queue) {
+		struct input_queue *next = dev->read_queue->next;
+		free_input_queue(dev->read_queue);
+		dev->read_queue = next;
+	}
+
 	/* Free the device itself */
 	free(dev);
 }
@@ -615,86 +753,376 @@ hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, wchar
 	return handle;
 }
 
-static void read_callback(struct libusb_transfer *transfer)
+/* Allocate an input report ring. Every slot is big enough for a whole
+   packet from the input endpoint, so nothing is allocated per report. */
+static struct input_queue *alloc_input_queue(hid_device *dev, unsigned int capacity)
 {
-	hid_device *dev = transfer->user_data;
-	
-	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+	unsigned int i;
+	size_t slot_size = dev->input_ep_max_packet_size;
+	struct input_queue *q = calloc(1, sizeof(struct input_queue));
 
-		struct input_report *rpt = malloc(sizeof(*rpt));
-		rpt->data = malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
+	if (!q)
+		return NULL;
+	q->slots = calloc(capacity, sizeof(struct input_report));
+	q->storage = malloc(capacity * slot_size);
+	if (!q->slots || !q->storage) {
+		free_input_queue(q);
+		return NULL;
+	}
+	for (i = 0; i < capacity; i++)
+		q->slots[i].data = q->storage + i * slot_size;
+	q->capacity = capacity;
+	return q;
+}
 
+static void free_input_queue(struct input_queue *q)
+{
+	free(q->slots);
+	free(q->storage);
+	free(q);
+}
+
+/* Identify the frame a report belongs to, for HID_QUEUE_DROP_OLDEST_FRAME.
+   Returns -1 if the report doesn't carry a frame key. */
+static int frame_key(hid_device *dev, const uint8_t *data, size_t len)
+{
+	int offset = ATOMIC_LOAD(&dev->frame_key_offset);
+	if (offset < 0 || (size_t)offset >= len)
+		return -1;
+	return (data[0] << 8) | data[offset];
+}
+
+/* Drop the oldest frame in the ring: the oldest report plus every report
+   right after it with the same frame key. Returns the key of the frame
+   dropped, or -1. */
+static int drop_oldest_frame(hid_device *dev, struct input_queue *q)
+{
+	unsigned int head = ATOMIC_LOAD(&q->head);
+	int key = -1;
+	unsigned int dropped = 0;
+
+	while (head != q->tail) {
+		struct input_report *rpt = &q->slots[head & (q->capacity - 1)];
+		int k = frame_key(dev, rpt->data, rpt->len);
+		if (dropped > 0 && (k < 0 || k != key))
+			break;
+		if (!ATOMIC_CAS(&q->head, &head, head + 1)) {
+			/* The reader took this report first. If we hadn't
+			   dropped anything yet, that made room already. */
+			if (dropped == 0)
+				return -1;
+			continue;
+		}
+		head++;
+		if (dropped == 0)
+			key = k;
+		dropped++;
+	}
+	if (dropped > 0) {
+		STAT_SUB(dev, queued, dropped);
+		STAT_ADD(dev, frames_dropped, 1);
+		STAT_ADD(dev, frame_reports_dropped, dropped);
+	}
+	return key;
+}
+
+/* Find the ring to add reports to, and tell hid_set_input_queue() that we
+   are using it. */
+static struct input_queue *acquire_producer_queue(hid_device *dev)
+{
+	struct input_queue *q;
+	do {
+		q = ATOMIC_LOAD(&dev->input_queue);
+		ATOMIC_STORE(&dev->producer_queue, q);
+	} while (q != ATOMIC_LOAD(&dev->input_queue));
+	return q;
+}
+
+/* Make the pollable fd readable, unless it already is. */
+static void signal_event_fd(hid_device *dev)
+{
+	if (dev->event_fd >= 0 && !__atomic_exchange_n(&dev->event_fd_signalled, 1, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if (write(dev->event_fd, &one, sizeof(one)) < 0)
+			LOG("can't signal event fd: %d\n", errno);
+	}
+}
+
+/* Add a report to the ring, applying the overflow policy if it is full.
+   Called only from read_callback(). */
+static void push_report(hid_device *dev, const uint8_t *data, size_t len, unsigned long long arrival)
+{
+	struct input_queue *q = acquire_producer_queue(dev);
+	hid_queue_policy policy = ATOMIC_LOAD(&dev->queue_policy);
+	unsigned int tail = q->tail;
+	unsigned int head = ATOMIC_LOAD(&q->head);
+	struct input_report *rpt;
+	unsigned int queued;
+	int key = -1;
+
+	STAT_ADD(dev, reports_received, 1);
+
+	if (policy == HID_QUEUE_DROP_OLDEST_FRAME) {
+		key = frame_key(dev, data, len);
+		if (key >= 0 && key == dev->dropping_frame_key) {
+			/* More of a frame that was already dropped. */
+			STAT_ADD(dev, frame_reports_dropped, 1);
+			goto out;
+		}
+		dev->dropping_frame_key = -1;
+	}
+
+	if (tail - head >= q->capacity) {
+		switch (policy) {
+		case HID_QUEUE_DROP_NEWEST:
+			STAT_ADD(dev, dropped_newest, 1);
+			goto out;
+		case HID_QUEUE_DROP_OLDEST_FRAME:
+			if (key >= 0) {
+				if (drop_oldest_frame(dev, q) == key) {
+					/* The whole ring was this frame, so this
+					   report and any more of it must go too. */
+					dev->dropping_frame_key = key;
+					STAT_ADD(dev, frame_reports_dropped, 1);
+					goto out;
+				}
+				break;
+			}
+			/* A report with no frame key can't tell us which
+			   frame to drop, so just drop the oldest report. */
+			/* FALLTHROUGH */
+		case HID_QUEUE_DROP_OLDEST:
+		default:
+			/* Drop the oldest report. This way we don't stall
+			   the device if the user never reads anything from
+			   it. If this fails, the reader just took that report,
+			   which makes room too. */
+			if (ATOMIC_CAS(&q->head, &head, head + 1)) {
+				STAT_SUB(dev, queued, 1);
+				STAT_ADD(dev, dropped_oldest, 1);
+			}
+			break;
+		}
+	}
+
+	rpt = &q->slots[tail & (q->capacity - 1)];
+	memcpy(rpt->data, data, len);
+	rpt->len = len;
+	rpt->arrival = arrival;
+	/* Counted before it can be taken, so the count never goes below
+	   zero. */
+	queued = STAT_ADD(dev, queued, 1) + 1;
+	ATOMIC_STORE(&q->tail, tail + 1);
+
+	if (queued > STAT_LOAD(dev, high_water))
+		STAT_STORE(dev, high_water, queued);
+
+out:
+	ATOMIC_STORE(&dev->producer_queue, NULL);
+
+	signal_event_fd(dev);
+
+	/* Wake the reader if it is (or is about to be) sleeping. */
+	if (ATOMIC_LOAD(&dev->waiters)) {
 		pthread_mutex_lock(&dev->mutex);
+		pthread_cond_signal(&dev->condition);
+		pthread_mutex_unlock(&dev->mutex);
+	}
+}
+
+/* Copy the oldest report in the ring q into data, and its arrival time into
+   arrival, and remove it. Returns the number of bytes copied, or -1 if the
+   ring is empty. */
+static int pop_from_queue(hid_device *dev, struct input_queue *q, unsigned char *data, size_t length, unsigned long long *arrival)
+{
+	unsigned int head = ATOMIC_LOAD(&q->head);
+
+	while (head != ATOMIC_LOAD(&q->tail)) {
+		struct input_report *rpt = &q->slots[head & (q->capacity - 1)];
+		size_t len = (length < rpt->len)? length: rpt->len;
+		if (len > 0)
+			memcpy(data, rpt->data, len);
+		*arrival = rpt->arrival;
+		/* If the producer dropped this report while we were copying
+		   it, the slot may have been overwritten and the copy is
+		   garbage. In that case the swap fails, head is reloaded, and
+		   we try again with the new oldest report. */
+		if (ATOMIC_CAS(&q->head, &head, head + 1)) {
+			STAT_SUB(dev, queued, 1);
+			return len;
+		}
+	}
+	return -1;
+}
+
+/* Take the oldest queued report, moving on to a replacement ring once an
+   old one is used up. Returns the number of bytes copied, or -1 if there
+   are no reports queued. */
+static int pop_report(hid_device *dev, unsigned char *data, size_t length, unsigned long long *arrival)
+{
+	for (;;) {
+		struct input_queue *q = dev->read_queue;
+		int res = pop_from_queue(dev, q, data, length, arrival);
+		if (res >= 0 || !q->next)
+			return res;
+		/* hid_set_input_queue() only returns once the producer has
+		   stopped using a replaced ring, so it's safe to free. */
+		dev->read_queue = q->next;
+		free_input_queue(q);
+	}
+}
+
+/* Count a transfer as in flight and submit it, undoing the count if the
+   submission fails. Counting first means the count never drops to zero
+   while a transfer can still call read_callback(). Returns the result of
+   libusb_submit_transfer(). */
+static int submit_read_transfer(hid_device *dev, struct libusb_transfer *transfer)
+{
+	int res;
+	__atomic_fetch_add(&dev->transfers_in_flight, 1, __ATOMIC_SEQ_CST);
+	res = libusb_submit_transfer(transfer);
+	if (res != 0)
+		__atomic_fetch_sub(&dev->transfers_in_flight, 1, __ATOMIC_SEQ_CST);
+	return res;
+}
+
+/* Queue the reports of transfers that have completed, in the order they
+   were submitted, and submit each transfer again. */
+static void deliver_completed_transfers(hid_device *dev)
+{
+	int skipped = 0;
+
+	while (skipped < dev->num_transfers) {
+		struct read_transfer *rt = &dev->transfers[dev->next_transfer];
+		struct libusb_transfer *transfer = rt->transfer;
+
+		if (rt->retired) {
+			/* It will never complete, so don't wait for it. */
+			dev->next_transfer = (dev->next_transfer + 1) % dev->num_transfers;
+			skipped++;
+			continue;
+		}
+		if (!rt->completed)
+			break;
+		rt->completed = 0;
+		skipped = 0;
 
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			pthread_cond_signal(&dev->condition);
+		if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+			push_report(dev, transfer->buffer, transfer->actual_length, rt->completed_at);
+		}
+		else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+			//LOG("Timeout (normal)\n");
 		}
 		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
+			LOG("Unknown transfer code: %d\n", transfer->status);
+		}
+
+		dev->next_transfer = (dev->next_transfer + 1) % dev->num_transfers;
+
+		/* Re-submit the transfer object. */
+		if (!dev->shutdown_thread) {
+			int res = submit_read_transfer(dev, transfer);
+			if (res != 0) {
+				LOG("can't resubmit read transfer: %d\n", res);
+				rt->retired = 1;
 			}
-			cur->next = rpt;
-			
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
-			}			
 		}
-		pthread_mutex_unlock(&dev->mutex);
 	}
-	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		dev->shutdown_thread = 1;
-		return;
+}
+
+/* Reading has stopped for good: make reads fail from now on, and wake
+   anyone waiting for a report so they find out. */
+static void stop_reading(hid_device *dev)
+{
+	dev->shutdown_thread = 1;
+	/* Let anyone polling find out that reads now fail. */
+	signal_event_fd(dev);
+	/* With no read thread of its own to do it when it stops, wake any
+	   threads waiting on data. */
+	if (dev->shared_events) {
+		pthread_mutex_lock(&dev->mutex);
+		pthread_cond_broadcast(&dev->condition);
+		pthread_mutex_unlock(&dev->mutex);
 	}
-	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-		dev->shutdown_thread = 1;
-		return;
+}
+
+/* Like pop_report(), but when the queue turns out to be empty, make the
+   pollable fd unreadable again. */
+static int take_report(hid_device *dev, unsigned char *data, size_t length, unsigned long long *arrival)
+{
+	int res = pop_report(dev, data, length, arrival);
+	if (res < 0 && ATOMIC_LOAD(&dev->event_fd_signalled)) {
+		uint64_t count;
+		if (read(dev->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			LOG("can't clear event fd: %d\n", errno);
+		ATOMIC_STORE(&dev->event_fd_signalled, 0);
+		/* A report may have arrived after we looked, and found the fd
+		   still signalled. Look again, so it isn't left unnoticed. */
+		res = pop_report(dev, data, length, arrival);
+		if (res >= 0)
+			signal_event_fd(dev);
 	}
-	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
-		//LOG("Timeout (normal)\n");
+	return res;
+}
+
+/* The time in nanoseconds on the monotonic clock, which is what
+   hid_read_timestamped() reports arrival times on. */
+static unsigned long long monotonic_nanos(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void read_callback(struct libusb_transfer *transfer)
+{
+	struct read_transfer *rt = transfer->user_data;
+	hid_device *dev = rt->dev;
+
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED ||
+	    transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		stop_reading(dev);
 	}
 	else {
-		LOG("Unknown transfer code: %d\n", transfer->status);
+		/* A transfer can finish before the ones submitted ahead of it
+		   (if they time out, say). Hold on to it until they're done,
+		   so that reports are always queued in order. */
+		rt->completed_at = monotonic_nanos();
+		rt->completed = 1;
+		deliver_completed_transfers(dev);
+
+		/* This transfer is still counted, so a count of one means no
+		   transfer could be submitted again, and nothing more will
+		   ever be read. */
+		if (!dev->shutdown_thread && ATOMIC_LOAD(&dev->transfers_in_flight) == 1)
+			stop_reading(dev);
 	}
-	
-	/* Re-submit the transfer object. */
-	libusb_submit_transfer(transfer);
+
+	/* This must be the last thing done with the device: once the count
+	   reaches zero, hid_close() may free it. */
+	__atomic_fetch_sub(&dev->transfers_in_flight, 1, __ATOMIC_SEQ_CST);
 }
 
 
+/* Make the first submissions. Further submissions are made from inside
+   read_callback() */
+static void submit_read_transfers(hid_device *dev)
+{
+	int i;
+	for (i = 0; i < dev->num_transfers; i++) {
+		if (submit_read_transfer(dev, dev->transfers[i].transfer) != 0)
+			dev->transfers[i].retired = 1;
+	}
+	if (ATOMIC_LOAD(&dev->transfers_in_flight) == 0)
+		stop_reading(dev);
+}
+
 static void *read_thread(void *param)
 {
 	hid_device *dev = param;
-	unsigned char *buf;
-	const size_t length = dev->input_ep_max_packet_size;
+	int i;
 
-	/* Set up the transfer object. */
-	buf = malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
-		dev->device_handle,
-		dev->input_endpoint,
-		buf,
-		length,
-		read_callback,
-		dev,
-		5000/*timeout*/);
-	
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
+	submit_read_transfers(dev);
 
 	// Notify the main thread that the read thread is up and running.
 	pthread_barrier_wait(&dev->barrier);
@@ -709,11 +1137,15 @@ static void *read_thread(void *param)
 		}
 	}
 	
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	if (libusb_cancel_transfer(dev->transfer) == 0) {
-		/* The transfer was cancelled, so wait for its completion. */
-		libusb_handle_events(NULL);
+	/* Cancel any transfers that may be pending. This call will fail
+	   for transfers which aren't pending, but that's OK. */
+	for (i = 0; i < dev->num_transfers; i++)
+		libusb_cancel_transfer(dev->transfers[i].transfer);
+
+	/* Wait for the cancelled transfers to complete. */
+	while (ATOMIC_LOAD(&dev->transfers_in_flight) > 0) {
+		if (libusb_handle_events(NULL) < 0)
+			break;
 	}
 	
 	/* Now that the read thread is stopping, Wake any threads which are
@@ -725,8 +1157,8 @@ static void *read_thread(void *param)
 	pthread_cond_broadcast(&dev->condition);
 	pthread_mutex_unlock(&dev->mutex);
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
+	/* The transfer objects and their buffers are cleaned up in
+	   hid_close(). They are not cleaned up here because this thread
 	   could end either due to a disconnect or due to a user
 	   call to hid_close(). In both cases the objects can be safely
 	   cleaned up after the call to pthread_join() (in hid_close()), but
@@ -736,6 +1168,128 @@ static void *read_thread(void *param)
 	return NULL;
 }
 
+/* Allocate the interrupt transfers for the input endpoint, each with its
+   own buffer. Returns -1 if out of memory. */
+static int alloc_read_transfers(hid_device *dev, int count)
+{
+	int i;
+	const size_t length = dev->input_ep_max_packet_size;
+
+	dev->transfers = calloc(count, sizeof(struct read_transfer));
+	if (!dev->transfers)
+		return -1;
+	dev->num_transfers = count;
+	for (i = 0; i < count; i++) {
+		struct read_transfer *rt = &dev->transfers[i];
+		unsigned char *buf = malloc(length);
+		rt->dev = dev;
+		rt->transfer = libusb_alloc_transfer(0);
+		if (!buf || !rt->transfer) {
+			free(buf);
+			return -1;
+		}
+		libusb_fill_interrupt_transfer(rt->transfer,
+			dev->device_handle,
+			dev->input_endpoint,
+			buf,
+			length,
+			read_callback,
+			rt,
+			5000/*timeout*/);
+	}
+	return 0;
+}
+
+static void free_read_transfers(hid_device *dev)
+{
+	int i;
+	for (i = 0; i < dev->num_transfers; i++) {
+		if (dev->transfers[i].transfer) {
+			free(dev->transfers[i].transfer->buffer);
+			libusb_free_transfer(dev->transfers[i].transfer);
+		}
+	}
+	free(dev->transfers);
+	dev->transfers = NULL;
+	dev->num_transfers = 0;
+}
+
+/* Body of each shared event thread. */
+static void *event_thread(void *param)
+{
+	(void)param;
+	while (!ATOMIC_LOAD(&event_pool.shutdown)) {
+		struct timeval tv = { 1, 0 };
+		int res = libusb_handle_events_timeout_completed(NULL, &tv, &event_pool.shutdown);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			/* There was an error. Break out of this loop. */
+			LOG("event thread stopping: %d\n", res);
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void stop_event_threads(void)
+{
+	int i;
+	ATOMIC_STORE(&event_pool.shutdown, 1);
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+	libusb_interrupt_event_handler(NULL);
+#endif
+	for (i = 0; i < event_pool.num_threads; i++)
+		pthread_join(event_pool.threads[i], NULL);
+	event_pool.num_threads = 0;
+}
+
+/* Register a device with the shared event threads, starting them if it is
+   the first. */
+static int event_pool_acquire(void)
+{
+	int res = 0;
+	pthread_mutex_lock(&event_pool.mutex);
+	if (event_pool.users == 0) {
+		ATOMIC_STORE(&event_pool.shutdown, 0);
+		while (event_pool.num_threads < event_thread_count) {
+			if (pthread_create(&event_pool.threads[event_pool.num_threads], NULL, event_thread, NULL) != 0) {
+				stop_event_threads();
+				res = -1;
+				break;
+			}
+			event_pool.num_threads++;
+		}
+	}
+	if (res == 0)
+		event_pool.users++;
+	pthread_mutex_unlock(&event_pool.mutex);
+	return res;
+}
+
+/* Unregister a device, stopping the event threads if it was the last. */
+static void event_pool_release(void)
+{
+	pthread_mutex_lock(&event_pool.mutex);
+	if (--event_pool.users == 0)
+		stop_event_threads();
+	pthread_mutex_unlock(&event_pool.mutex);
+}
+
+int HID_API_EXPORT hid_set_event_threads(int count)
+{
+	if (count < 0 || count > MAX_EVENT_THREADS)
+		return -1;
+	event_thread_count = count;
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_read_transfer_count(int count)
+{
+	if (count < 1 || count > MAX_READ_TRANSFERS)
+		return -1;
+	read_transfer_count = count;
+	return 0;
+}
+
 
 hid_device * HID_API_EXPORT hid_open_path(const char *path)
 {
@@ -845,10 +1399,42 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							}
 						}
 						
-						pthread_create(&dev->thread, NULL, read_thread, dev);
-						
-						// Wait here for the read thread to be initialized.
-						pthread_barrier_wait(&dev->barrier);
+						dev->input_queue = alloc_input_queue(dev, INPUT_QUEUE_CAPACITY);
+						dev->read_queue = dev->input_queue;
+						dev->queue_stats.capacity = INPUT_QUEUE_CAPACITY;
+						dev->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+						if (!dev->input_queue || dev->event_fd < 0 ||
+						    alloc_read_transfers(dev, read_transfer_count) < 0) {
+							LOG("can't allocate input report queue\n");
+							free_read_transfers(dev);
+							free(dev_path);
+							libusb_release_interface(dev->device_handle, dev->interface);
+							libusb_close(dev->device_handle);
+							good_open = 0;
+							break;
+						}
+
+						if (event_thread_count > 0) {
+							/* Let the shared event threads handle
+							   this device's transfers. */
+							if (event_pool_acquire() < 0) {
+								LOG("can't start event threads\n");
+								free_read_transfers(dev);
+								free(dev_path);
+								libusb_release_interface(dev->device_handle, dev->interface);
+								libusb_close(dev->device_handle);
+								good_open = 0;
+								break;
+							}
+							dev->shared_events = 1;
+							submit_read_transfers(dev);
+						}
+						else {
+							pthread_create(&dev->thread, NULL, read_thread, dev);
+
+							// Wait here for the read thread to be initialized.
+							pthread_barrier_wait(&dev->barrier);
+						}
 						
 					}
 					free(dev_path);
@@ -923,32 +1509,18 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	}
 }
 
-/* Helper function, to simplify hid_read().
-   This should be called with dev->mutex locked. */
-static int return_data(hid_device *dev, unsigned char *data, size_t length)
-{
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
-	size_t len = (length < rpt->len)? length: rpt->len;
-	if (len > 0)
-		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
-	return len;
-}
-
 static void cleanup_mutex(void *param)
 {
 	hid_device *dev = param;
+	__atomic_sub_fetch(&dev->waiters, 1, __ATOMIC_SEQ_CST);
 	pthread_mutex_unlock(&dev->mutex);
 }
 
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+int HID_API_EXPORT hid_read_timestamped(hid_device *dev, unsigned char *data, size_t length, int milliseconds, unsigned long long *arrival_ns)
 {
 	int bytes_read = -1;
+	struct timespec ts;
 
 #if 0
 	int transferred;
@@ -957,36 +1529,24 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	return transferred;
 #endif
 
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cleanup_push(&cleanup_mutex, dev);
-
 	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
-		goto ret;
-	}
-	
+	*arrival_ns = 0;
+	bytes_read = take_report(dev, data, length, arrival_ns);
+	if (bytes_read >= 0)
+		return bytes_read;
+
 	if (dev->shutdown_thread) {
 		/* This means the device has been disconnected.
 		   An error code of -1 should be returned. */
-		bytes_read = -1;
-		goto ret;
+		return -1;
 	}
-	
-	if (milliseconds == -1) {
-		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
-			pthread_cond_wait(&dev->condition, &dev->mutex);
-		}
-		if (dev->input_reports) {
-			bytes_read = return_data(dev, data, length);
-		}
+
+	if (milliseconds == 0) {
+		/* Purely non-blocking */
+		return 0;
 	}
-	else if (milliseconds > 0) {
-		/* Non-blocking, but called with timeout. */
-		int res;
-		struct timespec ts;
+
+	if (milliseconds > 0) {
 		clock_gettime(CLOCK_REALTIME, &ts);
 		ts.tv_sec += milliseconds / 1000;
 		ts.tv_nsec += (milliseconds % 1000) * 1000000;
@@ -994,43 +1554,56 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 			ts.tv_sec++;
 			ts.tv_nsec -= 1000000000L;
 		}
-		
-		while (!dev->input_reports && !dev->shutdown_thread) {
+	}
+
+	/* Sleep until a report arrives. Announce that we're waiting before
+	   checking the ring once more, so that read_callback() either sees
+	   us waiting and signals, or its report is seen by that check. */
+	pthread_mutex_lock(&dev->mutex);
+	__atomic_add_fetch(&dev->waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	while ((bytes_read = pop_report(dev, data, length, arrival_ns)) < 0) {
+		int res;
+		if (dev->shutdown_thread) {
+			bytes_read = -1;
+			break;
+		}
+		if (milliseconds == -1) {
+			/* Blocking */
+			res = pthread_cond_wait(&dev->condition, &dev->mutex);
+		}
+		else {
+			/* Non-blocking, but called with timeout. */
 			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
-			if (res == 0) {
-				if (dev->input_reports) {
-					bytes_read = return_data(dev, data, length);
-					break;
-				}
-				
-				/* If we're here, there was a spurious wake up
-				   or the read thread was shutdown. Run the
-				   loop again (ie: don't break). */
-			}
-			else if (res == ETIMEDOUT) {
-				/* Timed out. */
+		}
+		if (res == ETIMEDOUT) {
+			/* Timed out, unless a report slipped in at the last moment. */
+			bytes_read = pop_report(dev, data, length, arrival_ns);
+			if (bytes_read < 0)
 				bytes_read = 0;
-				break;
-			}
-			else {
-				/* Error. */
-				bytes_read = -1;
-				break;
-			}
+			break;
 		}
-	}
-	else {
-		/* Purely non-blocking */
-		bytes_read = 0;
+		else if (res != 0) {
+			/* Error. */
+			bytes_read = -1;
+			break;
+		}
+		/* If we're here, there was a spurious wake up, a new report, or
+		   the read thread was shutdown. Run the loop again. */
 	}
 
-ret:
-	pthread_mutex_unlock(&dev->mutex);
-	pthread_cleanup_pop(0);
+	pthread_cleanup_pop(1);
 
 	return bytes_read;
 }
 
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	unsigned long long arrival;
+	return hid_read_timestamped(dev, data, length, milliseconds, &arrival);
+}
+
 int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 {
 	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
@@ -1044,6 +1617,67 @@ int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 }
 
 
+int HID_API_EXPORT hid_set_input_queue(hid_device *dev, size_t capacity, hid_queue_policy policy, int frame_key_offset)
+{
+	struct input_queue *old = dev->input_queue;
+
+	switch (policy) {
+	case HID_QUEUE_DROP_OLDEST:
+	case HID_QUEUE_DROP_NEWEST:
+	case HID_QUEUE_DROP_OLDEST_FRAME:
+		break;
+	default:
+		return -1;
+	}
+	if (capacity > INPUT_QUEUE_MAX_CAPACITY)
+		return -1;
+
+	ATOMIC_STORE(&dev->frame_key_offset, frame_key_offset);
+	ATOMIC_STORE(&dev->queue_policy, policy);
+
+	if (capacity > 0) {
+		unsigned int rounded = 1;
+		struct input_queue *q;
+		while (rounded < capacity)
+			rounded <<= 1;
+		if (rounded != old->capacity) {
+			q = alloc_input_queue(dev, rounded);
+			if (!q)
+				return -1;
+			/* Reports already queued stay in the old ring, and are
+			   read before any in the new one. */
+			old->next = q;
+			ATOMIC_STORE(&dev->input_queue, q);
+			STAT_STORE(dev, capacity, rounded);
+			/* Wait for the producer to finish any report it was
+			   adding to the old ring. It doesn't block, so this is
+			   short. */
+			while (ATOMIC_LOAD(&dev->producer_queue) == old)
+				sched_yield();
+		}
+	}
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_input_queue_stats(hid_device *dev, struct hid_input_queue_stats *stats)
+{
+	stats->reports_received = STAT_LOAD(dev, reports_received);
+	stats->dropped_oldest = STAT_LOAD(dev, dropped_oldest);
+	stats->dropped_newest = STAT_LOAD(dev, dropped_newest);
+	stats->frames_dropped = STAT_LOAD(dev, frames_dropped);
+	stats->frame_reports_dropped = STAT_LOAD(dev, frame_reports_dropped);
+	stats->high_water = STAT_LOAD(dev, high_water);
+	stats->capacity = STAT_LOAD(dev, capacity);
+	stats->queued = STAT_LOAD(dev, queued);
+	return 0;
+}
+
+
+int HID_API_EXPORT hid_get_pollable_fd(hid_device *dev)
+{
+	return dev->event_fd;
+}
+
 int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
 	int res = -1;
@@ -1107,19 +1741,35 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
+	int i;
+
 	if (!dev)
 		return;
 	
 	/* Cause read_thread() to stop. */
 	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
-
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+	for (i = 0; i < dev->num_transfers; i++)
+		libusb_cancel_transfer(dev->transfers[i].transfer);
+
+	if (dev->shared_events) {
+		/* Wait for the cancelled transfers to complete. Whichever
+		   thread handles their events, read_callback() only stops
+		   counting a transfer as in flight once it's done with the
+		   device, so nothing touches it after this. */
+		while (ATOMIC_LOAD(&dev->transfers_in_flight) > 0) {
+			struct timeval tv = { 1, 0 };
+			if (libusb_handle_events_timeout_completed(NULL, &tv, NULL) < 0)
+				break;
+		}
+		event_pool_release();
+	}
+	else {
+		/* Wait for read_thread() to end. */
+		pthread_join(dev->thread, NULL);
+	}
 	
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+	/* Clean up the Transfer objects allocated in hid_open_path(). */
+	free_read_transfers(dev);
 	
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1127,13 +1777,7 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 	
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
-	
+	/* The queue of received reports is freed along with the device. */
 	free_hid_device(dev);
 }
 
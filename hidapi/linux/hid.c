@@ -0,0 +1,716 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ Alan Ott
+ Signal 11 Software
+
+ 8/22/2009
+ Linux Version - 6/2/2010
+ hidraw Version (sysfs enumeration, epoll reads)
+
+ Copyright 2009, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        http://github.com/signal11/hidapi .
+********************************************************/
+
+/*
+This backend talks to the kernel's hidraw driver through /dev/hidrawN,
+instead of detaching the kernel driver and going through libusb. The
+kernel already queues input reports for each open hidraw file, so there is
+no read thread: hid_read_timeout() reads straight from a nonblocking file
+descriptor, and sleeps in epoll_wait() when nothing is queued. Devices are
+found by walking /sys/class/hidraw, so no libudev is needed either.
+*/
+
+#define _GNU_SOURCE // needed for wcsdup() before glibc 2.10
+
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <locale.h>
+#include <errno.h>
+#include <time.h>
+
+/* Unix */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <wchar.h>
+
+/* Linux */
+#include <linux/hidraw.h>
+#include <linux/input.h>
+
+#include "hidapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef DEBUG_PRINTF
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define LOG(...) do {} while (0)
+#endif
+
+#define SYSFS_HIDRAW_DIR "/sys/class/hidraw"
+
+struct hid_device_ {
+	/* The /dev/hidrawN file, opened nonblocking */
+	int device_handle;
+	/* Used to sleep until device_handle is readable */
+	int epoll_fd;
+
+	/* Whether blocking reads are used */
+	int blocking; /* boolean */
+
+	/* String descriptors, read from sysfs when the device is opened */
+	wchar_t *manufacturer_string;
+	wchar_t *product_string;
+	wchar_t *serial_number;
+};
+
+static int initialized = 0;
+
+static hid_device *new_hid_device(void)
+{
+	hid_device *dev = calloc(1, sizeof(hid_device));
+	dev->device_handle = -1;
+	dev->epoll_fd = -1;
+	dev->blocking = 1;
+	dev->manufacturer_string = NULL;
+	dev->product_string = NULL;
+	dev->serial_number = NULL;
+
+	return dev;
+}
+
+static void free_hid_device(hid_device *dev)
+{
+	if (dev->epoll_fd >= 0)
+		close(dev->epoll_fd);
+	if (dev->device_handle >= 0)
+		close(dev->device_handle);
+	free(dev->manufacturer_string);
+	free(dev->product_string);
+	free(dev->serial_number);
+	free(dev);
+}
+
+/* Get bytes from a HID Report Descriptor.
+   Only call with a num_bytes of 0, 1, 2, or 4. */
+static uint32_t get_bytes(uint8_t *rpt, size_t len, size_t num_bytes, size_t cur)
+{
+	/* Return if there aren't enough bytes. */
+	if (cur + num_bytes >= len)
+		return 0;
+
+	if (num_bytes == 0)
+		return 0;
+	else if (num_bytes == 1) {
+		return rpt[cur+1];
+	}
+	else if (num_bytes == 2) {
+		return (rpt[cur+2] * 256 + rpt[cur+1]);
+	}
+	else if (num_bytes == 4) {
+		return (rpt[cur+4] * 0x01000000 +
+		        rpt[cur+3] * 0x00010000 +
+		        rpt[cur+2] * 0x00000100 +
+		        rpt[cur+1] * 0x00000001);
+	}
+	else
+		return 0;
+}
+
+/* Retrieves the device's Usage Page and Usage from the report
+   descriptor. The algorithm is simple, as it just returns the first
+   Usage and Usage Page that it finds in the descriptor.
+   The return value is 0 on success and -1 on failure. */
+static int get_usage(uint8_t *report_descriptor, size_t size,
+                     unsigned short *usage_page, unsigned short *usage)
+{
+	size_t i = 0;
+	int size_code;
+	int data_len, key_size;
+	int usage_found = 0, usage_page_found = 0;
+
+	while (i < size) {
+		int key = report_descriptor[i];
+		int key_cmd = key & 0xfc;
+
+		if ((key & 0xf0) == 0xf0) {
+			/* This is a Long Item. The next byte contains the
+			   length of the data section (value) for this key.
+			   See the HID specification, version 1.11, section
+			   6.2.2.3, titled "Long Items." */
+			if (i+1 < size)
+				data_len = report_descriptor[i+1];
+			else
+				data_len = 0; /* malformed report */
+			key_size = 3;
+		}
+		else {
+			/* This is a Short Item. The bottom two bits of the
+			   key contain the size code for the data section
+			   (value) for this key.  Refer to the HID
+			   specification, version 1.11, section 6.2.2.2,
+			   titled "Short Items." */
+			size_code = key & 0x3;
+			data_len = (size_code == 3)? 4: size_code;
+			key_size = 1;
+		}
+
+		if (key_cmd == 0x4) {
+			*usage_page  = get_bytes(report_descriptor, size, data_len, i);
+			usage_page_found = 1;
+		}
+		if (key_cmd == 0x8) {
+			*usage = get_bytes(report_descriptor, size, data_len, i);
+			usage_found = 1;
+		}
+
+		if (usage_page_found && usage_found)
+			return 0; /* success */
+
+		/* Skip over this key and it's associated data */
+		i += data_len + key_size;
+	}
+
+	return -1; /* failure */
+}
+
+/* Read a whole sysfs file into buf. Returns the length read, or -1 if the
+   file doesn't exist. */
+static int read_sysfs_file(const char *dir, const char *name, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	int fd;
+	ssize_t len;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path))
+		return -1;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size);
+	close(fd);
+	return len;
+}
+
+/* Read a sysfs attribute into buf as a string, without the trailing
+   newline. Returns its length, or -1 if the attribute doesn't exist. */
+static int read_sysfs_attr(const char *dir, const char *name, char *buf, size_t size)
+{
+	int len = read_sysfs_file(dir, name, buf, size - 1);
+	if (len < 0)
+		return -1;
+	while (len > 0 && buf[len-1] == '\n')
+		len--;
+	buf[len] = '\0';
+	return len;
+}
+
+/* Find the value of key in a uevent file's KEY=value lines. */
+static int read_uevent_value(const char *dir, const char *key, char *buf, size_t size)
+{
+	char uevent[4096];
+	char *line, *saveptr = NULL;
+	size_t key_len = strlen(key);
+
+	if (read_sysfs_attr(dir, "uevent", uevent, sizeof(uevent)) < 0)
+		return -1;
+	for (line = strtok_r(uevent, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+		if (strncmp(line, key, key_len) == 0 && line[key_len] == '=') {
+			snprintf(buf, size, "%s", line + key_len + 1);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static wchar_t *utf8_to_wchar_t(const char *utf8)
+{
+	wchar_t *ret = NULL;
+	size_t wlen = mbstowcs(NULL, utf8, 0);
+	if (wlen == (size_t)-1)
+		return wcsdup(L"");
+	ret = calloc(wlen+1, sizeof(wchar_t));
+	mbstowcs(ret, utf8, wlen+1);
+	ret[wlen] = 0;
+	return ret;
+}
+
+/* Copy a string attribute into a new wide string, or NULL if it's absent. */
+static wchar_t *get_sysfs_string(const char *dir, const char *name)
+{
+	char buf[256];
+	if (!dir || read_sysfs_attr(dir, name, buf, sizeof(buf)) < 0)
+		return NULL;
+	return utf8_to_wchar_t(buf);
+}
+
+/* The sysfs directories describing one hidraw node. usb_intf and usb_dev
+   are empty for devices which aren't on USB. */
+struct sysfs_dirs {
+	char hid[PATH_MAX];
+	char usb_intf[PATH_MAX];
+	char usb_dev[PATH_MAX];
+	unsigned int bus_type;
+	unsigned short vendor_id;
+	unsigned short product_id;
+};
+
+/* Look up the sysfs directories of the hidraw node called name (hidrawN).
+   Returns -1 if it isn't a hidraw node. */
+static int get_sysfs_dirs(const char *name, struct sysfs_dirs *dirs)
+{
+	char link[PATH_MAX];
+	char hid_id[64];
+	char *slash;
+
+	snprintf(link, sizeof(link), SYSFS_HIDRAW_DIR "/%s/device", name);
+	if (!realpath(link, dirs->hid))
+		return -1;
+	if (read_uevent_value(dirs->hid, "HID_ID", hid_id, sizeof(hid_id)) < 0)
+		return -1;
+	if (sscanf(hid_id, "%x:%hx:%hx", &dirs->bus_type, &dirs->vendor_id, &dirs->product_id) != 3)
+		return -1;
+
+	dirs->usb_intf[0] = '\0';
+	dirs->usb_dev[0] = '\0';
+	if (dirs->bus_type == BUS_USB) {
+		/* The HID device sits below the USB interface, which sits
+		   below the USB device. */
+		strcpy(dirs->usb_intf, dirs->hid);
+		slash = strrchr(dirs->usb_intf, '/');
+		if (slash)
+			*slash = '\0';
+		strcpy(dirs->usb_dev, dirs->usb_intf);
+		slash = strrchr(dirs->usb_dev, '/');
+		if (slash)
+			*slash = '\0';
+	}
+	return 0;
+}
+
+int HID_API_EXPORT hid_init(void)
+{
+	if (!initialized) {
+		/* Needed for the multibyte conversion of strings */
+		setlocale(LC_ALL,"");
+		initialized = 1;
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_exit(void)
+{
+	initialized = 0;
+
+	return 0;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	DIR *dir;
+	struct dirent *entry;
+
+	struct hid_device_info *root = NULL; // return object
+	struct hid_device_info *cur_dev = NULL;
+
+	if (!initialized)
+		hid_init();
+
+	dir = opendir(SYSFS_HIDRAW_DIR);
+	if (!dir)
+		return NULL;
+	while ((entry = readdir(dir)) != NULL) {
+		struct sysfs_dirs dirs;
+		struct hid_device_info *tmp;
+		char buf[4096];
+		int len;
+
+		if (entry->d_name[0] == '.')
+			continue;
+		if (get_sysfs_dirs(entry->d_name, &dirs) < 0)
+			continue;
+
+		/* Check the VID/PID against the arguments */
+		if (!((vendor_id == 0x0 && product_id == 0x0) ||
+		      (vendor_id == dirs.vendor_id && product_id == dirs.product_id)))
+			continue;
+
+		/* VID/PID match. Create the record. */
+		tmp = calloc(1, sizeof(struct hid_device_info));
+		if (cur_dev) {
+			cur_dev->next = tmp;
+		}
+		else {
+			root = tmp;
+		}
+		cur_dev = tmp;
+
+		/* Fill out the record */
+		cur_dev->next = NULL;
+		snprintf(buf, sizeof(buf), "/dev/%s", entry->d_name);
+		cur_dev->path = strdup(buf);
+
+		/* VID/PID */
+		cur_dev->vendor_id = dirs.vendor_id;
+		cur_dev->product_id = dirs.product_id;
+
+		if (dirs.bus_type == BUS_USB) {
+			/* Serial Number, Manufacturer and Product strings */
+			cur_dev->serial_number = get_sysfs_string(dirs.usb_dev, "serial");
+			cur_dev->manufacturer_string = get_sysfs_string(dirs.usb_dev, "manufacturer");
+			cur_dev->product_string = get_sysfs_string(dirs.usb_dev, "product");
+
+			/* Release Number */
+			if (read_sysfs_attr(dirs.usb_dev, "bcdDevice", buf, sizeof(buf)) > 0)
+				cur_dev->release_number = strtoul(buf, NULL, 16);
+
+			/* Interface Number */
+			if (read_sysfs_attr(dirs.usb_intf, "bInterfaceNumber", buf, sizeof(buf)) > 0)
+				cur_dev->interface_number = strtoul(buf, NULL, 16);
+		}
+		else {
+			/* Bluetooth and friends only give us a name and
+			   a unique ID. */
+			if (read_uevent_value(dirs.hid, "HID_UNIQ", buf, sizeof(buf)) == 0)
+				cur_dev->serial_number = utf8_to_wchar_t(buf);
+			if (read_uevent_value(dirs.hid, "HID_NAME", buf, sizeof(buf)) == 0)
+				cur_dev->product_string = utf8_to_wchar_t(buf);
+			cur_dev->interface_number = -1;
+		}
+
+		/* Usage Page and Usage. Unlike with libusb, the report
+		   descriptor can be read without disturbing the device. */
+		len = read_sysfs_file(dirs.hid, "report_descriptor", buf, sizeof(buf));
+		if (len > 0) {
+			unsigned short page = 0, usage = 0;
+			get_usage((uint8_t*)buf, len, &page, &usage);
+			cur_dev->usage_page = page;
+			cur_dev->usage = usage;
+		}
+	}
+	closedir(dir);
+
+	return root;
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	struct hid_device_info *d = devs;
+	while (d) {
+		struct hid_device_info *next = d->next;
+		free(d->path);
+		free(d->serial_number);
+		free(d->manufacturer_string);
+		free(d->product_string);
+		free(d);
+		d = next;
+	}
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, wchar_t *serial_number)
+{
+	struct hid_device_info *devs, *cur_dev;
+	const char *path_to_open = NULL;
+	hid_device *handle = NULL;
+
+	devs = hid_enumerate(vendor_id, product_id);
+	cur_dev = devs;
+	while (cur_dev) {
+		if (cur_dev->vendor_id == vendor_id &&
+		    cur_dev->product_id == product_id) {
+			if (serial_number) {
+				if (cur_dev->serial_number &&
+				    wcscmp(serial_number, cur_dev->serial_number) == 0) {
+					path_to_open = cur_dev->path;
+					break;
+				}
+			}
+			else {
+				path_to_open = cur_dev->path;
+				break;
+			}
+		}
+		cur_dev = cur_dev->next;
+	}
+
+	if (path_to_open) {
+		/* Open the device */
+		handle = hid_open_path(path_to_open);
+	}
+
+	hid_free_enumeration(devs);
+
+	return handle;
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	hid_device *dev;
+	struct epoll_event ev;
+	struct sysfs_dirs dirs;
+	const char *name;
+
+	if (!initialized)
+		hid_init();
+
+	dev = new_hid_device();
+
+	/* OPEN HERE */
+	dev->device_handle = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (dev->device_handle < 0) {
+		LOG("can't open device %s: %s\n", path, strerror(errno));
+		free_hid_device(dev);
+		return NULL;
+	}
+
+	dev->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (dev->epoll_fd < 0) {
+		LOG("can't create epoll instance: %s\n", strerror(errno));
+		free_hid_device(dev);
+		return NULL;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (epoll_ctl(dev->epoll_fd, EPOLL_CTL_ADD, dev->device_handle, &ev) < 0) {
+		LOG("can't watch device: %s\n", strerror(errno));
+		free_hid_device(dev);
+		return NULL;
+	}
+
+	/* Store off the strings, since there's no descriptor index to go
+	   back to later. */
+	name = strrchr(path, '/');
+	name = name? name + 1: path;
+	if (get_sysfs_dirs(name, &dirs) == 0) {
+		if (dirs.bus_type == BUS_USB) {
+			dev->manufacturer_string = get_sysfs_string(dirs.usb_dev, "manufacturer");
+			dev->product_string = get_sysfs_string(dirs.usb_dev, "product");
+			dev->serial_number = get_sysfs_string(dirs.usb_dev, "serial");
+		}
+		else {
+			char buf[256];
+			if (read_uevent_value(dirs.hid, "HID_NAME", buf, sizeof(buf)) == 0)
+				dev->product_string = utf8_to_wchar_t(buf);
+			if (read_uevent_value(dirs.hid, "HID_UNIQ", buf, sizeof(buf)) == 0)
+				dev->serial_number = utf8_to_wchar_t(buf);
+		}
+	}
+
+	return dev;
+}
+
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int bytes_written;
+
+	/* hidraw wants the report ID in the first byte, or 0 for devices
+	   which don't use numbered reports, just like HIDAPI. */
+	bytes_written = write(dev->device_handle, data, length);
+
+	return bytes_written;
+}
+
+
+/* The time in nanoseconds on the monotonic clock, which is what
+   hid_read_timestamped() reports arrival times on. */
+static unsigned long long monotonic_nanos(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int HID_API_EXPORT hid_read_timestamped(hid_device *dev, unsigned char *data, size_t length, int milliseconds, unsigned long long *arrival_ns)
+{
+	*arrival_ns = 0;
+	for (;;) {
+		struct epoll_event ev;
+		int res;
+		ssize_t bytes_read = read(dev->device_handle, data, length);
+
+		/* hidraw doesn't say when the kernel got the report, so the
+		   best we can do is when we did. */
+		if (bytes_read > 0)
+			*arrival_ns = monotonic_nanos();
+		if (bytes_read >= 0)
+			return bytes_read;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EINPROGRESS) {
+			/* The device has gone away, most likely. */
+			return -1;
+		}
+
+		/* Nothing is queued. */
+		if (milliseconds == 0)
+			return 0;
+
+		/* Sleep until the kernel has a report for us. */
+		res = epoll_wait(dev->epoll_fd, &ev, 1, milliseconds);
+		if (res == 0)
+			return 0; /* Timed out */
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ev.events & (EPOLLERR | EPOLLHUP))
+			return -1;
+
+		/* Read what woke us, but don't wait again if someone else
+		   got to it first. */
+		milliseconds = 0;
+	}
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	unsigned long long arrival;
+	return hid_read_timestamped(dev, data, length, milliseconds, &arrival);
+}
+
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+	/* The file is always nonblocking; this only changes what hid_read()
+	   does when nothing is queued. */
+	dev->blocking = !nonblock;
+
+	return 0;
+}
+
+
+int HID_API_EXPORT hid_set_event_threads(int count)
+{
+	/* Not supported by this backend. It has no threads to share. */
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_read_transfer_count(int count)
+{
+	/* Not supported by this backend. The kernel keeps the endpoint
+	   polled. */
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_input_queue(hid_device *dev, size_t capacity, hid_queue_policy policy, int frame_key_offset)
+{
+	/* Not supported by this backend. Reports are queued by the
+	   kernel. */
+	return -1;
+}
+
+int HID_API_EXPORT hid_get_input_queue_stats(hid_device *dev, struct hid_input_queue_stats *stats)
+{
+	/* Not supported by this backend. */
+	return -1;
+}
+
+int HID_API_EXPORT hid_get_pollable_fd(hid_device *dev)
+{
+	/* The hidraw file itself is readable whenever reports are queued. */
+	return dev->device_handle;
+}
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int res;
+
+	res = ioctl(dev->device_handle, HIDIOCSFEATURE(length), data);
+	if (res < 0)
+		return -1;
+
+	return res;
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+	int res;
+
+	/* data[0] holds the report ID on the way in, and the report ID is
+	   returned in it too. */
+	res = ioctl(dev->device_handle, HIDIOCGFEATURE(length), data);
+	if (res < 0)
+		return -1;
+
+	return res;
+}
+
+
+void HID_API_EXPORT hid_close(hid_device *dev)
+{
+	if (!dev)
+		return;
+
+	/* Closing the file releases everything the kernel queued for us. */
+	free_hid_device(dev);
+}
+
+
+static int copy_string(const wchar_t *str, wchar_t *string, size_t maxlen)
+{
+	if (!str || maxlen == 0)
+		return -1;
+	wcsncpy(string, str, maxlen);
+	string[maxlen-1] = L'\0';
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+	return copy_string(dev->manufacturer_string, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_product_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+	return copy_string(dev->product_string, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+	return copy_string(dev->serial_number, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
+{
+	/* hidraw doesn't give access to arbitrary string descriptors. */
+	return -1;
+}
+
+
+HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
+{
+	return NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
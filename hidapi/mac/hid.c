@@ -946,6 +946,44 @@ int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 	return 0;
 }
 
+int HID_API_EXPORT hid_read_timestamped(hid_device *dev, unsigned char *data, size_t length, int milliseconds, unsigned long long *arrival_ns)
+{
+	/* Not supported by this backend: reads work, but arrival times are
+	   unknown. */
+	*arrival_ns = 0;
+	return hid_read_timeout(dev, data, length, milliseconds);
+}
+
+int HID_API_EXPORT hid_get_pollable_fd(hid_device *dev)
+{
+	/* Not supported by this backend. */
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_event_threads(int count)
+{
+	/* Not supported by this backend. */
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_read_transfer_count(int count)
+{
+	/* Not supported by this backend. */
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_input_queue(hid_device *dev, size_t capacity, hid_queue_policy policy, int frame_key_offset)
+{
+	/* Not supported by this backend. */
+	return -1;
+}
+
+int HID_API_EXPORT hid_get_input_queue_stats(hid_device *dev, struct hid_input_queue_stats *stats)
+{
+	/* Not supported by this backend. */
+	return -1;
+}
+
 int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
 	return set_report(dev, kIOHIDReportTypeFeature, data, length);
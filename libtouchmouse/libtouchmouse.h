@@ -1,6 +1,7 @@
 #ifndef __LIBTOUCHMOUSE_H__
 #define __LIBTOUCHMOUSE_H__
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef _WIN32
 	/// Win32 needs symbols exported.
@@ -23,6 +24,14 @@ struct touchmouse_device_;
 /// Opaque struct representing a handle to a particular TouchMouse device.
 typedef struct touchmouse_device_ touchmouse_device;
 
+struct touchmouse_decoder_;
+/// Opaque struct representing a standalone image decoder, not tied to any device.
+typedef struct touchmouse_decoder_ touchmouse_decoder;
+
+struct touchmouse_capture_;
+/// Opaque struct representing an indexed capture file opened for reading.
+typedef struct touchmouse_capture_ touchmouse_capture;
+
 struct touchmouse_device_info;
 /// Struct used for enumeration of devices.
 typedef struct touchmouse_device_info {
@@ -41,6 +50,44 @@ typedef struct touchmouse_callback_info {
 /// Callback declaration: void function that takes a pointer to a touchmouse_callback_info
 typedef void (*touchmouse_image_callback)(touchmouse_callback_info *cbinfo);
 
+/**
+ * Information provided in extended image update callbacks (see
+ * touchmouse_set_image_update_callback_ex()).
+ *
+ * Fields may be added to the end of this struct in later versions.  The
+ * library sets size to the size of the struct it filled in, so a program built
+ * against a newer header than the library should check that a field is present
+ * with TOUCHMOUSE_CALLBACK_INFO_HAS() before using it.
+ */
+typedef struct touchmouse_callback_info_ex {
+	size_t size;               /**< Size in bytes of the struct the library filled in */
+	void* userdata;            /**< User-controllable pointer, as in touchmouse_callback_info */
+	uint8_t* image;            /**< Pointer to 195 bytes of 8-bit greyscale image data (13 rows, 15 columns). */
+	uint8_t timestamp;         /**< Device-provided timestamp, as in touchmouse_callback_info */
+	uint64_t first_arrival_ns; /**< Host time at which the first report of this image arrived, in nanoseconds on the touchmouse_time_nanos() clock.  0 if unknown. */
+	uint64_t last_arrival_ns;  /**< Host time at which the last report of this image arrived.  0 if unknown. */
+	uint64_t device_time_ms;   /**< The device timestamp, unwrapped into a count of milliseconds that doesn't wrap around every 256, and carried on across restarts (see series) */
+	uint64_t sequence;         /**< Number of images delivered before this one.  Frames lost before reaching the library show up as unusually large steps in device_time_ms instead. */
+	uint64_t corrected_time_ns; /**< Host time of the image, from fitting the device clock to the arrival times of recent images: first_arrival_ns without the USB scheduling jitter.  On the touchmouse_time_nanos() clock; 0 if arrival times are unknown. */
+	uint64_t series;           /**< Number of times the device has restarted its clock, which it does when a new series of touches begins */
+} touchmouse_callback_info_ex;
+
+/// Whether the touchmouse_callback_info_ex at info includes field.
+#define TOUCHMOUSE_CALLBACK_INFO_HAS(info, field) \
+	((info)->size >= offsetof(touchmouse_callback_info_ex, field) + sizeof((info)->field))
+
+/// The current fit of a device's clock to the host clock
+typedef struct touchmouse_clock_estimate {
+	int samples;       /**< Images the fit is based on.  It starts again each time the device restarts its clock. */
+	double drift_ppm;  /**< How much faster the device clock runs than the host clock, in parts per million */
+	int64_t offset_ns; /**< Host time at which device_time_ms was 0 */
+	double jitter_ns;  /**< RMS distance of the arrival times from the fit */
+	uint64_t series;   /**< Number of times the device has restarted its clock */
+} touchmouse_clock_estimate;
+
+/// Extended callback declaration: void function that takes a pointer to a touchmouse_callback_info_ex
+typedef void (*touchmouse_image_callback_ex)(const touchmouse_callback_info_ex *cbinfo);
+
 /// A list of modes that the touchmouse can be placed in.
 typedef enum {
 	TOUCHMOUSE_DEFAULT = 0,   /**< Default mode when you plug the mouse in, no full image callbacks. */
@@ -48,6 +95,77 @@ typedef enum {
 	// Other modes may exist, I haven't played with the mouse enough yet.
 } touchmouse_mode;
 
+/// Ways the library can reassemble images from the compressed report stream.
+typedef enum {
+	TOUCHMOUSE_DECODE_BUFFERED = 0, /**< Collect the packed pixels, then scale and lay out the whole image at once (vectorized where supported). Default. */
+	TOUCHMOUSE_DECODE_IN_PLACE = 1, /**< Scale each pixel and write it to its final position as it arrives, with no intermediate buffer. */
+} touchmouse_decode_mode;
+
+/// What to throw away when a device's report queue is full.
+typedef enum {
+	TOUCHMOUSE_QUEUE_DROP_OLDEST = 0, /**< Discard the oldest queued report. Default. */
+	TOUCHMOUSE_QUEUE_DROP_NEWEST = 1, /**< Discard the report that just arrived. */
+	TOUCHMOUSE_QUEUE_DROP_FRAME = 2,  /**< Discard all the queued reports of the oldest image, so that losing reports costs as few images as possible. */
+} touchmouse_queue_policy;
+
+/// How a replay device (see touchmouse_open_replay()) paces the reports it serves.
+typedef enum {
+	TOUCHMOUSE_REPLAY_RECORDED = 0, /**< Serve each report when it is due, keeping the gaps they were recorded with. Default. */
+	TOUCHMOUSE_REPLAY_FAST = 1,     /**< Serve reports as fast as they are read. */
+} touchmouse_replay_pacing;
+
+/// Settings for a synthetic device (see touchmouse_open_synthetic()).  Fields left zero take their defaults.
+typedef struct touchmouse_synthetic_params {
+	double frame_rate; /**< Images per second while something is touching.  Default 125. */
+	uint32_t seed;     /**< Seed for the made-up touches; devices with the same seed see the same ones.  Default 1. */
+	int idle;          /**< Nonzero to go quiet for a while between touches, as a real mouse does. */
+	int backlog;       /**< Frame periods an image may wait unread before it is dropped.  Default 4. */
+} touchmouse_synthetic_params;
+
+/// Counters describing a device's report queue
+typedef struct touchmouse_queue_stats {
+	uint64_t reports_received;      /**< Reports received from the device */
+	uint64_t dropped_oldest;        /**< Reports discarded by TOUCHMOUSE_QUEUE_DROP_OLDEST */
+	uint64_t dropped_newest;        /**< Reports discarded by TOUCHMOUSE_QUEUE_DROP_NEWEST */
+	uint64_t frames_dropped;        /**< Images discarded by TOUCHMOUSE_QUEUE_DROP_FRAME */
+	uint64_t frame_reports_dropped; /**< Reports belonging to the images discarded by TOUCHMOUSE_QUEUE_DROP_FRAME */
+	uint32_t capacity;              /**< Current queue capacity, in reports */
+	uint32_t queued;                /**< Reports waiting to be processed right now */
+	uint32_t high_water;            /**< Most reports ever waiting at once */
+} touchmouse_queue_stats;
+
+/// Where to find one image in an indexed capture (see touchmouse_capture_get_frame())
+typedef struct touchmouse_capture_frame {
+	uint64_t host_time_ns;   /**< When the image's first report arrived, on the touchmouse_time_nanos() clock of the recording host */
+	uint64_t device_time_ms; /**< The image's device timestamp, unwrapped as in touchmouse_callback_info_ex */
+	uint32_t series;         /**< Number of times the device had restarted its clock, as in touchmouse_callback_info_ex */
+	uint32_t report_count;   /**< Reports belonging to the image, including any others that arrived among them */
+	uint64_t offset;         /**< Position in the file of the image's first record */
+} touchmouse_capture_frame;
+
+/// Counters describing what the library has done with a device's reports
+typedef struct touchmouse_stats {
+	uint64_t reports_received; /**< Reports read from the device and passed to the decoder */
+	uint64_t reports_ignored;  /**< Reports that weren't image data (other report IDs, or the wrong size) */
+	uint64_t decoder_resets;   /**< Partly decoded images abandoned because a report from a different image arrived */
+	uint64_t decoder_errors;   /**< Reports that couldn't be decoded */
+	uint64_t frames_delivered; /**< Images passed to the callback */
+	uint64_t reports_dropped;  /**< Reports discarded because the report queue was full (Linux only) */
+	uint64_t frames_dropped;   /**< Whole images discarded by TOUCHMOUSE_QUEUE_DROP_FRAME (Linux only) */
+} touchmouse_stats;
+
+/// Summary of how long images took to reach the callback after their last report arrived
+typedef struct touchmouse_latency_stats {
+	uint64_t count;   /**< Images measured */
+	uint64_t min_ns;  /**< Shortest latency, in nanoseconds */
+	uint64_t mean_ns; /**< Mean latency */
+	uint64_t p50_ns;  /**< Median latency */
+	uint64_t p90_ns;  /**< 90th percentile latency */
+	uint64_t p99_ns;  /**< 99th percentile latency */
+	uint64_t p999_ns; /**< 99.9th percentile latency */
+	uint64_t max_ns;  /**< Longest latency */
+} touchmouse_latency_stats;
+
 /// Enumeration of library message logging levels
 typedef enum {
 	TOUCHMOUSE_LOG_FATAL = 0, /**< Log level for crashing/non-recoverable errors */
@@ -60,6 +178,32 @@ typedef enum {
 	TOUCHMOUSE_LOG_FLOOD,     /**< Log level for EVERYTHING. May significantly slow performance. */
 } touchmouse_loglevel;
 
+/// Most arguments captured from a single log message; any more are dropped.
+#define TOUCHMOUSE_LOG_MAX_ARGS 8
+/// Space for the strings captured from a single log message.
+#define TOUCHMOUSE_LOG_STRING_SPACE 96
+
+/// One argument captured from a log message.  Which member is set depends on the conversion in the format string.
+typedef union touchmouse_log_arg {
+	int64_t i;     /**< Integer and character conversions, and '*' widths and precisions */
+	double d;      /**< Floating-point conversions */
+	const void* p; /**< %p */
+	uint32_t s;    /**< %s and %ls: offset of a copy of the string (converted to narrow, and perhaps truncated) in touchmouse_log_record::strings */
+} touchmouse_log_arg;
+
+/// A log message, captured without formatting it.
+typedef struct touchmouse_log_record {
+	touchmouse_loglevel level;                     /**< Level the message was logged at */
+	uint64_t timestamp;                            /**< Monotonic time at which the message was logged, in nanoseconds */
+	const char* format;                            /**< printf-style format string.  These are string literals, so the pointer also identifies the message. */
+	int arg_count;                                 /**< Number of arguments captured */
+	touchmouse_log_arg args[TOUCHMOUSE_LOG_MAX_ARGS]; /**< The arguments, in order */
+	char strings[TOUCHMOUSE_LOG_STRING_SPACE];     /**< Copies of the string arguments */
+} touchmouse_log_record;
+
+/// Log callback declaration: receives each log message, and the userdata given to touchmouse_set_log_callback().
+typedef void (*touchmouse_log_callback)(const touchmouse_log_record *record, void *userdata);
+
 // Library initialization/destruction routines
 
 /**
@@ -89,6 +233,89 @@ TOUCHMOUSEAPI int touchmouse_shutdown(void);
  */
 TOUCHMOUSEAPI void touchmouse_set_log_level(touchmouse_loglevel level);
 
+/**
+ * Send log messages to a callback instead of printing them to stderr.
+ *
+ * Messages are passed as binary records: the format string and captured
+ * arguments, which touchmouse_format_log_record() can turn into text.  Unless
+ * touchmouse_set_log_async() is enabled, the callback runs on whichever thread
+ * logged the message.  Set this before opening devices, not while other
+ * threads may be logging.
+ *
+ * @param callback Function to call with each message, or NULL to go back to printing to stderr.
+ * @param userdata Passed to the callback.
+ */
+TOUCHMOUSEAPI void touchmouse_set_log_callback(touchmouse_log_callback callback, void *userdata);
+
+/**
+ * Log asynchronously.
+ *
+ * When enabled, logging only captures the message into an in-memory ring
+ * buffer, without taking locks, formatting anything or touching stdio.  A
+ * background thread empties the ring, passing each record to the log
+ * callback, or printing it to stderr if there is none.  If messages are
+ * logged faster than the thread keeps up, the ring fills and further messages
+ * are dropped (see touchmouse_get_log_records_dropped()).
+ *
+ * Disabling logs everything still in the ring before returning.  So does
+ * touchmouse_shutdown().
+ *
+ * @param enabled 1 to log asynchronously, 0 to log on the calling thread.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_set_log_async(int enabled);
+
+/**
+ * Count the log messages dropped because the asynchronous log ring was full.
+ *
+ * @return the number of messages dropped since the library was loaded
+ */
+TOUCHMOUSEAPI uint64_t touchmouse_get_log_records_dropped(void);
+
+/**
+ * Format a log record as text, as printf() would have.
+ *
+ * @param record Record to format.
+ * @param buf Buffer to write the text to.  Always NUL-terminated; truncated if too small.
+ * @param size Size of buf in bytes.
+ *
+ * @return the length of the text written, not counting the NUL
+ */
+TOUCHMOUSEAPI int touchmouse_format_log_record(const touchmouse_log_record *record, char *buf, int size);
+
+/**
+ * Set how many USB transfers each device keeps waiting for reports at once.
+ *
+ * With more than one, the next transfer is already submitted while one is
+ * being processed, so the device is never left unpolled if the thread that
+ * handles USB events is slow to run.  Reports are still processed in order.
+ * Applies to devices opened after the call.  The default is 1.
+ *
+ * Only supported on Linux.
+ *
+ * @param count Number of transfers, from 1 to 64.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_set_read_transfer_count(int count);
+
+/**
+ * Service every device with the same few threads.
+ *
+ * Normally each open device gets its own thread to handle USB events.  With
+ * many mice on one host, those threads just take turns, so it is cheaper to
+ * have a fixed number of threads handle the events of every device.
+ * Applies to devices opened after the call.
+ *
+ * Only supported on Linux.
+ *
+ * @param count Number of shared threads, from 1 to 8, or 0 to give each device its own thread (the default).
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_set_event_threads(int count);
+
 /**
  * Enumerate all currently-connected TouchMouse devices.
  *
@@ -114,6 +341,56 @@ TOUCHMOUSEAPI void touchmouse_free_enumeration(touchmouse_device_info *devs);
  */
 TOUCHMOUSEAPI int touchmouse_open(touchmouse_device **dev, touchmouse_device_info *dev_info);
 
+/**
+ * Open a replay device: one that serves the reports from a capture file (see
+ * touchmouse_start_recording()) instead of reading them from a TouchMouse.
+ * Everything downstream of reading works the same, so replay devices can
+ * stand in for real ones in tests and benchmarks.
+ *
+ * Once the capture is used up, processing events fails as it does when a
+ * device is unplugged.  Device modes are accepted and ignored, and the report
+ * queue can't be configured.
+ *
+ * Setting the TOUCHMOUSE_REPLAY environment variable to the path of a capture
+ * makes touchmouse_enumerate_devices() list a replay device after any real
+ * ones, so that programs can use it unchanged.  It is paced as recorded,
+ * unless TOUCHMOUSE_REPLAY_PACING is "fast".
+ *
+ * @param dev Address of a touchmouse_device* to populate with the new device.
+ * @param path Capture file to replay.
+ * @param pacing How fast to serve the reports.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_open_replay(touchmouse_device **dev, const char *path, touchmouse_replay_pacing pacing);
+
+/**
+ * Open a synthetic device: one that makes up touch images (fingers moving
+ * about, now and then a palm) and sends them as the reports a TouchMouse
+ * would, at a steady frame rate.  It needs no hardware, so any number can be
+ * opened to find out how many mice a host can keep up with.
+ *
+ * The touches are made up when the device is opened and repeat every 256
+ * images, so reading one costs little more than copying out its reports.
+ * On Linux the device has a descriptor for touchmouse_get_pollable_fd(),
+ * which becomes readable as each image is due.
+ *
+ * Images that go unread for longer than the backlog are dropped, and counted
+ * in touchmouse_get_stats() as frames_dropped.  Device modes are accepted
+ * and ignored, and the report queue can't be configured.
+ *
+ * Setting the TOUCHMOUSE_SYNTHETIC environment variable to a number makes
+ * touchmouse_enumerate_devices() list that many synthetic devices after any
+ * real ones, each with its own seed.  TOUCHMOUSE_SYNTHETIC_RATE sets their
+ * frame rate.
+ *
+ * @param dev Address of a touchmouse_device* to populate with the new device.
+ * @param params Settings for the device, or NULL for the defaults.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_open_synthetic(touchmouse_device **dev, const touchmouse_synthetic_params *params);
+
 /**
  * Close the device referred to by the provided handle.
  *
@@ -135,6 +412,18 @@ TOUCHMOUSEAPI int touchmouse_close(touchmouse_device *dev);
  */
 TOUCHMOUSEAPI int touchmouse_set_device_mode(touchmouse_device *dev, touchmouse_mode mode);
 
+/**
+ * Choose how the selected device reassembles images.  Both modes produce
+ * identical images; which one is faster depends on the CPU.  Any partially
+ * decoded image is discarded.
+ *
+ * @param dev Device for which to set the decode mode
+ * @param mode Desired decode mode (see touchmouse_decode_mode for details).
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_set_decode_mode(touchmouse_device *dev, touchmouse_decode_mode mode);
+
 /**
  * Register a callback to be called when a touch image update is received from
  * the device.
@@ -146,6 +435,40 @@ TOUCHMOUSEAPI int touchmouse_set_device_mode(touchmouse_device *dev, touchmouse_
  */
 TOUCHMOUSEAPI int touchmouse_set_image_update_callback(touchmouse_device *dev, touchmouse_image_callback callback);
 
+/**
+ * Register a callback to be called with each touch image and its timing: when
+ * its reports arrived at the host, the unwrapped device time and a sequence
+ * number.  Replaces any callback set with
+ * touchmouse_set_image_update_callback(), and vice versa.
+ *
+ * @param dev Device for which to set the image update callback function
+ * @param callback Function to be called when an image update is received
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_set_image_update_callback_ex(touchmouse_device *dev, touchmouse_image_callback_ex callback);
+
+/**
+ * Read the clock that arrival times are given on.
+ *
+ * @return the current time in nanoseconds since an arbitrary epoch
+ */
+TOUCHMOUSEAPI uint64_t touchmouse_time_nanos(void);
+
+/**
+ * Get the current fit of a device's clock to the host clock, from which
+ * touchmouse_callback_info_ex::corrected_time_ns is worked out.
+ *
+ * The fit is updated as images are delivered, so call this from the thread
+ * that processes the device's events (or from the callback).
+ *
+ * @param dev Device whose clock estimate to get.
+ * @param estimate Filled in with the estimate.
+ *
+ * @return 0 on success, < 0 if there is no estimate yet
+ */
+TOUCHMOUSEAPI int touchmouse_get_clock_estimate(touchmouse_device *dev, touchmouse_clock_estimate *estimate);
+
 /**
  * Set a piece of user-defined data to be provided in the callback.  This makes
  * it possible to distinguish higher-level data associated with a particular
@@ -172,6 +495,419 @@ TOUCHMOUSEAPI int touchmouse_set_device_userdata(touchmouse_device *dev, void *u
  */
 TOUCHMOUSEAPI int touchmouse_process_events_timeout(touchmouse_device *dev, int milliseconds);
 
+/**
+ * Process every report the device has already queued, without blocking.
+ *
+ * Unlike touchmouse_process_events_timeout(), this does not stop after the
+ * first completed image: the callback is triggered once for every image that
+ * the queued reports complete, and partially received images are carried
+ * over to the next call.  This is the function to use when polling, since it
+ * can never fall behind the device.
+ *
+ * @param dev Device for which to process events.
+ *
+ * @return the number of images delivered on success, -1 if some reports could not be decoded (images from the others are still delivered), -2 on unrecoverable error
+ */
+TOUCHMOUSEAPI int touchmouse_process_pending_events(touchmouse_device *dev);
+
+/**
+ * Process events for several devices at once, for up to a certain maximum of
+ * milliseconds.
+ *
+ * Sleeps until any of the devices has reports waiting, then processes the
+ * reports of every device that has some, triggering each device's callback
+ * for each image completed.  Every device gets the same share of reports per
+ * call, so one busy device can't starve the others.  Returns once at least
+ * one image has been delivered, or when the timeout expires.
+ *
+ * Sleeping on every device at once needs touchmouse_get_pollable_fd(); on
+ * platforms without it the devices are polled in turn instead.
+ *
+ * A device that fails to read (because it was unplugged, say) is marked
+ * failed, and later calls skip it and no longer wait on it; its status says
+ * so until it is closed.  The other devices carry on as before.
+ *
+ * @param devs Array of devices for which to process events.
+ * @param count Number of devices in devs.
+ * @param milliseconds Maximum time to block waiting for a new image update.  Negative values mean block infinitely, 0 means completely nonblocking, and positive values set a maximum timeout.
+ * @param status Optional array of count ints, or NULL.  Each is set to 0 if its device is fine, -1 if some of its reports could not be decoded during this call, or -2 if reading from it has failed and it should be closed.
+ *
+ * @return the number of images delivered (from any device), -1 if waiting for reports failed, or -2 if every device has failed
+ */
+TOUCHMOUSEAPI int touchmouse_process_events_multi(touchmouse_device **devs, int count, int milliseconds, int *status);
+
+/**
+ * Get a file descriptor which becomes readable when the device has reports
+ * waiting to be processed, for use with poll(), epoll, QSocketNotifier and
+ * the like.
+ *
+ * When it is readable, call touchmouse_process_pending_events(), which also
+ * makes it unreadable again once every report has been processed.  Never read
+ * from it directly.  It is closed by touchmouse_close().
+ *
+ * Only supported on Linux.
+ *
+ * @param dev Device to get the file descriptor of.
+ *
+ * @return the file descriptor, or -1 if there is none and the device has to be polled instead
+ */
+TOUCHMOUSEAPI int touchmouse_get_pollable_fd(touchmouse_device *dev);
+
+/**
+ * Set how many reports are queued for a device before some are thrown away,
+ * and which ones go.
+ *
+ * Reports arrive in bursts, and are queued until they are processed.  A lost
+ * report spoils the image it belongs to, so consumers that process events in
+ * bursts of their own may want a deeper queue, or TOUCHMOUSE_QUEUE_DROP_FRAME.
+ * Call this from the thread that processes the device's events.
+ *
+ * Only supported on Linux.
+ *
+ * @param dev Device whose queue to configure.
+ * @param capacity Number of reports to queue (rounded up to a power of two), or 0 to leave it alone.  The default is 32.
+ * @param policy What to discard when the queue is full.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_set_report_queue(touchmouse_device *dev, int capacity, touchmouse_queue_policy policy);
+
+/**
+ * Get the counters for a device's report queue.
+ *
+ * Only supported on Linux.
+ *
+ * @param dev Device whose counters to get.
+ * @param stats Filled in with the current counters.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_get_report_queue_stats(touchmouse_device *dev, touchmouse_queue_stats *stats);
+
+/**
+ * Get a device's counters: how many reports arrived, were ignored or dropped,
+ * how often decoding went wrong, and how many images came out.
+ *
+ * The counters are cheap enough to be always on, and may be read from any
+ * thread while another processes the device's events.
+ *
+ * @param dev Device whose counters to get.
+ * @param stats Filled in with the counts since the device was opened, or since the last touchmouse_reset_stats().
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_get_stats(touchmouse_device *dev, touchmouse_stats *stats);
+
+/**
+ * Start a device's counters again from zero.
+ *
+ * @param dev Device whose counters to reset.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_reset_stats(touchmouse_device *dev);
+
+/**
+ * Record every report read from a device, and when it arrived, to a capture
+ * file.  Captures hold exactly what the device sent, so problems seen with
+ * them can be reproduced without the device.
+ *
+ * Recording doesn't slow down event processing: reports are buffered in
+ * memory and written out by a background thread.  If the disk can't keep up
+ * and the buffers fill, reports are left out of the capture.
+ *
+ * The file holds a header ("TMCP", a format version, and the start time),
+ * then one record per report: its length, the nanoseconds since the previous
+ * one arrived, and the raw report.  touchmouse_index_capture() can add an
+ * index to it afterwards, for random access.
+ *
+ * Call this, and touchmouse_stop_recording(), from the thread that processes
+ * the device's events.
+ *
+ * @param dev Device to record.
+ * @param path File to create, replacing any that exists.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_start_recording(touchmouse_device *dev, const char *path);
+
+/**
+ * Stop recording, finish writing the capture file and close it.
+ * touchmouse_close() does this too.
+ *
+ * @param dev Device being recorded.
+ *
+ * @return 0 on success, < 0 if the device wasn't being recorded or the capture couldn't be written completely
+ */
+TOUCHMOUSEAPI int touchmouse_stop_recording(touchmouse_device *dev);
+
+/**
+ * Add an index to a capture file, recording where each image's reports
+ * start along with its arrival time and device timestamp, so that it can be
+ * opened with touchmouse_capture_open().  The index is appended to the file
+ * in place; indexed captures can still be replayed.  Indexing a capture that
+ * already has an index does nothing.
+ *
+ * @param path Capture file, which must not still be being recorded.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_index_capture(const char *path);
+
+/**
+ * Open an indexed capture for random access.  The file is mapped into
+ * memory rather than read, so opening even a very large capture is quick,
+ * and reports are handed out straight from the mapping.  An open capture is
+ * never modified, so any number of threads may read it at once, for instance
+ * each taking its own range of images.
+ *
+ * @param capture Address of a touchmouse_capture* to populate.
+ * @param path Capture file, indexed by touchmouse_index_capture().
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_capture_open(touchmouse_capture **capture, const char *path);
+
+/**
+ * Close an indexed capture.  Report pointers obtained from it are no longer
+ * valid afterwards.
+ *
+ * @param capture Capture to close
+ */
+TOUCHMOUSEAPI void touchmouse_capture_close(touchmouse_capture *capture);
+
+/**
+ * Count the images in an indexed capture.
+ *
+ * @param capture Capture to count
+ *
+ * @return the number of images
+ */
+TOUCHMOUSEAPI uint64_t touchmouse_capture_frame_count(touchmouse_capture *capture);
+
+/**
+ * Look up an image in an indexed capture.
+ *
+ * @param capture Capture to look in
+ * @param n Image number, from 0
+ * @param frame Filled in with where the image is
+ *
+ * @return 0 on success, < 0 if there is no such image
+ */
+TOUCHMOUSEAPI int touchmouse_capture_get_frame(touchmouse_capture *capture, uint64_t n, touchmouse_capture_frame *frame);
+
+/**
+ * Find the last image that had started arriving by a given host time, by
+ * binary search of the index.
+ *
+ * @param capture Capture to search
+ * @param host_time_ns Time on the recording host's touchmouse_time_nanos() clock
+ *
+ * @return the image number, or -1 if every image arrived later
+ */
+TOUCHMOUSEAPI int64_t touchmouse_capture_find_time(touchmouse_capture *capture, uint64_t host_time_ns);
+
+/**
+ * Find the last image with a device time at or before the one given, by
+ * binary search of the index.
+ *
+ * @param capture Capture to search
+ * @param device_time_ms Unwrapped device time, as in touchmouse_capture_frame
+ *
+ * @return the image number, or -1 if every image is later
+ */
+TOUCHMOUSEAPI int64_t touchmouse_capture_find_device_time(touchmouse_capture *capture, uint64_t device_time_ms);
+
+/**
+ * Get one of an image's reports, without copying it.  Feeding an image's
+ * reports in order to a decoder (see touchmouse_decoder_feed_timestamped())
+ * reproduces the image.
+ *
+ * @param capture Capture the image is in
+ * @param frame Image, from touchmouse_capture_get_frame()
+ * @param i Report number within the image, from 0 to report_count - 1
+ * @param report Set to point at the raw report, inside the capture's mapping
+ * @param arrival_ns Set to when the report arrived (may be NULL)
+ *
+ * @return the report's length, or < 0 if there is no such report
+ */
+TOUCHMOUSEAPI int touchmouse_capture_get_report(touchmouse_capture *capture, const touchmouse_capture_frame *frame, uint32_t i, const unsigned char **report, uint64_t *arrival_ns);
+
+/**
+ * Summarize a device's latency: for each image delivered, the time from the
+ * arrival of its last report to the callback being called.
+ *
+ * On Linux, a report arrives when its USB transfer completes (or, with the
+ * hidraw backend, when it is read from the kernel), so this includes any time
+ * spent waiting in the report queue.  Elsewhere, arrival times aren't known
+ * and the time the report was read is used instead.
+ *
+ * Latencies are kept in a histogram whose buckets are about 6% wide, so the
+ * percentiles are accurate to that.  The histogram may be read from any
+ * thread while another processes the device's events.
+ *
+ * @param dev Device whose latency to summarize.
+ * @param stats Filled in with the summary.  All zero if nothing has been measured yet.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_get_latency_stats(touchmouse_device *dev, touchmouse_latency_stats *stats);
+
+/**
+ * Get any percentile of a device's latency (see touchmouse_get_latency_stats()).
+ *
+ * @param dev Device whose latency to query.
+ * @param percentile Percentage of images, from 0 to 100.
+ *
+ * @return the latency in nanoseconds that percentile percent of images were at or below, or 0 if nothing has been measured
+ */
+TOUCHMOUSEAPI uint64_t touchmouse_get_latency_percentile(touchmouse_device *dev, double percentile);
+
+/**
+ * Forget the latencies measured so far.
+ *
+ * @param dev Device whose latency histogram to empty.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_reset_latency_stats(touchmouse_device *dev);
+
+// Standalone decoder routines.  These need no device (or even
+// touchmouse_init()), so they can be used to decode recorded reports offline.
+// Each decoder is independent, so separate threads may each use their own.
+
+/**
+ * Create a standalone decoder, which reassembles images from raw input
+ * reports the same way an opened device does.
+ *
+ * Safe to call from any number of threads at once.
+ *
+ * @param decoder Address of a touchmouse_decoder* to populate with the new decoder.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_decoder_init(touchmouse_decoder **decoder);
+
+/**
+ * Free a decoder created with touchmouse_decoder_init().
+ *
+ * @param decoder Decoder to free
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_decoder_free(touchmouse_decoder *decoder);
+
+/**
+ * Register a callback to be called whenever the decoder completes an image.
+ *
+ * @param decoder Decoder for which to set the callback
+ * @param callback Function to be called with each completed image
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_decoder_set_image_update_callback(touchmouse_decoder *decoder, touchmouse_image_callback callback);
+
+/**
+ * Register an extended callback to be called whenever the decoder completes
+ * an image.  See touchmouse_set_image_update_callback_ex().
+ *
+ * @param decoder Decoder for which to set the callback
+ * @param callback Function to be called with each completed image
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_decoder_set_image_update_callback_ex(touchmouse_decoder *decoder, touchmouse_image_callback_ex callback);
+
+/**
+ * Set a piece of user-defined data to be provided in the decoder's callbacks.
+ *
+ * @param decoder Decoder for which to set the userdata pointer.
+ * @param userdata Pointer to receive in the touchmouse_callback_info in callbacks from this decoder.
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_decoder_set_userdata(touchmouse_decoder *decoder, void *userdata);
+
+/**
+ * Choose how the decoder reassembles images.  See touchmouse_set_decode_mode().
+ *
+ * @param decoder Decoder for which to set the mode
+ * @param mode Desired decode mode
+ *
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_decoder_set_mode(touchmouse_decoder *decoder, touchmouse_decode_mode mode);
+
+/**
+ * Feed one raw input report, exactly as read from the device (32 bytes,
+ * starting with the report ID), to the decoder.  The callback is triggered
+ * once for every image the report completes.  Reports that don't carry image
+ * data are ignored, and a partially received image is kept until the next
+ * report arrives.
+ *
+ * @param decoder Decoder to feed
+ * @param report Raw report data
+ * @param length Length of the report in bytes
+ *
+ * @return the number of images completed, or -1 if the report could not be decoded
+ */
+TOUCHMOUSEAPI int touchmouse_decoder_feed(touchmouse_decoder *decoder, const unsigned char *report, int length);
+
+/**
+ * Feed one raw input report to the decoder, as touchmouse_decoder_feed()
+ * does, along with the time it arrived, which is passed on to extended
+ * callbacks.
+ *
+ * @param decoder Decoder to feed
+ * @param report Raw report data
+ * @param length Length of the report in bytes
+ * @param arrival_ns When the report arrived, in nanoseconds, or 0 if unknown
+ *
+ * @return the number of images completed, or -1 if the report could not be decoded
+ */
+TOUCHMOUSEAPI int touchmouse_decoder_feed_timestamped(touchmouse_decoder *decoder, const unsigned char *report, int length, uint64_t arrival_ns);
+
+/**
+ * Discard any partially decoded image, for instance before feeding reports
+ * from a different capture.
+ *
+ * @param decoder Decoder to reset
+ * @return 0 on success, < 0 on error
+ */
+TOUCHMOUSEAPI int touchmouse_decoder_reset(touchmouse_decoder *decoder);
+
+/// Most reports an encoded image can take (see touchmouse_encode_image()).
+#define TOUCHMOUSE_MAX_IMAGE_REPORTS 4
+
+/**
+ * Encode an image as the reports a TouchMouse would send for it: the pixels
+ * run-length encoded as the device does, split into payloads of at most 25
+ * bytes, each in a 32-byte 0x27 report carrying the given timestamp.
+ * Feeding the reports to a decoder gives back the image.
+ *
+ * The device has only 15 pixel levels, so each pixel is rounded to the
+ * nearest of those, and the pixels outside the touch area are left out; an
+ * image delivered by the library comes back exactly.
+ *
+ * @param image 195 bytes of image data laid out as in callbacks
+ * @param timestamp Timestamp byte to put in each report
+ * @param reports Room for TOUCHMOUSE_MAX_IMAGE_REPORTS reports
+ *
+ * @return the number of reports written
+ */
+TOUCHMOUSEAPI int touchmouse_encode_image(const uint8_t *image, uint8_t timestamp, unsigned char reports[][32]);
+
+/**
+ * Encode an image given as the 181 pixel levels the device sends, in the
+ * order it sends them, as touchmouse_encode_image() does.
+ *
+ * @param pixels 181 pixel levels, each 0 to 14
+ * @param timestamp Timestamp byte to put in each report
+ * @param reports Room for TOUCHMOUSE_MAX_IMAGE_REPORTS reports
+ *
+ * @return the number of reports written, or -1 if a level is out of range
+ */
+TOUCHMOUSEAPI int touchmouse_encode_pixels(const uint8_t *pixels, uint8_t timestamp, unsigned char reports[][32]);
+
 #ifdef __cplusplus
 }
 #endif
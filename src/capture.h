@@ -0,0 +1,158 @@
+/* The capture file format, shared by the recorder and the replay device.
+ *
+ * A capture is a header followed by one record per input report, in the
+ * order they arrived.  All integers are little-endian.
+ *
+ *   header:  "TMCP"
+ *            u16  format version (TM_CAPTURE_VERSION)
+ *            u16  header size in bytes, so that later versions can add fields
+ *            u64  arrival time the first record's delta counts from, in ns
+ *                 on the touchmouse_time_nanos() clock
+ *   record:  u8   report length
+ *            var  ns since the previous record arrived (or since the header
+ *                 time), as an unsigned LEB128 varint
+ *            ...  the report, exactly as read from the device
+ *
+ * touchmouse_index_capture() adds an index of where each image's reports
+ * start, so that readers can map the file and binary-search it rather than
+ * reading from the beginning.  It is appended after the records, and the
+ * format version in the header is changed to TM_CAPTURE_VERSION_INDEXED
+ * only once it's complete.  The index starts on an 8-byte boundary.
+ *
+ *   index:   "TMIX"
+ *            u32  size of each entry in bytes, so that later versions can
+ *                 add fields
+ *   entry:   u64  offset of the image's first record
+ *            u64  arrival time of that record, in ns
+ *            u64  device time in ms, unwrapped as for
+ *                 touchmouse_callback_info_ex::device_time_ms
+ *            u32  records belonging to the image
+ *            u32  device clock series
+ *   trailer: u64  offset of the index
+ *            u64  number of entries
+ *            u64  offset at which the records end
+ *            "TMCPINDX"
+ *
+ * An image's records are the one that starts it, which is the first image
+ * report with a new timestamp, and every one after it until the next.
+ */
+#ifndef __TM_CAPTURE_H__
+#define __TM_CAPTURE_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#define TM_CAPTURE_MAGIC "TMCP"
+#define TM_CAPTURE_VERSION 1
+// The version of a capture with an index appended.
+#define TM_CAPTURE_VERSION_INDEXED 2
+#define TM_CAPTURE_HEADER_SIZE 16
+#define TM_CAPTURE_INDEX_MAGIC "TMIX"
+#define TM_CAPTURE_INDEX_HEADER_SIZE 8
+#define TM_CAPTURE_INDEX_ENTRY_SIZE 32
+#define TM_CAPTURE_TRAILER_MAGIC "TMCPINDX"
+#define TM_CAPTURE_TRAILER_SIZE 32
+// Longest a record can be: length, a 64-bit varint and a maximal report.
+#define TM_CAPTURE_MAX_RECORD (1 + 10 + 255)
+
+static inline void tm_capture_put_u16(uint8_t *p, uint16_t v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void tm_capture_put_u64(uint8_t *p, uint64_t v)
+{
+	int i;
+	for (i = 0; i < 8; i++)
+		p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline void tm_capture_put_u32(uint8_t *p, uint32_t v)
+{
+	int i;
+	for (i = 0; i < 4; i++)
+		p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline uint16_t tm_capture_get_u16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t tm_capture_get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t tm_capture_get_u64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	int i;
+	for (i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+// Parse the record starting at data[p], in a capture whose records end at
+// end.  Returns the report's length and sets *report (its offset), *delta
+// and *next, or returns -1 if there's no complete record there.
+static inline int tm_capture_parse_record(const uint8_t *data, size_t end, size_t p, size_t *report, uint64_t *delta, size_t *next)
+{
+	int length;
+	int shift = 0;
+	*delta = 0;
+	if (p >= end)
+		return -1;
+	length = data[p++];
+	for (;;) {
+		uint8_t byte;
+		if (p >= end || shift > 63)
+			return -1;
+		byte = data[p++];
+		*delta |= (uint64_t)(byte & 0x7f) << shift;
+		shift += 7;
+		if (!(byte & 0x80))
+			break;
+	}
+	if (end - p < (size_t)length)
+		return -1;
+	*report = p;
+	*next = p + length;
+	return length;
+}
+
+// Check the header of a capture of size bytes, and find where its records
+// start and end, and its index and number of entries if it has one (*index
+// is 0 if not).  Returns 0, or -1 if it isn't a capture this code can read.
+static inline int tm_capture_layout(const uint8_t *data, size_t size, size_t *records_start, size_t *records_end, size_t *index, uint64_t *entries)
+{
+	uint16_t version, header_size;
+	if (size < TM_CAPTURE_HEADER_SIZE || memcmp(data, TM_CAPTURE_MAGIC, 4) != 0)
+		return -1;
+	version = tm_capture_get_u16(data + 4);
+	header_size = tm_capture_get_u16(data + 6);
+	if (header_size < TM_CAPTURE_HEADER_SIZE || header_size > size)
+		return -1;
+	*records_start = header_size;
+	*records_end = size;
+	*index = 0;
+	*entries = 0;
+	if (version == TM_CAPTURE_VERSION)
+		return 0;
+	if (version != TM_CAPTURE_VERSION_INDEXED || size < header_size + TM_CAPTURE_TRAILER_SIZE ||
+			memcmp(data + size - 8, TM_CAPTURE_TRAILER_MAGIC, 8) != 0)
+		return -1;
+	const uint8_t *trailer = data + size - TM_CAPTURE_TRAILER_SIZE;
+	uint64_t offset = tm_capture_get_u64(trailer);
+	uint64_t end = tm_capture_get_u64(trailer + 16);
+	if (offset < header_size || offset > size - TM_CAPTURE_TRAILER_SIZE - TM_CAPTURE_INDEX_HEADER_SIZE ||
+			memcmp(data + offset, TM_CAPTURE_INDEX_MAGIC, 4) != 0 || end < header_size || end > offset)
+		return -1;
+	*records_end = (size_t)end;
+	*index = (size_t)offset;
+	*entries = tm_capture_get_u64(trailer + 8);
+	return 0;
+}
+
+#endif // __TM_CAPTURE_H__
@@ -0,0 +1,326 @@
+/* Capture indexing and random access; see capture.h for the file format.
+ *
+ * Indexing makes one pass over the records, which the clock model follows
+ * just as a decoder would, and appends the index as it goes.  Reading maps
+ * the whole file and works straight from the mapping: finding an image is a
+ * binary search of the index, and its reports are never copied.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "touchmouse-internal.h"
+#include "capture.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// A whole file mapped read-only into memory.
+typedef struct {
+	const uint8_t *data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+} file_map;
+
+struct touchmouse_capture_ {
+	file_map map;
+	size_t records_end;
+	const uint8_t *entries;
+	uint32_t entry_size;
+	uint64_t count;
+};
+
+#ifdef _WIN32
+static int map_file(const char *path, file_map *m)
+{
+	LARGE_INTEGER size;
+	memset(m, 0, sizeof(*m));
+	m->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m->file == INVALID_HANDLE_VALUE)
+		return -1;
+	if (!GetFileSizeEx(m->file, &size) || size.QuadPart == 0 || (uint64_t)size.QuadPart > (size_t)-1) {
+		CloseHandle(m->file);
+		return -1;
+	}
+	m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!m->mapping) {
+		CloseHandle(m->file);
+		return -1;
+	}
+	m->data = (const uint8_t*)MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!m->data) {
+		CloseHandle(m->mapping);
+		CloseHandle(m->file);
+		return -1;
+	}
+	m->size = (size_t)size.QuadPart;
+	return 0;
+}
+
+static void unmap_file(file_map *m)
+{
+	UnmapViewOfFile(m->data);
+	CloseHandle(m->mapping);
+	CloseHandle(m->file);
+}
+#else
+static int map_file(const char *path, file_map *m)
+{
+	struct stat st;
+	void *data;
+	int fd = open(path, O_RDONLY);
+	memset(m, 0, sizeof(*m));
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0 || st.st_size == 0 || (uint64_t)st.st_size > (size_t)-1) {
+		close(fd);
+		return -1;
+	}
+	data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping holds its own reference to the file.
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+	m->data = (const uint8_t*)data;
+	m->size = (size_t)st.st_size;
+	return 0;
+}
+
+static void unmap_file(file_map *m)
+{
+	munmap((void*)m->data, m->size);
+}
+#endif
+
+static int write_entry(FILE *file, uint64_t offset, uint64_t arrival, uint64_t device_time, uint32_t records, uint32_t series)
+{
+	uint8_t entry[TM_CAPTURE_INDEX_ENTRY_SIZE];
+	tm_capture_put_u64(entry, offset);
+	tm_capture_put_u64(entry + 8, arrival);
+	tm_capture_put_u64(entry + 16, device_time);
+	tm_capture_put_u32(entry + 24, records);
+	tm_capture_put_u32(entry + 28, series);
+	return fwrite(entry, sizeof(entry), 1, file) == 1 ? 0 : -1;
+}
+
+int touchmouse_index_capture(const char *path)
+{
+	static const uint8_t padding[8] = {0};
+	file_map map;
+	size_t records_start, records_end, index;
+	uint64_t entries;
+	if (map_file(path, &map) < 0) {
+		TM_ERROR("touchmouse_index_capture: can't map %s\n", path);
+		return -1;
+	}
+	if (tm_capture_layout(map.data, map.size, &records_start, &records_end, &index, &entries) < 0) {
+		TM_ERROR("touchmouse_index_capture: %s is not a capture this version can read\n", path);
+		unmap_file(&map);
+		return -1;
+	}
+	if (index) {
+		TM_DEBUG("touchmouse_index_capture: %s is already indexed\n", path);
+		unmap_file(&map);
+		return 0;
+	}
+	FILE *file = fopen(path, "r+b");
+	if (!file) {
+		TM_ERROR("touchmouse_index_capture: can't open %s for writing\n", path);
+		unmap_file(&map);
+		return -1;
+	}
+	setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+	// The index goes after everything already in the file, even a record cut
+	// short at the end.
+	uint64_t index_offset = ((uint64_t)map.size + 7) & ~(uint64_t)7;
+	uint8_t header[TM_CAPTURE_INDEX_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	memcpy(header, TM_CAPTURE_INDEX_MAGIC, 4);
+	tm_capture_put_u32(header + 4, TM_CAPTURE_INDEX_ENTRY_SIZE);
+	int failed = fseek(file, 0, SEEK_END) != 0 ||
+		fwrite(padding, 1, (size_t)(index_offset - map.size), file) != (size_t)(index_offset - map.size) ||
+		fwrite(header, sizeof(header), 1, file) != 1;
+
+	tm_clock_model clock;
+	tm_clock_model_init(&clock);
+	uint64_t time = tm_capture_get_u64(map.data + 8);
+	uint64_t count = 0;
+	size_t position = records_start;
+	// The image being gathered up
+	int have_frame = 0;
+	uint8_t timestamp = 0;
+	uint64_t frame_offset = 0, frame_arrival = 0, frame_device_time = 0;
+	uint32_t frame_records = 0, frame_series = 0;
+	size_t report, next;
+	uint64_t delta;
+	int length;
+	while (!failed && (length = tm_capture_parse_record(map.data, map.size, position, &report, &delta, &next)) >= 0) {
+		const uint8_t *r = map.data + report;
+		time += delta;
+		// All the reports of an image carry the same timestamp, so the first
+		// with a new one starts the next image.
+		if (length == 32 && r[0] == 0x27 && (!have_frame || r[TM_REPORT_TIMESTAMP_OFFSET] != timestamp)) {
+			if (have_frame && write_entry(file, frame_offset, frame_arrival, frame_device_time, frame_records, frame_series) < 0)
+				failed = 1;
+			uint64_t corrected;
+			timestamp = r[TM_REPORT_TIMESTAMP_OFFSET];
+			frame_offset = position;
+			frame_arrival = time;
+			frame_device_time = tm_clock_model_update(&clock, timestamp, time, &corrected);
+			frame_series = (uint32_t)clock.series;
+			frame_records = 0;
+			have_frame = 1;
+			count++;
+		}
+		// Anything before the first image belongs to none.
+		if (have_frame)
+			frame_records++;
+		position = next;
+	}
+	if (!failed && have_frame && write_entry(file, frame_offset, frame_arrival, frame_device_time, frame_records, frame_series) < 0)
+		failed = 1;
+
+	uint8_t trailer[TM_CAPTURE_TRAILER_SIZE];
+	tm_capture_put_u64(trailer, index_offset);
+	tm_capture_put_u64(trailer + 8, count);
+	tm_capture_put_u64(trailer + 16, position);
+	memcpy(trailer + 24, TM_CAPTURE_TRAILER_MAGIC, 8);
+	if (!failed)
+		failed = fwrite(trailer, sizeof(trailer), 1, file) != 1;
+	// Only now that the index is complete does the file claim to have one.
+	uint8_t version[2];
+	tm_capture_put_u16(version, TM_CAPTURE_VERSION_INDEXED);
+	if (!failed)
+		failed = fflush(file) != 0 || fseek(file, 4, SEEK_SET) != 0 || fwrite(version, sizeof(version), 1, file) != 1;
+	if (fclose(file) != 0)
+		failed = 1;
+	unmap_file(&map);
+	if (failed) {
+		TM_ERROR("touchmouse_index_capture: failed writing the index to %s\n", path);
+		return -1;
+	}
+	TM_DEBUG("touchmouse_index_capture: indexed %llu images in %s\n", (unsigned long long)count, path);
+	return 0;
+}
+
+int touchmouse_capture_open(touchmouse_capture **capture, const char *path)
+{
+	touchmouse_capture *c = (touchmouse_capture*)calloc(1, sizeof(touchmouse_capture));
+	size_t records_start, index;
+	if (!c) {
+		TM_ERROR("touchmouse_capture_open: out of memory\n");
+		return -1;
+	}
+	if (map_file(path, &c->map) < 0) {
+		TM_ERROR("touchmouse_capture_open: can't map %s\n", path);
+		free(c);
+		return -1;
+	}
+	if (tm_capture_layout(c->map.data, c->map.size, &records_start, &c->records_end, &index, &c->count) < 0 || !index) {
+		TM_ERROR("touchmouse_capture_open: %s is not an indexed capture\n", path);
+		unmap_file(&c->map);
+		free(c);
+		return -1;
+	}
+	const uint8_t *header = c->map.data + index;
+	size_t room = c->map.size - TM_CAPTURE_TRAILER_SIZE - index - TM_CAPTURE_INDEX_HEADER_SIZE;
+	c->entry_size = tm_capture_get_u32(header + 4);
+	c->entries = header + TM_CAPTURE_INDEX_HEADER_SIZE;
+	if (c->entry_size < TM_CAPTURE_INDEX_ENTRY_SIZE || c->count > room / c->entry_size) {
+		TM_ERROR("touchmouse_capture_open: %s has a damaged index\n", path);
+		unmap_file(&c->map);
+		free(c);
+		return -1;
+	}
+	*capture = c;
+	return 0;
+}
+
+void touchmouse_capture_close(touchmouse_capture *capture)
+{
+	unmap_file(&capture->map);
+	free(capture);
+}
+
+uint64_t touchmouse_capture_frame_count(touchmouse_capture *capture)
+{
+	return capture->count;
+}
+
+int touchmouse_capture_get_frame(touchmouse_capture *capture, uint64_t n, touchmouse_capture_frame *frame)
+{
+	const uint8_t *entry;
+	if (n >= capture->count)
+		return -1;
+	entry = capture->entries + n * capture->entry_size;
+	frame->offset = tm_capture_get_u64(entry);
+	frame->host_time_ns = tm_capture_get_u64(entry + 8);
+	frame->device_time_ms = tm_capture_get_u64(entry + 16);
+	frame->report_count = tm_capture_get_u32(entry + 24);
+	frame->series = tm_capture_get_u32(entry + 28);
+	return 0;
+}
+
+// The last entry whose u64 field at field_offset is at most value, or -1.
+// Both fields searched on only ever go forward through the capture.
+static int64_t find_last_at_most(touchmouse_capture *capture, int field_offset, uint64_t value)
+{
+	uint64_t low = 0;
+	uint64_t high = capture->count;
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+		if (tm_capture_get_u64(capture->entries + middle * capture->entry_size + field_offset) <= value)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return (int64_t)low - 1;
+}
+
+int64_t touchmouse_capture_find_time(touchmouse_capture *capture, uint64_t host_time_ns)
+{
+	return find_last_at_most(capture, 8, host_time_ns);
+}
+
+int64_t touchmouse_capture_find_device_time(touchmouse_capture *capture, uint64_t device_time_ms)
+{
+	return find_last_at_most(capture, 16, device_time_ms);
+}
+
+int touchmouse_capture_get_report(touchmouse_capture *capture, const touchmouse_capture_frame *frame, uint32_t i, const unsigned char **report, uint64_t *arrival_ns)
+{
+	size_t position = (size_t)frame->offset;
+	uint64_t time = frame->host_time_ns;
+	uint32_t k;
+	if (i >= frame->report_count || frame->offset >= capture->records_end)
+		return -1;
+	// Records only say how long after the one before they arrived, so walk
+	// from the start of the image; images are only a few reports long.
+	for (k = 0; ; k++) {
+		size_t offset, next;
+		uint64_t delta;
+		int length = tm_capture_parse_record(capture->map.data, capture->records_end, position, &offset, &delta, &next);
+		if (length < 0)
+			return -1;
+		if (k > 0)
+			time += delta;
+		if (k == i) {
+			*report = capture->map.data + offset;
+			if (arrival_ns)
+				*arrival_ns = time;
+			return length;
+		}
+		position = next;
+	}
+}
@@ -0,0 +1,132 @@
+/* Device clock model; see touchmouse-internal.h.
+ *
+ * The device stamps each image with the low 8 bits of a millisecond counter
+ * that restarts whenever a new series of touches begins.  We unwrap it into a
+ * 64-bit count, using the host arrival times to tell how many times it
+ * wrapped and whether it restarted, and fit a line through the recent
+ * (device time, arrival time) pairs.  Reading the line at an image's device
+ * time gives a host timestamp with the USB scheduling jitter averaged out.
+ */
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "touchmouse-internal.h"
+
+// A pause in images longer than this means the touches stopped, and the
+// device will have restarted its counter.
+#define TM_CLOCK_SERIES_GAP_MS 200
+// Arrival times disagreeing with the device by more than this mean the
+// counter restarted, even without a pause.
+#define TM_CLOCK_RESTART_TOLERANCE_MS 32
+// Fewer samples than this aren't enough to fit the drift; keep the last
+// estimate of it and only fit the offset.
+#define TM_CLOCK_MIN_FIT_SAMPLES 16
+// The span the drift is fitted over needs to be this long, too.
+#define TM_CLOCK_MIN_FIT_SPAN_MS 500
+// How many fits the drift estimate is averaged over.
+#define TM_CLOCK_DRIFT_SMOOTHING 64
+#define TM_NANOS_PER_MS 1000000.0
+
+void tm_clock_model_init(tm_clock_model *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->slope = TM_NANOS_PER_MS;
+}
+
+// Forget the samples, but not the drift, which belongs to the device and
+// carries over from one series to the next.
+static void restart_window(tm_clock_model *m)
+{
+	m->window_count = 0;
+	m->window_next = 0;
+}
+
+static void add_sample(tm_clock_model *m, uint64_t device_time, uint64_t arrival)
+{
+	m->window_device[m->window_next] = device_time;
+	m->window_host[m->window_next] = arrival;
+	m->window_next = (m->window_next + 1) % TM_CLOCK_WINDOW;
+	if (m->window_count < TM_CLOCK_WINDOW)
+		m->window_count++;
+}
+
+// Fit host = intercept + slope * device over the window, relative to the
+// newest sample (so that the doubles keep their precision), and return the
+// fitted host time of the newest sample.
+static uint64_t fit(tm_clock_model *m, uint64_t device_time, uint64_t arrival)
+{
+	double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0, span = 0;
+	double n = m->window_count;
+	double mean_x, mean_y, intercept, sum_rr = 0;
+	int i;
+	for (i = 0; i < m->window_count; i++) {
+		double x = (double)m->window_device[i] - (double)device_time;
+		double y = (double)(int64_t)(m->window_host[i] - arrival);
+		sum_x += x;
+		sum_y += y;
+		sum_xx += x * x;
+		sum_xy += x * y;
+		if (-x > span)
+			span = -x;
+	}
+	mean_x = sum_x / n;
+	mean_y = sum_y / n;
+	if (m->window_count >= TM_CLOCK_MIN_FIT_SAMPLES && span >= TM_CLOCK_MIN_FIT_SPAN_MS) {
+		double var_x = sum_xx / n - mean_x * mean_x;
+		// A window's worth of jittery arrivals only pins the drift down
+		// roughly, so average the fits over time too.
+		if (var_x > 0)
+			m->slope += ((sum_xy / n - mean_x * mean_y) / var_x - m->slope) / TM_CLOCK_DRIFT_SMOOTHING;
+	}
+	intercept = mean_y - m->slope * mean_x;
+	for (i = 0; i < m->window_count; i++) {
+		double x = (double)m->window_device[i] - (double)device_time;
+		double y = (double)(int64_t)(m->window_host[i] - arrival);
+		double r = y - (intercept + m->slope * x);
+		sum_rr += r * r;
+	}
+	m->jitter = sqrt(sum_rr / n);
+	m->offset = (int64_t)arrival + (int64_t)intercept - (int64_t)(m->slope * (double)device_time);
+	return arrival + (int64_t)intercept;
+}
+
+uint64_t tm_clock_model_update(tm_clock_model *m, uint8_t timestamp, uint64_t arrival, uint64_t *corrected)
+{
+	uint8_t step = (uint8_t)(timestamp - m->last_timestamp);
+	*corrected = 0;
+	if (!m->have_frame) {
+		m->device_time = timestamp;
+	} else if (!arrival || !m->last_arrival) {
+		// Without arrival times, all we can do is assume the counter
+		// went forward by less than 256 ms.
+		m->device_time += step;
+	} else {
+		double elapsed_ms = (double)(int64_t)(arrival - m->last_arrival) / TM_NANOS_PER_MS;
+		// The step the arrival times suggest, as the 8-bit step plus
+		// however many wraps bring it closest.
+		double wraps = floor((elapsed_ms - step) / 256.0 + 0.5);
+		double expected;
+		if (wraps < 0)
+			wraps = 0;
+		expected = step + 256.0 * wraps;
+		if (elapsed_ms > TM_CLOCK_SERIES_GAP_MS || fabs(expected - elapsed_ms) > TM_CLOCK_RESTART_TOLERANCE_MS) {
+			// The counter started again.  Carry on counting from
+			// where the host clock says we've got to.
+			TM_DEBUG("tm_clock_model_update: device clock restarted (timestamp %d after %d ms)\n", timestamp, (int)elapsed_ms);
+			m->device_time += (elapsed_ms >= 1) ? (uint64_t)(elapsed_ms + 0.5) : 1;
+			m->series++;
+			restart_window(m);
+		} else {
+			m->device_time += (uint64_t)expected;
+		}
+	}
+	m->have_frame = 1;
+	m->last_timestamp = timestamp;
+	m->last_arrival = arrival;
+	if (arrival) {
+		add_sample(m, m->device_time, arrival);
+		*corrected = fit(m, m->device_time, arrival);
+	}
+	return m->device_time;
+}
@@ -0,0 +1,424 @@
+/* Copyright 2011 Drew Fisher (drew.m.fisher@gmail.com). All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice, this list of
+ *       conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of the copyright holder.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "touchmouse-internal.h"
+#include "image_unpack.h"
+#include "tm_thread.h"
+#include "mono_timer.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#pragma pack(1)
+//  The USB HID reports that contain our data are always 32 bytes, with the
+//  following structure:
+typedef struct {
+	uint8_t report_id; // HID report ID.  In this case, we only care about the
+	                   //   ones that have report_id 0x27.
+	uint8_t length;    // Length of the useful data in this transfer, including
+	                   //   both timestamp and data[] buffer.
+	uint8_t magic[4];  // Four magic bytes.  These are always the same:
+	                   //   0x14 0x01 0x00 0x51
+	uint8_t timestamp; // Measured in milliseconds since the last series of
+	                   //   touch events began, but wraps at 256.  If two or
+	                   //   more consecutive transfers have the same timestamp,
+	                   //   it is likely that their data should be taken
+	                   //   together 
+	uint8_t data[25];  // Compressed touchmouse image data.  Only length-1
+	                   //   bytes of this buffer are useful.
+} report;
+#pragma pack()
+
+//  The image that we get is 181 bytes that are part of a 13x15 (195 pixel)
+//  grid laid out like this:
+//
+//  1 2 3 4 5 6 7 8 9 a b c d e f
+//  -----------------------------+
+//        0 0 0 0 0 0 0 0 0      | 1
+//      0 0 0 0 0 0 0 0 0 0 0    | 2
+//    0 0 0 0 0 0 0 0 0 0 0 0 0  | 3
+//    0 0 0 0 0 0 0 0 0 0 0 0 0  | 4
+//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 5
+//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 6
+//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 7
+//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 8
+//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 9
+//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 10
+//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 11
+//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 12
+//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 13
+//
+//  Each "pixel" in the image may have one of 15 values - 0 through 0xE.  We
+//  receive a stream of nybbles that encodes these 181 bytes, but should present
+//  the unpacked version to the client.
+//
+//  The data we receive is ordered as is English - left to right, top to bottom.
+//
+//  When processing nybbles, it turns out we should process the less-significant
+//  nybble first and the more-significant nybble second.
+//
+//  The compression scheme is simple - pixels are expressed with their raw value
+//  (0 - E) unless there is a run of at least three 0's, in which case two nybbles
+//  F, X encode a run of X+3 zeroes.  Since zeroes are the most common value, this
+//  results in a decent amount of compression.
+//
+//  Note that the usable touch area on the mouse may be even smaller than this 181
+//  pixel arrangement - some of even these pixels may always give a value of 0.
+
+// Every one of the 181 pixels is rewritten before a frame is handed out, and
+// the 14 outside the touch area are zeroed once when the decoder is created and
+// never written again, so resetting needs no clearing of either buffer.
+void tm_decoder_reset(touchmouse_decoder *state)
+{
+	state->buf_index = 0;
+	state->next_is_run_encoded = 0;
+}
+
+// Each payload byte carries two nybbles, and each nybble expands into a run of
+// zero or more identical pixels: a literal is a run of one, a 0xF prefix is a
+// run of none, and the nybble following a prefix is a run of X+3 zeroes.  So
+// every byte decodes to at most two runs, and the only state that carries
+// over from one byte to the next is whether it ended on a bare 0xF.  We
+// precompute the runs for all 256 byte values in both of those states, so the
+// decoder can consume a byte at a time without inspecting nybbles at all.
+// The table is generated at compile time, so decoders need no setup and can
+// run on any number of threads at once.
+typedef struct {
+	uint8_t count[2];    // Pixels produced by the low and high nybble
+	uint8_t value[2];    // Pixel value repeated count[n] times
+	uint8_t run_pending; // Byte ended with a 0xF whose length is in the next byte
+} byte_decoding;
+
+#define LO(b) ((b) & 0xf)
+#define HI(b) ((b) >> 4)
+// With no prefix pending, the low nybble is a literal or a 0xF prefix, and the
+// high nybble is either the length of that run or another literal/prefix.
+#define FRESH(b) { \
+	{ LO(b) == 0xf ? 0 : 1, \
+	  LO(b) == 0xf ? HI(b) + 3 : (HI(b) == 0xf ? 0 : 1) }, \
+	{ LO(b) == 0xf ? 0 : LO(b), \
+	  (LO(b) == 0xf || HI(b) == 0xf) ? 0 : HI(b) }, \
+	LO(b) != 0xf && HI(b) == 0xf }
+// With a prefix pending, the low nybble is the length of its run.
+#define PENDING(b) { \
+	{ LO(b) + 3, HI(b) == 0xf ? 0 : 1 }, \
+	{ 0, HI(b) == 0xf ? 0 : HI(b) }, \
+	HI(b) == 0xf }
+#define ROW16(E, b) E(b), E(b + 1), E(b + 2), E(b + 3), E(b + 4), E(b + 5), E(b + 6), E(b + 7), \
+	E(b + 8), E(b + 9), E(b + 10), E(b + 11), E(b + 12), E(b + 13), E(b + 14), E(b + 15)
+#define ALL256(E) ROW16(E, 0x00), ROW16(E, 0x10), ROW16(E, 0x20), ROW16(E, 0x30), \
+	ROW16(E, 0x40), ROW16(E, 0x50), ROW16(E, 0x60), ROW16(E, 0x70), \
+	ROW16(E, 0x80), ROW16(E, 0x90), ROW16(E, 0xa0), ROW16(E, 0xb0), \
+	ROW16(E, 0xc0), ROW16(E, 0xd0), ROW16(E, 0xe0), ROW16(E, 0xf0)
+
+static const byte_decoding byte_table[2][256] = {
+	{ ALL256(FRESH) },
+	{ ALL256(PENDING) },
+};
+
+// Write count copies of value into the packed image.  Runs are never longer
+// than 18 pixels, so on SSE2 this is two unconditional vector stores; the
+// extra bytes land in the slack at the end of partial_image or on pixels that
+// haven't been decoded yet.
+static void fill_run(uint8_t *dest, uint8_t value, int count)
+{
+#ifdef __SSE2__
+	__m128i v = _mm_set1_epi8((char)value);
+	_mm_storeu_si128((__m128i*)dest, v);
+	_mm_storeu_si128((__m128i*)(dest + 16), v);
+	(void)count;
+#else
+	memset(dest, value, count);
+#endif
+}
+
+// In TOUCHMOUSE_DECODE_IN_PLACE mode, scale count copies of value and write
+// them straight to their final positions in the image.
+static void place_run(touchmouse_decoder *state, uint8_t value, int count)
+{
+	const uint8_t *index = tm_pixel_index + state->buf_index;
+	uint8_t scaled = tm_decoder_table[value];
+	int i;
+	for(i = 0; i < count; i++) {
+		state->image[index[i]] = scaled;
+	}
+}
+
+// Decode a report payload, starting at nybble *position (counted from the
+// low nybble of data[0]).  Returns DECODER_COMPLETE as soon as the 181st pixel
+// has been produced, DECODER_ERROR if a run would overflow the image, and
+// DECODER_IN_PROGRESS if the payload ran out before the image did.  On return
+// *position is the first nybble not yet consumed, so callers that want the
+// rest of the payload after a completed frame can reset and call again.
+static int decode_payload(touchmouse_decoder *state, const uint8_t *data, int length, int *position)
+{
+	int t = *position >> 1;
+	int n = *position & 1;
+	for(; t < length; t++, n = 0) {
+		const byte_decoding* entry = &byte_table[state->next_is_run_encoded][data[t]];
+		if (n == 1) {
+			// Resuming after a frame that ended on the low nybble: decode the
+			// high nybble as if the low one had been an ordinary literal.
+			entry = &byte_table[0][data[t] & 0xf0];
+		}
+		for(; n < 2; n++) {
+			int count = entry->count[n];
+			if (state->buf_index + count > 181) {
+				// Completing this decode would overrun the buffer.  We've been
+				// given invalid data.  Abort.
+				TM_ERROR("decode_payload: run encoded would overflow buffer: got 0xF%X (%d zeros) with only %d bytes to fill in buffer\n", count - 3, count, 181 - state->buf_index);
+				*position = t * 2 + n + 1;
+				return DECODER_ERROR;
+			}
+			if (state->mode == TOUCHMOUSE_DECODE_IN_PLACE) {
+				place_run(state, entry->value[n], count);
+				state->buf_index += count;
+				if (state->buf_index == 181) {
+					*position = t * 2 + n + 1;
+					return DECODER_COMPLETE;
+				}
+			} else {
+				fill_run(state->partial_image + state->buf_index, entry->value[n], count);
+				state->buf_index += count;
+				if (state->buf_index == 181) {
+					tm_unpack(state->partial_image, state->image);
+					*position = t * 2 + n + 1;
+					return DECODER_COMPLETE;
+				}
+			}
+		}
+		state->next_is_run_encoded = entry->run_pending;
+	}
+	*position = length * 2;
+	return DECODER_IN_PROGRESS;
+}
+
+static tm_once global_init_once = TM_ONCE_INIT;
+
+static void global_init(void)
+{
+	TM_DEBUG("Using %s image unpack kernel\n", tm_unpack_select());
+}
+
+// Pick the fastest image unpack kernel for this CPU.  This only has to happen
+// once per process, before the first frame is decoded, but decoders may be
+// set up on several threads at once.
+void tm_decoder_global_init(void)
+{
+	tm_call_once(&global_init_once, global_init);
+}
+
+void tm_decoder_setup(touchmouse_decoder *decoder)
+{
+	tm_decoder_global_init();
+	memset(decoder, 0, sizeof(*decoder));
+	tm_clock_model_init(&decoder->clock);
+}
+
+static void deliver_frame(touchmouse_decoder *decoder, uint8_t timestamp)
+{
+	TM_SPEW("Frame completed, triggering callback\n");
+	decoder->timestamp_last_completed = timestamp;
+	touchmouse_callback_info cbinfo;
+	cbinfo.userdata = decoder->userdata;
+	cbinfo.image = decoder->image;
+	cbinfo.timestamp = decoder->timestamp_last_completed;
+	// The first report is the one least held up behind the rest.
+	uint64_t corrected;
+	uint64_t device_time = tm_clock_model_update(&decoder->clock, timestamp,
+		decoder->frame_first_arrival ? decoder->frame_first_arrival : decoder->report_arrival, &corrected);
+	if (decoder->latency && decoder->report_arrival) {
+		uint64_t now = mono_timer_nanos();
+		tm_latency_record(decoder->latency, now > decoder->report_arrival ? now - decoder->report_arrival : 0);
+	}
+	if (decoder->cb_ex) {
+		touchmouse_callback_info_ex info;
+		info.size = sizeof(info);
+		info.userdata = decoder->userdata;
+		info.image = decoder->image;
+		info.timestamp = timestamp;
+		info.first_arrival_ns = decoder->frame_first_arrival;
+		info.last_arrival_ns = decoder->report_arrival;
+		info.device_time_ms = device_time;
+		info.sequence = decoder->counters.frames;
+		info.corrected_time_ns = corrected;
+		info.series = decoder->clock.series;
+		decoder->cb_ex(&info);
+	} else if (decoder->cb) {
+		decoder->cb(&cbinfo);
+	}
+	TM_COUNTER_INC(&decoder->counters.frames);
+}
+
+// Feed one input report to the decoder.  See touchmouse-internal.h.
+int tm_decoder_feed(touchmouse_decoder *decoder, const unsigned char *data, int res, int drain, uint64_t arrival)
+{
+	decoder->report_arrival = arrival;
+	// Dump contents of transfer
+	if (TM_LOG_ENABLED(TOUCHMOUSE_LOG_SPEW)) {
+		TM_SPEW("tm_decoder_feed: got report: %d bytes:", res);
+		int j;
+		for(j = 0; j < res; j++) {
+			TM_SPEW(" %02X", data[j]);
+		}
+		TM_SPEW("\n");
+	}
+	// Interpret contents.
+	const report* r = (const report*)data;
+	int frames = 0;
+	TM_COUNTER_INC(&decoder->counters.reports);
+	// We only care about report ID 39 (0x27), which should be 32 bytes long
+	if (res == 32 && r->report_id == 0x27) {
+		// The length byte counts the timestamp byte too, so 0 is impossible.
+		// Anything claiming more payload than the report holds is cut down
+		// to what's actually there, rather than trusted.
+		if (r->length == 0) {
+			TM_ERROR("tm_decoder_feed: report has a length of 0\n");
+			TM_COUNTER_INC(&decoder->counters.errors);
+			tm_decoder_reset(decoder);
+			return -1;
+		}
+		int length = r->length - 1;
+		if (length > (int)sizeof(r->data))
+			length = sizeof(r->data);
+		if (length > res - (int)offsetof(report, data))
+			length = res - (int)offsetof(report, data);
+		if (TM_LOG_ENABLED(TOUCHMOUSE_LOG_FLOOD)) {
+			TM_FLOOD("Timestamp: %02X\t%02X bytes:", r->timestamp, length);
+			int t;
+			for(t = 0; t < length; t++) {
+				TM_FLOOD(" %02X", r->data[t]);
+			}
+			TM_FLOOD("\n");
+		}
+		// Reset the decoder if we've seen one timestamp already from earlier
+		// transfers, and this one doesn't match.
+		if ((decoder->buf_index != 0 || decoder->next_is_run_encoded) && r->timestamp != decoder->timestamp_in_progress) {
+			TM_FLOOD("tm_decoder_feed: timestamps don't match: got %d, expected %d\n", r->timestamp, decoder->timestamp_in_progress);
+			TM_COUNTER_INC(&decoder->counters.resets);
+			tm_decoder_reset(decoder); // Reset decoder for next transfer
+		}
+		decoder->timestamp_in_progress = r->timestamp;
+		int position = 0;
+		if (decoder->buf_index == 0 && !decoder->next_is_run_encoded)
+			decoder->frame_first_arrival = arrival;
+		while (position < length * 2) {
+			int result = decode_payload(decoder, r->data, length, &position);
+			if (result == DECODER_COMPLETE) {
+				deliver_frame(decoder, r->timestamp);
+				tm_decoder_reset(decoder); // Reset decoder for next transfer
+				decoder->frame_first_arrival = arrival;
+				frames++;
+				if (!drain)
+					break;
+			} else if (result == DECODER_ERROR) {
+				TM_ERROR("Caught error in decoder, aborting decode!\n");
+				TM_COUNTER_INC(&decoder->counters.errors);
+				tm_decoder_reset(decoder);
+				return -1;
+			}
+		}
+	} else {
+		TM_COUNTER_INC(&decoder->counters.ignored);
+	}
+	return frames;
+}
+
+int touchmouse_decoder_init(touchmouse_decoder **decoder)
+{
+	touchmouse_decoder* dec = (touchmouse_decoder*)malloc(sizeof(touchmouse_decoder));
+	if (!dec) {
+		TM_ERROR("touchmouse_decoder_init: out of memory\n");
+		return -1;
+	}
+	tm_decoder_setup(dec);
+	*decoder = dec;
+	return 0;
+}
+
+int touchmouse_decoder_free(touchmouse_decoder *decoder)
+{
+	free(decoder);
+	return 0;
+}
+
+int touchmouse_decoder_set_image_update_callback(touchmouse_decoder *decoder, touchmouse_image_callback callback)
+{
+	decoder->cb = callback;
+	decoder->cb_ex = NULL;
+	return 0;
+}
+
+int touchmouse_decoder_set_image_update_callback_ex(touchmouse_decoder *decoder, touchmouse_image_callback_ex callback)
+{
+	decoder->cb_ex = callback;
+	decoder->cb = NULL;
+	return 0;
+}
+
+int touchmouse_decoder_set_userdata(touchmouse_decoder *decoder, void *userdata)
+{
+	decoder->userdata = userdata;
+	return 0;
+}
+
+int touchmouse_decoder_set_mode(touchmouse_decoder *decoder, touchmouse_decode_mode mode)
+{
+	switch (mode) {
+		case TOUCHMOUSE_DECODE_BUFFERED:
+		case TOUCHMOUSE_DECODE_IN_PLACE:
+			break;
+		default:
+			TM_ERROR("touchmouse_decoder_set_mode: unknown mode %d\n", mode);
+			return -1;
+	}
+	// Whatever has been decoded so far is laid out for the old mode.
+	tm_decoder_reset(decoder);
+	decoder->mode = mode;
+	return 0;
+}
+
+int touchmouse_decoder_feed(touchmouse_decoder *decoder, const unsigned char *report, int length)
+{
+	return tm_decoder_feed(decoder, report, length, 1, 0);
+}
+
+int touchmouse_decoder_feed_timestamped(touchmouse_decoder *decoder, const unsigned char *report, int length, uint64_t arrival_ns)
+{
+	return tm_decoder_feed(decoder, report, length, 1, arrival_ns);
+}
+
+int touchmouse_decoder_reset(touchmouse_decoder *decoder)
+{
+	tm_decoder_reset(decoder);
+	return 0;
+}
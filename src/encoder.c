@@ -0,0 +1,105 @@
+/* Image encoder: the inverse of the decoder.  Turns an image back into the
+ * reports a TouchMouse would have sent for it, using the compression scheme
+ * described in decoder.c.
+ */
+#include <string.h>
+#include <stdint.h>
+
+#include "touchmouse-internal.h"
+#include "image_unpack.h"
+
+// Payload bytes in one report, after the timestamp.
+#define TM_REPORT_PAYLOAD 25
+// The longest run one F,X pair can encode.
+#define TM_MAX_RUN 18
+
+// Encode 181 levels known to be in range.
+static int encode_levels(const uint8_t *levels, uint8_t timestamp, unsigned char reports[][32])
+{
+	// One more than the most the pixels can take, for evening up below.
+	uint8_t nybbles[TM_PACKED_PIXELS + 1];
+	uint8_t packed[(TM_PACKED_PIXELS + 1) / 2];
+	int n = 0;
+	int i = 0;
+	int last_run = -1;
+	while (i < TM_PACKED_PIXELS) {
+		if (levels[i] != 0) {
+			nybbles[n++] = levels[i++];
+			continue;
+		}
+		int end = i + 1;
+		while (end < TM_PACKED_PIXELS && levels[end] == 0 && end - i < TM_MAX_RUN)
+			end++;
+		if (end - i >= 3) {
+			last_run = n;
+			nybbles[n++] = 0xf;
+			nybbles[n++] = end - i - 3;
+			i = end;
+		} else {
+			// Too short for a run; zeroes are written like any other level.
+			while (i < end)
+				nybbles[n++] = levels[i++];
+		}
+	}
+	// An odd number of nybbles would leave a spare one at the end of the last
+	// byte, which a decoder reading on past the image takes as the start of
+	// the next.  Spell one zero of the last run out instead, which costs the
+	// one nybble needed.  Only an image without a single run of zeroes has to
+	// be padded.
+	if ((n & 1) && last_run >= 0) {
+		int zeroes = nybbles[last_run + 1] + 3;
+		memmove(&nybbles[last_run + 1], &nybbles[last_run], n - last_run);
+		n++;
+		nybbles[last_run] = 0;
+		if (zeroes == 3) {
+			nybbles[last_run + 1] = 0;
+			nybbles[last_run + 2] = 0;
+		} else {
+			nybbles[last_run + 1] = 0xf;
+			nybbles[last_run + 2] = zeroes - 4;
+		}
+	}
+	if (n & 1)
+		nybbles[n] = 0;
+	int bytes = (n + 1) / 2;
+	// Low nybble first.
+	for(i = 0; i < bytes; i++)
+		packed[i] = nybbles[2 * i] | (nybbles[2 * i + 1] << 4);
+
+	int count = 0;
+	int offset;
+	for(offset = 0; offset < bytes; offset += TM_REPORT_PAYLOAD) {
+		int length = bytes - offset < TM_REPORT_PAYLOAD ? bytes - offset : TM_REPORT_PAYLOAD;
+		unsigned char *r = reports[count++];
+		r[0] = 0x27;
+		r[1] = length + 1; // The length counts the timestamp too
+		r[2] = 0x14; r[3] = 0x01; r[4] = 0x00; r[5] = 0x51;
+		r[6] = timestamp;
+		memcpy(r + 7, packed + offset, length);
+		memset(r + 7 + length, 0, TM_REPORT_PAYLOAD - length);
+	}
+	return count;
+}
+
+int touchmouse_encode_pixels(const uint8_t *pixels, uint8_t timestamp, unsigned char reports[][32])
+{
+	int i;
+	for(i = 0; i < TM_PACKED_PIXELS; i++) {
+		if (pixels[i] > 14) {
+			TM_ERROR("touchmouse_encode_pixels: pixel %d has level %d, but the most is 14\n", i, pixels[i]);
+			return -1;
+		}
+	}
+	return encode_levels(pixels, timestamp, reports);
+}
+
+int touchmouse_encode_image(const uint8_t *image, uint8_t timestamp, unsigned char reports[][32])
+{
+	uint8_t levels[TM_PACKED_PIXELS];
+	int i;
+	// tm_decoder_table[k] is k * 255 / 14 rounded, so this finds the nearest
+	// level.
+	for(i = 0; i < TM_PACKED_PIXELS; i++)
+		levels[i] = (image[tm_pixel_index[i]] * 14 + 127) / 255;
+	return encode_levels(levels, timestamp, reports);
+}
@@ -0,0 +1,195 @@
+/* Copyright 2011 Drew Fisher (drew.m.fisher@gmail.com). All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice, this list of
+ *       conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of the copyright holder.
+*/
+#include <string.h>
+
+#include "image_unpack.h"
+#include "tm_thread.h"
+
+const uint8_t tm_decoder_table[16] = {0, 18, 36, 55, 73, 91, 109, 128, 146, 164, 182, 200, 219, 237, 255, 0 };
+
+tm_unpack_func tm_unpack = tm_unpack_scalar;
+
+// SPANn(s) expands to the image offsets of a row of n pixels starting at s.
+// Rows 0-3 are missing
+// some pixels at either end (see the layout diagram in decoder.c); the
+// remaining rows are all 15 pixels wide.
+#define SPAN9(s) (s), (s) + 1, (s) + 2, (s) + 3, (s) + 4, (s) + 5, (s) + 6, (s) + 7, (s) + 8
+#define SPAN11(s) SPAN9(s), (s) + 9, (s) + 10
+#define SPAN13(s) SPAN11(s), (s) + 11, (s) + 12
+#define SPAN15(s) SPAN13(s), (s) + 13, (s) + 14
+
+const uint8_t tm_pixel_index[TM_PACKED_PIXELS] = {
+	SPAN9(0 * 15 + 3),
+	SPAN11(1 * 15 + 2),
+	SPAN13(2 * 15 + 1),
+	SPAN13(3 * 15 + 1),
+	SPAN15(4 * 15), SPAN15(5 * 15), SPAN15(6 * 15), SPAN15(7 * 15),
+	SPAN15(8 * 15), SPAN15(9 * 15), SPAN15(10 * 15), SPAN15(11 * 15),
+	SPAN15(12 * 15),
+};
+
+const uint8_t tm_unused_pixel_index[TM_IMAGE_PIXELS - TM_PACKED_PIXELS] = {
+	0, 1, 2, 12, 13, 14,
+	15, 16, 28, 29,
+	30, 44,
+	45, 59,
+};
+
+void tm_unpack_scalar(const uint8_t *packed, uint8_t *image)
+{
+	int i;
+	for(i = 0; i < TM_IMAGE_PIXELS - TM_PACKED_PIXELS; i++)
+		image[tm_unused_pixel_index[i]] = 0;
+	for(i = 0; i < TM_PACKED_PIXELS; i++)
+		image[tm_pixel_index[i]] = tm_decoder_table[packed[i]];
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define TM_HAVE_X86_KERNELS
+#endif
+
+#ifdef TM_HAVE_X86_KERNELS
+#include <immintrin.h>
+
+// From row 4 onwards every row is a full 15 pixels wide, so the rest of the
+// image is one contiguous copy of the packed pixels, shifted by the 14 pixels
+// missing from the corners of rows 0-3.  The first 64 bytes of the image
+// (rows 0-3 plus the start of row 4) are built from four 16-byte shuffles,
+// each reading a window of packed pixels starting at front_base[k] and
+// placing them with front_mask[k] (0x80 produces a zero).
+#define FRONT_BYTES 64
+#define BULK_SHIFT 14
+
+static uint8_t front_mask[4][16];
+static int front_base[4];
+
+static void build_front_masks(void)
+{
+	int source[FRONT_BYTES];
+	int i;
+	int k;
+	for(k = 0; k < FRONT_BYTES; k++)
+		source[k] = -1;
+	for(i = 0; i < TM_PACKED_PIXELS; i++) {
+		if (tm_pixel_index[i] < FRONT_BYTES)
+			source[tm_pixel_index[i]] = i;
+	}
+	for(k = 0; k < 4; k++) {
+		int j;
+		front_base[k] = -1;
+		for(j = 0; j < 16; j++) {
+			int s = source[k * 16 + j];
+			if (s >= 0 && (front_base[k] < 0 || s < front_base[k]))
+				front_base[k] = s;
+		}
+		for(j = 0; j < 16; j++) {
+			int s = source[k * 16 + j];
+			front_mask[k][j] = (s >= 0) ? (uint8_t)(s - front_base[k]) : 0x80;
+		}
+	}
+}
+
+__attribute__((target("ssse3")))
+static void tm_unpack_ssse3(const uint8_t *packed, uint8_t *image)
+{
+	const __m128i lut = _mm_loadu_si128((const __m128i*)tm_decoder_table);
+	int k;
+	for(k = 0; k < 4; k++) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(packed + front_base[k]));
+		v = _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i*)front_mask[k]));
+		_mm_storeu_si128((__m128i*)(image + k * 16), _mm_shuffle_epi8(lut, v));
+	}
+	int i;
+	for(i = FRONT_BYTES; i + 16 <= TM_IMAGE_PIXELS; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(packed + i - BULK_SHIFT));
+		_mm_storeu_si128((__m128i*)(image + i), _mm_shuffle_epi8(lut, v));
+	}
+	// The last chunk overlaps the previous one rather than running off the end.
+	i = TM_IMAGE_PIXELS - 16;
+	__m128i v = _mm_loadu_si128((const __m128i*)(packed + i - BULK_SHIFT));
+	_mm_storeu_si128((__m128i*)(image + i), _mm_shuffle_epi8(lut, v));
+}
+
+__attribute__((target("avx2")))
+static void tm_unpack_avx2(const uint8_t *packed, uint8_t *image)
+{
+	// vpshufb shuffles within each 128-bit lane, so both the table and the
+	// front masks are simply duplicated per lane.
+	const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)tm_decoder_table));
+	int k;
+	for(k = 0; k < 4; k += 2) {
+		__m256i v = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(packed + front_base[k]))),
+			_mm_loadu_si128((const __m128i*)(packed + front_base[k + 1])), 1);
+		__m256i mask = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)front_mask[k])),
+			_mm_loadu_si128((const __m128i*)front_mask[k + 1]), 1);
+		v = _mm256_shuffle_epi8(v, mask);
+		_mm256_storeu_si256((__m256i*)(image + k * 16), _mm256_shuffle_epi8(lut, v));
+	}
+	int i;
+	for(i = FRONT_BYTES; i + 32 <= TM_IMAGE_PIXELS; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(packed + i - BULK_SHIFT));
+		_mm256_storeu_si256((__m256i*)(image + i), _mm256_shuffle_epi8(lut, v));
+	}
+	i = TM_IMAGE_PIXELS - 32;
+	__m256i v = _mm256_loadu_si256((const __m256i*)(packed + i - BULK_SHIFT));
+	_mm256_storeu_si256((__m256i*)(image + i), _mm256_shuffle_epi8(lut, v));
+}
+#endif // TM_HAVE_X86_KERNELS
+
+static tm_once select_once = TM_ONCE_INIT;
+static const char *selected_name;
+
+static void select_kernel(void)
+{
+#ifdef TM_HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		build_front_masks();
+		tm_unpack = tm_unpack_avx2;
+		selected_name = "avx2";
+		return;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		build_front_masks();
+		tm_unpack = tm_unpack_ssse3;
+		selected_name = "ssse3";
+		return;
+	}
+#endif
+	tm_unpack = tm_unpack_scalar;
+	selected_name = "scalar";
+}
+
+// The masks are built and tm_unpack set only once, so a thread already
+// decoding never sees either change under it.
+const char* tm_unpack_select(void)
+{
+	tm_call_once(&select_once, select_kernel);
+	return selected_name;
+}
@@ -0,0 +1,46 @@
+#ifndef __IMAGE_UNPACK_H__
+#define __IMAGE_UNPACK_H__
+
+#include <stdint.h>
+
+// The device sends 181 pixels, which we present as a 13x15 image.  See the
+// layout diagram in decoder.c.
+#define TM_PACKED_PIXELS 181
+#define TM_IMAGE_PIXELS 195
+
+// Buffers holding packed pixels must have this many bytes of slack past the
+// 181 real ones, so that run fills and vector loads may safely overrun.
+#define TM_PACKED_SLACK 32
+
+// There are 15 possible values that each pixel can take on, but we'd like to
+// scale them up to the full range of a uint8_t for convenience.  The 16th
+// entry is never produced by the decoder; it only pads the table out to the
+// width of a vector shuffle.
+extern const uint8_t tm_decoder_table[16];
+
+// Position in the 195-byte image of each of the 181 packed pixels, in the
+// order the device sends them.  Generated at compile time from the row
+// layout, and shared by everything that needs to map between the two.
+extern const uint8_t tm_pixel_index[TM_PACKED_PIXELS];
+
+// Positions in the 195-byte image that the device never sends; these are
+// always zero.
+extern const uint8_t tm_unused_pixel_index[TM_IMAGE_PIXELS - TM_PACKED_PIXELS];
+
+// Scales the 181 packed pixels through tm_decoder_table and scatters them to
+// their positions in the 195-byte image, zeroing the pixels outside the
+// touch area.
+typedef void (*tm_unpack_func)(const uint8_t *packed, uint8_t *image);
+
+// The unpack kernel in use.  Starts out as the scalar one, and is replaced by
+// the fastest one the CPU supports when tm_unpack_select() is called.
+extern tm_unpack_func tm_unpack;
+
+// Pick the best unpack kernel for this CPU and store it in tm_unpack.
+// Returns a short name for the kernel chosen.  Safe to call from any number
+// of threads; the choice is only made the first time.
+const char* tm_unpack_select(void);
+
+void tm_unpack_scalar(const uint8_t *packed, uint8_t *image);
+
+#endif // __IMAGE_UNPACK_H__
@@ -0,0 +1,133 @@
+/* Log-linear latency histogram; see touchmouse-internal.h.
+ *
+ * A single thread records, so the counts are updated with plain relaxed
+ * stores.  Readers may see a summary that is a record or two out of date, but
+ * never a torn count.
+ */
+#include <string.h>
+#include <stdint.h>
+
+#include "touchmouse-internal.h"
+#include "tm_thread.h"
+
+static int highest_bit(uint64_t value)
+{
+	return 63 - __builtin_clzll(value);
+}
+
+static int bucket_index(uint64_t value)
+{
+	int bit;
+	if (value < (1 << TM_LATENCY_SUB_BITS))
+		return (int)value;
+	bit = highest_bit(value);
+	if (bit >= TM_LATENCY_MAX_BITS)
+		return TM_LATENCY_BUCKETS - 1;
+	// The top TM_LATENCY_SUB_BITS + 1 bits pick the bucket.
+	return ((bit - TM_LATENCY_SUB_BITS + 1) << TM_LATENCY_SUB_BITS) +
+	       (int)(value >> (bit - TM_LATENCY_SUB_BITS)) - (1 << TM_LATENCY_SUB_BITS);
+}
+
+// The largest value that lands in a bucket.
+static uint64_t bucket_upper_bound(int index)
+{
+	int shift;
+	uint64_t mantissa;
+	if (index < (1 << TM_LATENCY_SUB_BITS))
+		return index;
+	shift = (index >> TM_LATENCY_SUB_BITS) - 1;
+	mantissa = (index & ((1 << TM_LATENCY_SUB_BITS) - 1)) + (1 << TM_LATENCY_SUB_BITS);
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void tm_latency_record(tm_latency_histogram *h, uint64_t nanos)
+{
+	if (TM_ATOMIC_LOAD(&h->reset_requested)) {
+		int i;
+		for (i = 0; i < TM_LATENCY_BUCKETS; i++)
+			TM_ATOMIC_STORE_RELAXED(&h->buckets[i], 0);
+		TM_ATOMIC_STORE_RELAXED(&h->sum, 0);
+		TM_ATOMIC_STORE_RELAXED(&h->min, 0);
+		TM_ATOMIC_STORE_RELAXED(&h->max, 0);
+		TM_ATOMIC_STORE_RELAXED(&h->count, 0);
+		TM_ATOMIC_STORE(&h->reset_requested, 0);
+	}
+	TM_COUNTER_INC(&h->buckets[bucket_index(nanos)]);
+	TM_ATOMIC_STORE_RELAXED(&h->sum, TM_ATOMIC_LOAD_RELAXED(&h->sum) + nanos);
+	if (h->count == 0 || nanos < h->min)
+		TM_ATOMIC_STORE_RELAXED(&h->min, nanos);
+	if (nanos > h->max)
+		TM_ATOMIC_STORE_RELAXED(&h->max, nanos);
+	TM_COUNTER_INC(&h->count);
+}
+
+void tm_latency_reset(tm_latency_histogram *h)
+{
+	// The recording thread does the actual clearing, so that it stays the
+	// only writer.
+	TM_ATOMIC_STORE(&h->reset_requested, 1);
+}
+
+// Walk the buckets to find the given percentile of total values.
+static uint64_t percentile_of(const tm_latency_histogram *h, uint64_t total, double percentile)
+{
+	uint64_t target, seen = 0, max;
+	int i;
+	if (total == 0)
+		return 0;
+	if (percentile < 0)
+		percentile = 0;
+	if (percentile > 100)
+		percentile = 100;
+	// The rank of the value wanted, counting from 1.
+	target = (uint64_t)(percentile / 100.0 * total + 0.5);
+	if (target < 1)
+		target = 1;
+	max = TM_ATOMIC_LOAD_RELAXED(&h->max);
+	for (i = 0; i < TM_LATENCY_BUCKETS; i++) {
+		seen += TM_ATOMIC_LOAD_RELAXED(&h->buckets[i]);
+		if (seen >= target) {
+			uint64_t bound = bucket_upper_bound(i);
+			return (i == TM_LATENCY_BUCKETS - 1 || bound > max) ? max : bound;
+		}
+	}
+	return max;
+}
+
+static uint64_t bucket_total(const tm_latency_histogram *h)
+{
+	uint64_t total = 0;
+	int i;
+	for (i = 0; i < TM_LATENCY_BUCKETS; i++)
+		total += TM_ATOMIC_LOAD_RELAXED(&h->buckets[i]);
+	return total;
+}
+
+uint64_t tm_latency_percentile(const tm_latency_histogram *h, double percentile)
+{
+	if (TM_ATOMIC_LOAD(&h->reset_requested))
+		return 0;
+	return percentile_of(h, bucket_total(h), percentile);
+}
+
+void tm_latency_summarize(const tm_latency_histogram *h, touchmouse_latency_stats *stats)
+{
+	uint64_t total, count;
+	memset(stats, 0, sizeof(*stats));
+	if (TM_ATOMIC_LOAD(&h->reset_requested))
+		return;
+	// Count what the buckets hold rather than trusting count, which may
+	// have been bumped since, so that the percentiles agree with each other.
+	total = bucket_total(h);
+	if (total == 0)
+		return;
+	stats->count = total;
+	stats->min_ns = TM_ATOMIC_LOAD_RELAXED(&h->min);
+	stats->max_ns = TM_ATOMIC_LOAD_RELAXED(&h->max);
+	count = TM_ATOMIC_LOAD_RELAXED(&h->count);
+	stats->mean_ns = TM_ATOMIC_LOAD_RELAXED(&h->sum) / (count ? count : total);
+	stats->p50_ns = percentile_of(h, total, 50);
+	stats->p90_ns = percentile_of(h, total, 90);
+	stats->p99_ns = percentile_of(h, total, 99);
+	stats->p999_ns = percentile_of(h, total, 99.9);
+}
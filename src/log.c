@@ -0,0 +1,571 @@
+/* Copyright 2011 Drew Fisher (drew.m.fisher@gmail.com). All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice, this list of
+ *       conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of the copyright holder.
+*/
+
+// Logging.  By default, tm_log() prints straight to stderr.  A log callback
+// receives binary records instead: the format string and the arguments,
+// captured without formatting anything.  In asynchronous mode, tm_log() only
+// copies the record into a lock-free ring, which a background thread drains.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <wchar.h>
+
+#include "touchmouse-internal.h"
+#include "mono_timer.h"
+#include "tm_thread.h"
+
+// Records the asynchronous ring holds.  Must be a power of two.
+#define TM_LOG_RING_SIZE 256
+// How often the drain thread wakes up when nobody prods it.
+#define TM_LOG_DRAIN_INTERVAL_MS 20
+// Longest message the drain thread prints to stderr.
+#define TM_LOG_LINE_MAX 1024
+
+touchmouse_loglevel tm_log_level = TOUCHMOUSE_LOG_INFO;
+
+static touchmouse_log_callback log_callback = NULL;
+static void *log_callback_userdata = NULL;
+
+// A bounded multi-producer queue after Dmitry Vyukov's: each slot's sequence
+// number says whether it is free for the producer claiming position pos
+// (sequence == pos) or holds a record for the consumer (sequence == pos + 1).
+typedef struct {
+	size_t sequence;
+	touchmouse_log_record record;
+} log_slot;
+
+static struct {
+	log_slot slots[TM_LOG_RING_SIZE];
+	size_t enqueue_pos;
+	size_t dequeue_pos;
+	int initialized;
+	int async;
+	// tm_log() calls that found async set and may still be queueing
+	int writers;
+	int stop;
+	tm_thread thread;
+	tm_event wake;
+} log_ring;
+
+static uint64_t log_records_dropped = 0;
+
+// Set global log level.  This should probably be pushed down into contexts,
+// but HIDAPI doesn't support contexts. :(
+void touchmouse_set_log_level(touchmouse_loglevel level)
+{
+	tm_log_level = level;
+}
+
+void touchmouse_set_log_callback(touchmouse_log_callback callback, void *userdata)
+{
+	log_callback_userdata = userdata;
+	log_callback = callback;
+}
+
+uint64_t touchmouse_get_log_records_dropped(void)
+{
+	return TM_ATOMIC_LOAD_RELAXED(&log_records_dropped);
+}
+
+// Kinds of argument a conversion takes.
+typedef enum {
+	ARG_NONE,    // %%, or %n, which we never write through
+	ARG_SIGNED,
+	ARG_UNSIGNED,
+	ARG_CHAR,
+	ARG_DOUBLE,
+	ARG_POINTER,
+	ARG_STRING,
+} arg_kind;
+
+// One parsed conversion specification.
+typedef struct {
+	const char *start;   // the '%'
+	const char *end;     // just past the conversion character
+	int width_star;
+	int precision_star;
+	char length[3];      // "", "hh", "h", "l", "ll", "z", "j", "t" or "L"
+	char conversion;
+	arg_kind kind;
+} conversion_spec;
+
+// Parse the conversion specification starting at the '%' at p.  Returns 0 if
+// the format ends before the conversion character.
+static int parse_spec(const char *p, conversion_spec *spec)
+{
+	memset(spec, 0, sizeof(*spec));
+	spec->start = p++;
+	while (*p && strchr("-+ #0'", *p))
+		p++;
+	if (*p == '*') {
+		spec->width_star = 1;
+		p++;
+	} else {
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->precision_star = 1;
+			p++;
+		} else {
+			while (*p >= '0' && *p <= '9')
+				p++;
+		}
+	}
+	if ((p[0] == 'h' && p[1] == 'h') || (p[0] == 'l' && p[1] == 'l')) {
+		memcpy(spec->length, p, 2);
+		p += 2;
+	} else if (*p && strchr("hlzjtL", *p)) {
+		spec->length[0] = *p++;
+	}
+	if (!*p)
+		return 0;
+	spec->conversion = *p++;
+	spec->end = p;
+	switch (spec->conversion) {
+	case 'd': case 'i':
+		spec->kind = ARG_SIGNED;
+		break;
+	case 'u': case 'o': case 'x': case 'X':
+		spec->kind = ARG_UNSIGNED;
+		break;
+	case 'c':
+		spec->kind = ARG_CHAR;
+		break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		spec->kind = ARG_DOUBLE;
+		break;
+	case 'p':
+		spec->kind = ARG_POINTER;
+		break;
+	case 's':
+		spec->kind = ARG_STRING;
+		break;
+	case 'n':
+		// Consumes a pointer, but there is nothing to record.
+		spec->kind = ARG_POINTER;
+		break;
+	default:
+		spec->kind = ARG_NONE;
+		break;
+	}
+	return 1;
+}
+
+// Copy a string argument into the record's string space, truncating it to
+// whatever room is left.  Returns its offset.
+static uint32_t capture_string(touchmouse_log_record *record, size_t *used, const char *s)
+{
+	uint32_t offset = (uint32_t)*used;
+	size_t room = TOUCHMOUSE_LOG_STRING_SPACE - 1 - *used;
+	size_t len;
+	if (!s)
+		s = "(null)";
+	len = strlen(s);
+	if (len > room)
+		len = room;
+	memcpy(record->strings + offset, s, len);
+	record->strings[offset + len] = '\0';
+	*used += len + (len < room ? 1 : 0);
+	return offset;
+}
+
+static uint32_t capture_wide_string(touchmouse_log_record *record, size_t *used, const wchar_t *ws)
+{
+	uint32_t offset = (uint32_t)*used;
+	size_t room = TOUCHMOUSE_LOG_STRING_SPACE - 1 - *used;
+	size_t len = 0;
+	mbstate_t state;
+	if (!ws)
+		return capture_string(record, used, NULL);
+	memset(&state, 0, sizeof(state));
+	for (; *ws; ws++) {
+		char mb[16];
+		size_t n = ((unsigned long)*ws < 0x80) ? (mb[0] = (char)*ws, 1) : wcrtomb(mb, *ws, &state);
+		if (n == (size_t)-1) {
+			mb[0] = '?';
+			n = 1;
+			memset(&state, 0, sizeof(state));
+		}
+		if (len + n > room)
+			break;
+		memcpy(record->strings + offset + len, mb, n);
+		len += n;
+	}
+	record->strings[offset + len] = '\0';
+	*used += len + (len < room ? 1 : 0);
+	return offset;
+}
+
+// Fill in record from a format and its arguments.  This only copies values:
+// nothing is formatted.
+static void capture_record(touchmouse_log_record *record, touchmouse_loglevel level, const char *fmt, va_list args)
+{
+	const char *p = fmt;
+	size_t strings_used = 0;
+	int n = 0;
+	record->level = level;
+	record->timestamp = mono_timer_nanos();
+	record->format = fmt;
+	record->strings[0] = '\0';
+	while ((p = strchr(p, '%')) != NULL) {
+		conversion_spec spec;
+		if (!parse_spec(p, &spec))
+			break;
+		p = spec.end;
+		if (spec.kind == ARG_NONE)
+			continue;
+		// Running out of room means we can't consume the rest of the
+		// arguments in order, so stop altogether.
+		if (n + spec.width_star + spec.precision_star + 1 > TOUCHMOUSE_LOG_MAX_ARGS)
+			break;
+		if (spec.width_star)
+			record->args[n++].i = va_arg(args, int);
+		if (spec.precision_star)
+			record->args[n++].i = va_arg(args, int);
+		switch (spec.kind) {
+		case ARG_SIGNED:
+			// Convert now exactly as printf would, so that formatting
+			// can print every integer as a long long.
+			switch (spec.length[0]) {
+			case 'h': record->args[n].i = spec.length[1] ? (signed char)va_arg(args, int) : (short)va_arg(args, int); break;
+			case 'l': record->args[n].i = spec.length[1] ? va_arg(args, long long) : va_arg(args, long); break;
+			case 'z': record->args[n].i = (int64_t)va_arg(args, size_t); break;
+			case 'j': record->args[n].i = va_arg(args, intmax_t); break;
+			case 't': record->args[n].i = va_arg(args, ptrdiff_t); break;
+			default: record->args[n].i = va_arg(args, int); break;
+			}
+			break;
+		case ARG_UNSIGNED:
+			switch (spec.length[0]) {
+			case 'h': record->args[n].i = spec.length[1] ? (unsigned char)va_arg(args, unsigned int) : (unsigned short)va_arg(args, unsigned int); break;
+			case 'l': record->args[n].i = (int64_t)(spec.length[1] ? va_arg(args, unsigned long long) : va_arg(args, unsigned long)); break;
+			case 'z': record->args[n].i = (int64_t)va_arg(args, size_t); break;
+			case 'j': record->args[n].i = (int64_t)va_arg(args, uintmax_t); break;
+			case 't': record->args[n].i = (int64_t)va_arg(args, ptrdiff_t); break;
+			default: record->args[n].i = va_arg(args, unsigned int); break;
+			}
+			break;
+		case ARG_CHAR:
+			record->args[n].i = (spec.length[0] == 'l') ? (int64_t)va_arg(args, wint_t) : va_arg(args, int);
+			break;
+		case ARG_DOUBLE:
+			record->args[n].d = (spec.length[0] == 'L') ? (double)va_arg(args, long double) : va_arg(args, double);
+			break;
+		case ARG_POINTER:
+			record->args[n].p = va_arg(args, void*);
+			break;
+		case ARG_STRING:
+			if (spec.length[0] == 'l')
+				record->args[n].s = capture_wide_string(record, &strings_used, va_arg(args, const wchar_t*));
+			else
+				record->args[n].s = capture_string(record, &strings_used, va_arg(args, const char*));
+			break;
+		default:
+			break;
+		}
+		n++;
+	}
+	record->arg_count = n;
+}
+
+// Append to a bounded buffer, keeping count of how much we would have written.
+typedef struct {
+	char *buf;
+	int size;
+	int len;
+} format_output;
+
+static void output_text(format_output *out, const char *text, int len)
+{
+	if (out->len < out->size - 1) {
+		int room = out->size - 1 - out->len;
+		memcpy(out->buf + out->len, text, len < room ? len : room);
+	}
+	out->len += len;
+}
+
+int touchmouse_format_log_record(const touchmouse_log_record *record, char *buf, int size)
+{
+	format_output out;
+	const char *p = record->format;
+	int n = 0;
+	out.buf = buf;
+	out.size = size;
+	out.len = 0;
+	while (*p) {
+		conversion_spec spec;
+		char sub[32];
+		int sub_len = 0;
+		char *dest;
+		int room, len = 0;
+		const char *q;
+		const char *percent = strchr(p, '%');
+		if (!percent) {
+			output_text(&out, p, (int)strlen(p));
+			break;
+		}
+		output_text(&out, p, (int)(percent - p));
+		if (!parse_spec(percent, &spec)) {
+			output_text(&out, percent, (int)strlen(percent));
+			break;
+		}
+		p = spec.end;
+		if (spec.conversion == '%') {
+			output_text(&out, "%", 1);
+			continue;
+		}
+		if (spec.kind == ARG_NONE)
+			continue;
+		if (n + spec.width_star + spec.precision_star + 1 > record->arg_count) {
+			// These arguments weren't captured.
+			output_text(&out, spec.start, (int)strlen(spec.start));
+			break;
+		}
+		if (spec.conversion == 'n') {
+			n++;
+			continue;
+		}
+		// Rebuild the specification with any '*' replaced by the captured
+		// value, and the length modifier by the one we stored under.
+		sub[sub_len++] = '%';
+		for (q = spec.start + 1; *q && strchr("-+ #0'", *q); q++)
+			sub[sub_len++] = *q;
+		if (spec.width_star) {
+			int64_t width = record->args[n++].i;
+			if (width < 0) {
+				sub[sub_len++] = '-';
+				width = -width;
+			}
+			sub_len += snprintf(sub + sub_len, sizeof(sub) - sub_len, "%d", (int)width);
+		} else {
+			for (; *q >= '0' && *q <= '9'; q++)
+				sub[sub_len++] = *q;
+		}
+		if (spec.precision_star) {
+			int64_t precision = record->args[n++].i;
+			if (precision >= 0)
+				sub_len += snprintf(sub + sub_len, sizeof(sub) - sub_len, ".%d", (int)precision);
+		} else if (*q == '.') {
+			sub[sub_len++] = *q++;
+			for (; *q >= '0' && *q <= '9'; q++)
+				sub[sub_len++] = *q;
+		}
+		if (sub_len > (int)sizeof(sub) - 4) {
+			// Absurdly long flags or width; don't bother.
+			n++;
+			continue;
+		}
+		if (spec.kind == ARG_SIGNED || spec.kind == ARG_UNSIGNED) {
+			sub[sub_len++] = 'l';
+			sub[sub_len++] = 'l';
+		}
+		sub[sub_len++] = (spec.kind == ARG_STRING) ? 's' : spec.conversion;
+		sub[sub_len] = '\0';
+
+		// snprintf() straight into the buffer, or just measure once it's full.
+		room = out.len < out.size ? out.size - out.len : 0;
+		dest = room ? buf + out.len : NULL;
+		switch (spec.kind) {
+		case ARG_SIGNED:
+			len = snprintf(dest, room, sub, (long long)record->args[n].i);
+			break;
+		case ARG_UNSIGNED:
+			len = snprintf(dest, room, sub, (unsigned long long)record->args[n].i);
+			break;
+		case ARG_CHAR:
+			len = snprintf(dest, room, sub, (record->args[n].i >= 0 && record->args[n].i < 0x80) ? (int)record->args[n].i : '?');
+			break;
+		case ARG_DOUBLE:
+			len = snprintf(dest, room, sub, record->args[n].d);
+			break;
+		case ARG_POINTER:
+			len = snprintf(dest, room, sub, record->args[n].p);
+			break;
+		case ARG_STRING:
+			len = snprintf(dest, room, sub, record->strings + record->args[n].s);
+			break;
+		default:
+			break;
+		}
+		if (len > 0)
+			out.len += len;
+		n++;
+	}
+	if (size > 0)
+		buf[out.len < size ? out.len : size - 1] = '\0';
+	return out.len < size ? out.len : (size > 0 ? size - 1 : 0);
+}
+
+// Hand a record to whoever wants it: the callback, or stderr.
+static void deliver_record(const touchmouse_log_record *record)
+{
+	touchmouse_log_callback callback = log_callback;
+	if (callback) {
+		callback(record, log_callback_userdata);
+	} else {
+		char line[TM_LOG_LINE_MAX];
+		touchmouse_format_log_record(record, line, sizeof(line));
+		fputs(line, stderr);
+	}
+}
+
+// Claim a free slot, capture into it and publish it.  Returns 0 if the ring
+// was full.
+static int enqueue_record(touchmouse_loglevel level, const char *fmt, va_list args)
+{
+	size_t pos = TM_ATOMIC_LOAD_RELAXED(&log_ring.enqueue_pos);
+	log_slot *slot;
+	for (;;) {
+		size_t sequence;
+		intptr_t diff;
+		slot = &log_ring.slots[pos & (TM_LOG_RING_SIZE - 1)];
+		sequence = TM_ATOMIC_LOAD(&slot->sequence);
+		diff = (intptr_t)sequence - (intptr_t)pos;
+		if (diff == 0) {
+			if (TM_ATOMIC_CAS(&log_ring.enqueue_pos, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = TM_ATOMIC_LOAD_RELAXED(&log_ring.enqueue_pos);
+		}
+	}
+	capture_record(&slot->record, level, fmt, args);
+	TM_ATOMIC_STORE(&slot->sequence, pos + 1);
+	// The drain thread polls, so only prod it when the ring is filling up.
+	if (pos + 1 - TM_ATOMIC_LOAD_RELAXED(&log_ring.dequeue_pos) >= TM_LOG_RING_SIZE * 3 / 4)
+		tm_event_signal(&log_ring.wake);
+	return 1;
+}
+
+// Deliver every published record.  Only one thread drains at a time.
+static void drain_ring(void)
+{
+	size_t pos = log_ring.dequeue_pos;
+	for (;;) {
+		log_slot *slot = &log_ring.slots[pos & (TM_LOG_RING_SIZE - 1)];
+		if (TM_ATOMIC_LOAD(&slot->sequence) != pos + 1)
+			break;
+		deliver_record(&slot->record);
+		TM_ATOMIC_STORE(&slot->sequence, pos + TM_LOG_RING_SIZE);
+		pos++;
+		TM_ATOMIC_STORE_RELAXED(&log_ring.dequeue_pos, pos);
+	}
+}
+
+static void drain_thread(void *arg)
+{
+	(void)arg;
+	for (;;) {
+		// Check before draining, so that whatever was logged before
+		// the stop request still gets out.
+		int stopping = TM_ATOMIC_LOAD(&log_ring.stop);
+		drain_ring();
+		if (stopping)
+			break;
+		tm_event_wait(&log_ring.wake, TM_LOG_DRAIN_INTERVAL_MS);
+	}
+}
+
+int touchmouse_set_log_async(int enabled)
+{
+	if (enabled) {
+		size_t i;
+		if (log_ring.async)
+			return 0;
+		if (!log_ring.initialized) {
+			for (i = 0; i < TM_LOG_RING_SIZE; i++)
+				log_ring.slots[i].sequence = i;
+			tm_event_init(&log_ring.wake);
+			log_ring.initialized = 1;
+		}
+		log_ring.stop = 0;
+		if (tm_thread_create(&log_ring.thread, drain_thread, NULL) != 0) {
+			TM_ERROR("touchmouse_set_log_async: couldn't start the log thread\n");
+			return -1;
+		}
+		TM_ATOMIC_STORE(&log_ring.async, 1);
+	} else {
+		if (!log_ring.async)
+			return 0;
+		TM_ATOMIC_STORE(&log_ring.async, 0);
+		// Every tm_log() from here on sees async clear.  Wait for the ones
+		// that saw it set to finish queueing, so that the last drain finds
+		// all their records published.
+		TM_ATOMIC_FENCE();
+		while (TM_ATOMIC_LOAD(&log_ring.writers) != 0)
+			tm_sleep_ms(1);
+		TM_ATOMIC_STORE(&log_ring.stop, 1);
+		tm_event_signal(&log_ring.wake);
+		tm_thread_join(log_ring.thread);
+		// Anything queued after the thread's last look.
+		drain_ring();
+	}
+	return 0;
+}
+
+void tm_log_shutdown(void)
+{
+	touchmouse_set_log_async(0);
+}
+
+// Emit a log message at the specified loglevel.  The TM_LOG macros have
+// already checked that the level is enabled.
+void tm_log(touchmouse_loglevel level, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	if (TM_ATOMIC_LOAD_RELAXED(&log_ring.async)) {
+		// Announce ourselves before looking again, so that
+		// touchmouse_set_log_async(0) either waits for us or we see it.
+		TM_ATOMIC_ADD(&log_ring.writers, 1);
+		TM_ATOMIC_FENCE();
+		if (TM_ATOMIC_LOAD(&log_ring.async)) {
+			if (!enqueue_record(level, fmt, args))
+				TM_ATOMIC_ADD_RELAXED(&log_records_dropped, 1);
+			TM_ATOMIC_ADD(&log_ring.writers, -1);
+			va_end(args);
+			return;
+		}
+		TM_ATOMIC_ADD(&log_ring.writers, -1);
+	}
+	if (log_callback) {
+		touchmouse_log_record record;
+		capture_record(&record, level, fmt, args);
+		log_callback(&record, log_callback_userdata);
+	} else {
+		vfprintf(stderr, fmt, args);
+	}
+	va_end(args);
+}
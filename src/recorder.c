@@ -0,0 +1,212 @@
+/* Capture recording; see capture.h for the file format.
+ *
+ * The thread processing events only ever encodes records into memory.  It
+ * fills fixed-size chunks and passes full ones to a writer thread through a
+ * single-producer single-consumer ring, getting empty ones back through
+ * another.  If the disk falls so far behind that no empty chunk is left,
+ * records are dropped (and counted) rather than making the caller wait.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "touchmouse-internal.h"
+#include "capture.h"
+#include "tm_thread.h"
+
+#define TM_RECORDER_CHUNK_SIZE 65536
+// Chunks in flight: 1 MB of buffering in all.
+#define TM_RECORDER_CHUNKS 16
+// A partly filled chunk is handed over anyway once it's this old, so that a
+// slow stream of reports still reaches the disk.
+#define TM_RECORDER_FLUSH_NS 1000000000ULL
+#define TM_RECORDER_WAKE_MS 100
+
+typedef struct {
+	size_t used;
+	uint8_t data[TM_RECORDER_CHUNK_SIZE];
+} record_chunk;
+
+// A ring of chunk pointers with one producer and one consumer.  One slot is
+// always left empty, so it holds all the chunks.
+typedef struct {
+	record_chunk *slots[TM_RECORDER_CHUNKS + 1];
+	unsigned int head;
+	unsigned int tail;
+} chunk_ring;
+
+struct tm_recorder_ {
+	FILE *file;
+	tm_thread thread;
+	tm_event wake;
+	int stop;
+	int write_error;
+	chunk_ring full;
+	chunk_ring empty;
+	// Producer side
+	record_chunk *current;
+	uint64_t current_started;
+	uint64_t last_arrival;
+	uint64_t dropped;
+	record_chunk chunks[TM_RECORDER_CHUNKS];
+};
+
+static int ring_push(chunk_ring *ring, record_chunk *chunk)
+{
+	unsigned int tail = ring->tail;
+	unsigned int next = (tail + 1) % (TM_RECORDER_CHUNKS + 1);
+	if (next == TM_ATOMIC_LOAD(&ring->head))
+		return 0;
+	ring->slots[tail] = chunk;
+	TM_ATOMIC_STORE(&ring->tail, next);
+	return 1;
+}
+
+static record_chunk *ring_pop(chunk_ring *ring)
+{
+	unsigned int head = ring->head;
+	record_chunk *chunk;
+	if (head == TM_ATOMIC_LOAD(&ring->tail))
+		return NULL;
+	chunk = ring->slots[head];
+	TM_ATOMIC_STORE(&ring->head, (head + 1) % (TM_RECORDER_CHUNKS + 1));
+	return chunk;
+}
+
+static void write_full_chunks(tm_recorder *r)
+{
+	record_chunk *chunk;
+	while ((chunk = ring_pop(&r->full)) != NULL) {
+		if (!r->write_error && fwrite(chunk->data, 1, chunk->used, r->file) != chunk->used) {
+			TM_ERROR("tm_recorder: write to capture file failed\n");
+			r->write_error = 1;
+		}
+		chunk->used = 0;
+		ring_push(&r->empty, chunk);
+	}
+}
+
+static void writer_thread(void *arg)
+{
+	tm_recorder *r = (tm_recorder*)arg;
+	for (;;) {
+		int stopping = TM_ATOMIC_LOAD(&r->stop);
+		write_full_chunks(r);
+		if (stopping)
+			break;
+		tm_event_wait(&r->wake, TM_RECORDER_WAKE_MS);
+	}
+	if (fflush(r->file) != 0)
+		r->write_error = 1;
+}
+
+tm_recorder *tm_recorder_open(const char *path, uint64_t start_time)
+{
+	uint8_t header[TM_CAPTURE_HEADER_SIZE];
+	tm_recorder *r;
+	int i;
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		TM_ERROR("tm_recorder_open: can't create %s\n", path);
+		return NULL;
+	}
+	memcpy(header, TM_CAPTURE_MAGIC, 4);
+	tm_capture_put_u16(header + 4, TM_CAPTURE_VERSION);
+	tm_capture_put_u16(header + 6, TM_CAPTURE_HEADER_SIZE);
+	tm_capture_put_u64(header + 8, start_time);
+	if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) {
+		TM_ERROR("tm_recorder_open: can't write to %s\n", path);
+		fclose(file);
+		return NULL;
+	}
+	r = (tm_recorder*)calloc(1, sizeof(tm_recorder));
+	if (!r) {
+		TM_ERROR("tm_recorder_open: out of memory\n");
+		fclose(file);
+		return NULL;
+	}
+	r->file = file;
+	r->last_arrival = start_time;
+	r->current = &r->chunks[0];
+	for (i = 1; i < TM_RECORDER_CHUNKS; i++)
+		ring_push(&r->empty, &r->chunks[i]);
+	tm_event_init(&r->wake);
+	if (tm_thread_create(&r->thread, writer_thread, r) != 0) {
+		TM_ERROR("tm_recorder_open: couldn't start the writer thread\n");
+		tm_event_destroy(&r->wake);
+		fclose(file);
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+// Pass the current chunk to the writer and take an empty one, if there is
+// one.  Otherwise the current chunk stays put.
+static void hand_over_chunk(tm_recorder *r, uint64_t now)
+{
+	record_chunk *next = ring_pop(&r->empty);
+	if (!next)
+		return;
+	ring_push(&r->full, r->current);
+	r->current = next;
+	r->current_started = now;
+	tm_event_signal(&r->wake);
+}
+
+void tm_recorder_add(tm_recorder *r, const unsigned char *data, int length, uint64_t arrival)
+{
+	uint8_t *p;
+	uint64_t delta;
+	if (r->current->used == 0)
+		r->current_started = arrival;
+	else if (arrival - r->current_started > TM_RECORDER_FLUSH_NS)
+		hand_over_chunk(r, arrival);
+	if (TM_RECORDER_CHUNK_SIZE - r->current->used < TM_CAPTURE_MAX_RECORD) {
+		hand_over_chunk(r, arrival);
+		if (TM_RECORDER_CHUNK_SIZE - r->current->used < TM_CAPTURE_MAX_RECORD) {
+			r->dropped++;
+			return;
+		}
+	}
+	if (length > 255)
+		length = 255;
+	// Arrival times only go forward, but don't trust that with our format.
+	delta = (arrival > r->last_arrival) ? arrival - r->last_arrival : 0;
+	p = r->current->data + r->current->used;
+	*p++ = (uint8_t)length;
+	do {
+		uint8_t byte = delta & 0x7f;
+		delta >>= 7;
+		*p++ = byte | (delta ? 0x80 : 0);
+	} while (delta);
+	memcpy(p, data, length);
+	p += length;
+	r->current->used = p - r->current->data;
+	r->last_arrival = arrival > r->last_arrival ? arrival : r->last_arrival;
+}
+
+uint64_t tm_recorder_dropped(const tm_recorder *r)
+{
+	return r->dropped;
+}
+
+int tm_recorder_close(tm_recorder *r)
+{
+	int res;
+	// The current chunk goes last.  The full ring has room for every chunk.
+	if (r->current->used)
+		ring_push(&r->full, r->current);
+	TM_ATOMIC_STORE(&r->stop, 1);
+	tm_event_signal(&r->wake);
+	tm_thread_join(r->thread);
+	tm_event_destroy(&r->wake);
+	res = r->write_error ? -1 : 0;
+	if (fclose(r->file) != 0)
+		res = -1;
+	if (r->dropped)
+		TM_WARNING("tm_recorder_close: %d reports were dropped because the disk couldn't keep up\n", (int)r->dropped);
+	free(r);
+	return res;
+}
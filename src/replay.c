@@ -0,0 +1,186 @@
+/* Replay device: serves the reports in a capture file (see capture.h) in
+ * place of a real device, either with the gaps they were recorded with or as
+ * fast as they are asked for.
+ *
+ * The whole capture is read into memory when it is opened, so replaying it
+ * does no I/O.  Reports come out with new arrival times: when they were due
+ * at recorded pacing, and when they were read otherwise.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "touchmouse-internal.h"
+#include "capture.h"
+#include "mono_timer.h"
+#include "tm_thread.h"
+
+struct tm_replay_ {
+	uint8_t *data;
+	// Where the records end: the end of the file, or the start of its index
+	size_t size;
+	// Offset of the next record
+	size_t position;
+	touchmouse_replay_pacing pacing;
+	// Recorded arrival time of the previous record (or the capture's start)
+	uint64_t recorded_time;
+	// Host time corresponding to recorded_time, once replay has started
+	uint64_t host_base;
+	uint64_t recorded_base;
+	int started;
+};
+
+static uint8_t *read_whole_file(const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	uint8_t *data = NULL;
+	long length;
+	if (!file)
+		return NULL;
+	if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+		data = (uint8_t*)malloc(length ? length : 1);
+		if (data && fread(data, 1, length, file) != (size_t)length) {
+			free(data);
+			data = NULL;
+		}
+		*size = length;
+	}
+	fclose(file);
+	return data;
+}
+
+typedef struct tm_replay_ tm_replay;
+
+static tm_replay *replay_open(const char *path, touchmouse_replay_pacing pacing)
+{
+	size_t size = 0;
+	uint8_t *data = read_whole_file(path, &size);
+	size_t records_start, records_end, index;
+	uint64_t entries;
+	tm_replay *r;
+	if (!data) {
+		TM_ERROR("replay_open: can't read %s\n", path);
+		return NULL;
+	}
+	if (size < TM_CAPTURE_HEADER_SIZE || memcmp(data, TM_CAPTURE_MAGIC, 4) != 0) {
+		TM_ERROR("replay_open: %s is not a capture file\n", path);
+		free(data);
+		return NULL;
+	}
+	if (tm_capture_layout(data, size, &records_start, &records_end, &index, &entries) < 0) {
+		TM_ERROR("replay_open: %s is an unsupported or damaged capture (version %d)\n", path, tm_capture_get_u16(data + 4));
+		free(data);
+		return NULL;
+	}
+	r = (tm_replay*)calloc(1, sizeof(tm_replay));
+	if (!r) {
+		TM_ERROR("replay_open: out of memory\n");
+		free(data);
+		return NULL;
+	}
+	r->data = data;
+	r->size = records_end;
+	r->position = records_start;
+	r->pacing = pacing;
+	r->recorded_time = tm_capture_get_u64(data + 8);
+	return r;
+}
+
+static void replay_close(void *handle)
+{
+	tm_replay *r = (tm_replay*)handle;
+	free(r->data);
+	free(r);
+}
+
+// Parse the record at the current position without consuming it.  Returns
+// its report length and sets *report, *next and *recorded, or returns -1 at
+// the end of the capture (or where it is cut short).
+static int peek_record(const tm_replay *r, const uint8_t **report, size_t *next, uint64_t *recorded)
+{
+	size_t offset;
+	uint64_t delta;
+	int length = tm_capture_parse_record(r->data, r->size, r->position, &offset, &delta, next);
+	if (length < 0)
+		return -1;
+	*report = r->data + offset;
+	*recorded = r->recorded_time + delta;
+	return length;
+}
+
+// Returns the length of the next report, 0 if none is due within
+// milliseconds, or -1 once the capture is used up.
+static int replay_read(void *handle, unsigned char *data, size_t length, int milliseconds, uint64_t *arrival)
+{
+	tm_replay *r = (tm_replay*)handle;
+	const uint8_t *report;
+	size_t next;
+	uint64_t recorded, now;
+	int res = peek_record(r, &report, &next, &recorded);
+	*arrival = 0;
+	if (res < 0)
+		return -1;
+	now = mono_timer_nanos();
+	if (r->pacing == TOUCHMOUSE_REPLAY_RECORDED) {
+		uint64_t due;
+		if (!r->started) {
+			// The first report is due straight away.
+			r->host_base = now;
+			r->recorded_base = recorded;
+			r->started = 1;
+		}
+		due = r->host_base + (recorded - r->recorded_base);
+		if (due > now) {
+			uint64_t wait_ms = (due - now + 999999) / 1000000;
+			if (milliseconds == 0)
+				return 0;
+			if (milliseconds > 0 && (uint64_t)milliseconds < wait_ms) {
+				tm_sleep_ms(milliseconds);
+				return 0;
+			}
+			tm_sleep_ms((int)wait_ms);
+		}
+		now = due;
+	}
+	if ((size_t)res > length)
+		res = (int)length;
+	memcpy(data, report, res);
+	r->position = next;
+	r->recorded_time = recorded;
+	*arrival = now;
+	return res;
+}
+
+static int replay_get_pollable_fd(void *handle)
+{
+	return -1;
+}
+
+static const wchar_t *replay_error(void *handle)
+{
+	return L"end of capture";
+}
+
+// A capture has whatever mode it was recorded in, and no report queue.
+static const tm_transport_ops replay_ops = {
+	"replay",
+	replay_read,
+	NULL,
+	NULL,
+	replay_get_pollable_fd,
+	NULL,
+	NULL,
+	replay_error,
+	replay_close,
+};
+
+int tm_replay_transport_open(tm_transport *transport, const char *path, touchmouse_replay_pacing pacing)
+{
+	tm_replay *r = replay_open(path, pacing);
+	if (!r)
+		return -1;
+	transport->ops = &replay_ops;
+	transport->handle = r;
+	return 0;
+}
@@ -0,0 +1,445 @@
+/* Synthetic device: makes up touch images (fingers moving about, now and
+ * then a palm, and optionally quiet spells with nothing touching) and serves
+ * them as the same 0x27 reports a TouchMouse sends, at a steady frame rate.
+ *
+ * A loop of frames is made up front, when the device is opened, and played
+ * over and over, so reading a frame only copies out its reports and stamps
+ * them with the time.  That keeps the cost of making up touches out of
+ * whatever is measuring the library.  Frames left unread for longer than the
+ * backlog are stepped over and counted as dropped, much as a report queue
+ * dropping whole images would lose them.  Each report's arrival time is when
+ * its frame was due, so time spent in the backlog shows up as latency.
+ *
+ * On Linux, a timerfd set for when the next frame is due makes the device
+ * pollable, so touchmouse_process_events_multi() can sleep on any number of
+ * them at once.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/timerfd.h>
+#endif
+
+#include "touchmouse-internal.h"
+#include "image_unpack.h"
+#include "mono_timer.h"
+#include "tm_thread.h"
+
+#define SYNTH_DEFAULT_RATE 125.0
+#define SYNTH_DEFAULT_BACKLOG 4
+#define SYNTH_MAX_BLOBS 3
+#define SYNTH_ROWS 13
+#define SYNTH_COLS 15
+// Frames in the loop: about two seconds' worth at the default rate.
+#define SYNTH_LOOP_FRAMES 256
+
+// Something touching: a Gaussian bump, moving.
+typedef struct {
+	// Centre, in pixels
+	float x, y;
+	// Velocity, in pixels per second
+	float vx, vy;
+	float sigma_x, sigma_y;
+	// Height of the bump, in pixel values (at most 14)
+	float peak;
+} blob;
+
+// The made-up touches, as they move on from frame to frame.  Only needed
+// while the loop is being made; times are from the start of the loop.
+typedef struct {
+	uint32_t rng;
+	int idle;
+	uint64_t period;
+	// Time of the frame just made, and of the next one
+	uint64_t frame_time;
+	uint64_t next_due;
+	// When the current touch lets go
+	uint64_t touch_end;
+	// When the device's timestamps last started again from zero
+	uint64_t series_start;
+	blob blobs[SYNTH_MAX_BLOBS];
+	int blob_count;
+} synth_scene;
+
+// One frame of the loop, with its times from the start of the loop.  Its
+// reports are stamped with the real timestamp as they're served.
+typedef struct {
+	uint64_t due;
+	uint64_t series_start;
+	int report_count;
+	uint8_t reports[TOUCHMOUSE_MAX_IMAGE_REPORTS][32];
+} synth_frame;
+
+typedef struct {
+	int idle;
+	uint64_t period;
+	uint64_t backlog;
+	synth_frame frames[SYNTH_LOOP_FRAMES];
+	// How long one pass through the loop lasts, and the reports in it
+	uint64_t loop_length;
+	uint64_t loop_reports;
+	// Host time the current pass started, and the frame due next in it
+	uint64_t loop_start;
+	int next_frame;
+	// When the device was opened.  Timestamps count from here if the device
+	// never goes idle; if it does, they start again with each pass.
+	uint64_t opened;
+	// Host time of the frame being served, and its reports
+	uint64_t frame_time;
+	uint8_t reports[TOUCHMOUSE_MAX_IMAGE_REPORTS][32];
+	int report_count;
+	int report_index;
+	// Readable once the next frame is due, or -1 where there are no
+	// timerfds, and when it was last set to fire
+	int timer_fd;
+	uint64_t timer_due;
+	struct hid_input_queue_stats stats;
+} tm_synthetic;
+
+// xorshift32: plenty random for made-up touches, and cheap.
+static uint32_t next_random(synth_scene *s)
+{
+	uint32_t x = s->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	s->rng = x;
+	return x;
+}
+
+// Uniform in [low, high).
+static float random_range(synth_scene *s, float low, float high)
+{
+	return low + (high - low) * (float)(next_random(s) >> 8) * (1.0f / 16777216.0f);
+}
+
+static uint64_t random_duration(synth_scene *s, float low_seconds, float high_seconds)
+{
+	return (uint64_t)(random_range(s, low_seconds, high_seconds) * 1e9f);
+}
+
+// Put down one to three fingers, or a palm with perhaps a finger ahead of it,
+// at time start.
+static void start_touch(synth_scene *s, uint64_t start)
+{
+	int fingers;
+	s->blob_count = 0;
+	if (random_range(s, 0, 1) < 0.2f) {
+		blob *palm = &s->blobs[s->blob_count++];
+		palm->x = random_range(s, 5, 9);
+		palm->y = random_range(s, 8, 11);
+		palm->vx = random_range(s, -1.5f, 1.5f);
+		palm->vy = random_range(s, -1.5f, 1.5f);
+		palm->sigma_x = random_range(s, 2.5f, 3.2f);
+		palm->sigma_y = random_range(s, 1.8f, 2.5f);
+		palm->peak = random_range(s, 11, 14);
+		fingers = random_range(s, 0, 1) < 0.5f ? 1 : 0;
+	} else {
+		fingers = 1 + (random_range(s, 0, 1) < 0.35f) + (random_range(s, 0, 1) < 0.1f);
+	}
+	while (fingers-- > 0) {
+		blob *finger = &s->blobs[s->blob_count++];
+		float speed = random_range(s, 2, 12);
+		float angle = random_range(s, 0, 6.2831853f);
+		finger->x = random_range(s, 2, 12);
+		finger->y = random_range(s, 1, 8);
+		finger->vx = speed * cosf(angle);
+		finger->vy = speed * sinf(angle);
+		finger->sigma_x = random_range(s, 0.8f, 1.3f);
+		finger->sigma_y = random_range(s, 0.9f, 1.5f);
+		finger->peak = random_range(s, 8, 14);
+	}
+	s->touch_end = start + random_duration(s, 0.5f, 4.0f);
+}
+
+// Keep the blobs wandering, bouncing off the edges of the sensor.
+static void move_blobs(synth_scene *s, float dt)
+{
+	int i;
+	for(i = 0; i < s->blob_count; i++) {
+		blob *b = &s->blobs[i];
+		b->vx += random_range(s, -20, 20) * dt;
+		b->vy += random_range(s, -20, 20) * dt;
+		b->x += b->vx * dt;
+		b->y += b->vy * dt;
+		if (b->x < 0) {
+			b->x = -b->x;
+			b->vx = -b->vx;
+		} else if (b->x > SYNTH_COLS - 1) {
+			b->x = 2 * (SYNTH_COLS - 1) - b->x;
+			b->vx = -b->vx;
+		}
+		if (b->y < 0) {
+			b->y = -b->y;
+			b->vy = -b->vy;
+		} else if (b->y > SYNTH_ROWS - 1) {
+			b->y = 2 * (SYNTH_ROWS - 1) - b->y;
+			b->vy = -b->vy;
+		}
+	}
+}
+
+// Move the scene on to the frame due at next_due, and work out when the one
+// after it is due.
+static void advance(synth_scene *s)
+{
+	s->frame_time = s->next_due;
+	move_blobs(s, (float)(s->period * 1e-9));
+	s->next_due += s->period;
+	if (s->next_due >= s->touch_end) {
+		uint64_t start = s->next_due;
+		if (s->idle) {
+			// A real mouse goes quiet when let go, and its timestamps start
+			// again from zero when it's next touched.
+			start = s->touch_end + random_duration(s, 0.2f, 2.0f);
+			s->series_start = start;
+			s->next_due = start;
+		}
+		start_touch(s, start);
+	}
+}
+
+// Draw the blobs into the 181 packed pixels, with a little dither so that
+// their edges flicker as a real sensor's do.
+static void render(synth_scene *s, uint8_t *pixels)
+{
+	// Gaussians are separable, so each blob needs only a row and a column of
+	// exponentials rather than one per pixel.
+	float gx[SYNTH_MAX_BLOBS][SYNTH_COLS];
+	float gy[SYNTH_MAX_BLOBS][SYNTH_ROWS];
+	int b, i;
+	for(b = 0; b < s->blob_count; b++) {
+		const blob *bl = &s->blobs[b];
+		for(i = 0; i < SYNTH_COLS; i++) {
+			float d = (i - bl->x) / bl->sigma_x;
+			gx[b][i] = bl->peak * expf(-0.5f * d * d);
+		}
+		for(i = 0; i < SYNTH_ROWS; i++) {
+			float d = (i - bl->y) / bl->sigma_y;
+			gy[b][i] = expf(-0.5f * d * d);
+		}
+	}
+	for(i = 0; i < TM_PACKED_PIXELS; i++) {
+		int row = tm_pixel_index[i] / SYNTH_COLS;
+		int col = tm_pixel_index[i] % SYNTH_COLS;
+		float value = 0;
+		for(b = 0; b < s->blob_count; b++)
+			value += gx[b][col] * gy[b][row];
+		if (value < 0.05f) {
+			pixels[i] = 0;
+			continue;
+		}
+		value += (float)(next_random(s) >> 24) * (1.0f / 256.0f);
+		pixels[i] = value >= 14 ? 14 : (uint8_t)value;
+	}
+}
+
+// Make up the loop, starting from a fresh touch at time zero.
+static void make_loop(tm_synthetic *synth, synth_scene *s)
+{
+	uint8_t pixels[TM_PACKED_PIXELS];
+	int i;
+	start_touch(s, 0);
+	for(i = 0; i < SYNTH_LOOP_FRAMES; i++) {
+		synth_frame *f = &synth->frames[i];
+		advance(s);
+		render(s, pixels);
+		f->due = s->frame_time;
+		f->series_start = s->series_start;
+		f->report_count = touchmouse_encode_pixels(pixels, 0, f->reports);
+		synth->loop_reports += f->report_count;
+	}
+	// The touch under way is cut off where the loop starts again.  A mouse
+	// that goes idle rests first, so each pass is a new series.
+	synth->loop_length = s->next_due;
+	if (s->idle)
+		synth->loop_length += random_duration(s, 0.2f, 2.0f);
+}
+
+// Host time the next frame is due.
+static uint64_t next_due(const tm_synthetic *s)
+{
+	return s->loop_start + s->frames[s->next_frame].due;
+}
+
+static void step(tm_synthetic *s)
+{
+	if (++s->next_frame == SYNTH_LOOP_FRAMES) {
+		s->next_frame = 0;
+		s->loop_start += s->loop_length;
+	}
+}
+
+// Make the timer fire when the next frame is due.  Setting it also forgets
+// that it fired before, so this is only done when nothing is due: the
+// descriptor stays readable while frames are waiting to be read.
+static void reset_timer(tm_synthetic *s)
+{
+#ifdef __linux__
+	struct itimerspec when;
+	uint64_t due = next_due(s);
+	// Already set for that frame, and not yet fired.
+	if (due == s->timer_due)
+		return;
+	s->timer_due = due;
+	memset(&when, 0, sizeof(when));
+	when.it_value.tv_sec = due / 1000000000;
+	when.it_value.tv_nsec = due % 1000000000;
+	if (timerfd_settime(s->timer_fd, TFD_TIMER_ABSTIME, &when, NULL) < 0)
+		TM_ERROR("synthetic_read: can't set the timer\n");
+#endif
+}
+
+// Step over the frames that have waited too long, then take the oldest one
+// left.
+static void next_frame(tm_synthetic *s, uint64_t now)
+{
+	const synth_frame *f;
+	int i;
+	// Far behind, whole passes go at once.
+	while (s->loop_start + 2 * s->loop_length + s->backlog <= now) {
+		TM_ATOMIC_STORE_RELAXED(&s->stats.frames_dropped,
+			TM_ATOMIC_LOAD_RELAXED(&s->stats.frames_dropped) + SYNTH_LOOP_FRAMES);
+		TM_ATOMIC_STORE_RELAXED(&s->stats.frame_reports_dropped,
+			TM_ATOMIC_LOAD_RELAXED(&s->stats.frame_reports_dropped) + s->loop_reports);
+		s->loop_start += s->loop_length;
+	}
+	while (next_due(s) + s->backlog <= now) {
+		TM_COUNTER_INC(&s->stats.frames_dropped);
+		TM_ATOMIC_STORE_RELAXED(&s->stats.frame_reports_dropped,
+			TM_ATOMIC_LOAD_RELAXED(&s->stats.frame_reports_dropped) + s->frames[s->next_frame].report_count);
+		step(s);
+	}
+	f = &s->frames[s->next_frame];
+	s->frame_time = next_due(s);
+	uint64_t series_start = s->idle ? s->loop_start + f->series_start : s->opened;
+	uint8_t timestamp = (uint8_t)((s->frame_time - series_start) / 1000000);
+	s->report_count = f->report_count;
+	s->report_index = 0;
+	memcpy(s->reports, f->reports, f->report_count * sizeof(f->reports[0]));
+	for(i = 0; i < s->report_count; i++)
+		s->reports[i][TM_REPORT_TIMESTAMP_OFFSET] = timestamp;
+	step(s);
+	TM_ATOMIC_STORE_RELAXED(&s->stats.reports_received,
+		TM_ATOMIC_LOAD_RELAXED(&s->stats.reports_received) + s->report_count);
+	uint32_t waiting = (uint32_t)((now - s->frame_time) / s->period + 1) * s->report_count;
+	if (waiting > s->stats.high_water)
+		TM_ATOMIC_STORE_RELAXED(&s->stats.high_water, waiting);
+}
+
+// Returns the length of the next report, or 0 if none is due within
+// milliseconds.
+static int synthetic_read(void *handle, unsigned char *data, size_t length, int milliseconds, uint64_t *arrival)
+{
+	tm_synthetic *s = (tm_synthetic*)handle;
+	*arrival = 0;
+	if (s->report_index == s->report_count) {
+		uint64_t now = mono_timer_nanos();
+		uint64_t due = next_due(s);
+		if (due > now) {
+			uint64_t wait_ms = (due - now + 999999) / 1000000;
+			if (milliseconds >= 0 && (uint64_t)milliseconds < wait_ms) {
+				if (milliseconds > 0)
+					tm_sleep_ms(milliseconds);
+				reset_timer(s);
+				return 0;
+			}
+			tm_sleep_ms((int)wait_ms);
+			now = mono_timer_nanos();
+		}
+		next_frame(s, now);
+	}
+	if (length > 32)
+		length = 32;
+	memcpy(data, s->reports[s->report_index++], length);
+	*arrival = s->frame_time;
+	return (int)length;
+}
+
+static int synthetic_get_pollable_fd(void *handle)
+{
+	return ((tm_synthetic*)handle)->timer_fd;
+}
+
+static int synthetic_get_input_queue_stats(void *handle, struct hid_input_queue_stats *stats)
+{
+	tm_synthetic *s = (tm_synthetic*)handle;
+	memset(stats, 0, sizeof(*stats));
+	stats->reports_received = TM_ATOMIC_LOAD_RELAXED(&s->stats.reports_received);
+	stats->frames_dropped = TM_ATOMIC_LOAD_RELAXED(&s->stats.frames_dropped);
+	stats->frame_reports_dropped = TM_ATOMIC_LOAD_RELAXED(&s->stats.frame_reports_dropped);
+	stats->capacity = s->stats.capacity;
+	stats->high_water = TM_ATOMIC_LOAD_RELAXED(&s->stats.high_water);
+	return 0;
+}
+
+static const wchar_t *synthetic_error(void *handle)
+{
+	return L"synthetic device failed";
+}
+
+static void synthetic_close(void *handle)
+{
+	tm_synthetic *s = (tm_synthetic*)handle;
+#ifdef __linux__
+	close(s->timer_fd);
+#endif
+	free(s);
+}
+
+// A synthetic device is always sending images, and its backlog is set when
+// it's opened.
+static const tm_transport_ops synthetic_ops = {
+	"synthetic",
+	synthetic_read,
+	NULL,
+	NULL,
+	synthetic_get_pollable_fd,
+	NULL,
+	synthetic_get_input_queue_stats,
+	synthetic_error,
+	synthetic_close,
+};
+
+int tm_synthetic_transport_open(tm_transport *transport, const touchmouse_synthetic_params *params)
+{
+	double rate = params->frame_rate > 0 ? params->frame_rate : SYNTH_DEFAULT_RATE;
+	int backlog = params->backlog > 0 ? params->backlog : SYNTH_DEFAULT_BACKLOG;
+	synth_scene scene;
+	tm_synthetic *s = (tm_synthetic*)calloc(1, sizeof(tm_synthetic));
+	if (!s) {
+		TM_ERROR("tm_synthetic_transport_open: out of memory\n");
+		return -1;
+	}
+	s->timer_fd = -1;
+#ifdef __linux__
+	s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (s->timer_fd < 0) {
+		TM_ERROR("tm_synthetic_transport_open: can't create a timer\n");
+		free(s);
+		return -1;
+	}
+#endif
+	memset(&scene, 0, sizeof(scene));
+	// xorshift never leaves zero, so mix the seed into a nonzero state.
+	scene.rng = (params->seed ? params->seed : 1) * 2654435761u;
+	if (!scene.rng)
+		scene.rng = 1;
+	scene.idle = s->idle = params->idle;
+	s->period = (uint64_t)(1e9 / rate);
+	if (s->period == 0)
+		s->period = 1;
+	scene.period = s->period;
+	s->backlog = backlog * s->period;
+	s->stats.capacity = backlog * TOUCHMOUSE_MAX_IMAGE_REPORTS;
+	make_loop(s, &scene);
+	s->opened = s->loop_start = mono_timer_nanos();
+	reset_timer(s);
+	transport->ops = &synthetic_ops;
+	transport->handle = s;
+	return 0;
+}
@@ -0,0 +1,163 @@
+/* Platform thread wrapper; see tm_thread.h. */
+
+#include <stdlib.h>
+
+#include "tm_thread.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#endif
+
+// What the platform thread entry point gets: the real function to call.
+typedef struct {
+	tm_thread_func func;
+	void *arg;
+} thread_start;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_main(LPVOID param)
+#else
+static void *thread_main(void *param)
+#endif
+{
+	thread_start start = *(thread_start*)param;
+	free(param);
+	start.func(start.arg);
+	return 0;
+}
+
+int tm_thread_create(tm_thread *thread, tm_thread_func func, void *arg)
+{
+	thread_start *start = (thread_start*)malloc(sizeof(thread_start));
+	if (!start)
+		return -1;
+	start->func = func;
+	start->arg = arg;
+#ifdef _WIN32
+	*thread = CreateThread(NULL, 0, thread_main, start, 0, NULL);
+	if (*thread == NULL) {
+		free(start);
+		return -1;
+	}
+#else
+	if (pthread_create(thread, NULL, thread_main, start) != 0) {
+		free(start);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+void tm_thread_join(tm_thread thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
+
+#ifdef _WIN32
+static BOOL CALLBACK once_main(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+	((void (*)(void))param)();
+	return TRUE;
+}
+#endif
+
+void tm_call_once(tm_once *once, void (*func)(void))
+{
+#ifdef _WIN32
+	InitOnceExecuteOnce(once, once_main, (PVOID)func, NULL);
+#else
+	pthread_once(once, func);
+#endif
+}
+
+void tm_sleep_ms(int milliseconds)
+{
+#ifdef _WIN32
+	Sleep(milliseconds);
+#else
+	struct timespec ts;
+	ts.tv_sec = milliseconds / 1000;
+	ts.tv_nsec = (milliseconds % 1000) * 1000000L;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+#endif
+}
+
+#ifdef _WIN32
+void tm_event_init(tm_event *event)
+{
+	InitializeCriticalSection(&event->lock);
+	InitializeConditionVariable(&event->cond);
+	event->signalled = 0;
+}
+
+void tm_event_destroy(tm_event *event)
+{
+	DeleteCriticalSection(&event->lock);
+}
+
+void tm_event_signal(tm_event *event)
+{
+	EnterCriticalSection(&event->lock);
+	event->signalled = 1;
+	WakeConditionVariable(&event->cond);
+	LeaveCriticalSection(&event->lock);
+}
+
+void tm_event_wait(tm_event *event, int milliseconds)
+{
+	EnterCriticalSection(&event->lock);
+	if (!event->signalled)
+		SleepConditionVariableCS(&event->cond, &event->lock, milliseconds);
+	event->signalled = 0;
+	LeaveCriticalSection(&event->lock);
+}
+#else
+void tm_event_init(tm_event *event)
+{
+	pthread_mutex_init(&event->lock, NULL);
+	pthread_cond_init(&event->cond, NULL);
+	event->signalled = 0;
+}
+
+void tm_event_destroy(tm_event *event)
+{
+	pthread_cond_destroy(&event->cond);
+	pthread_mutex_destroy(&event->lock);
+}
+
+void tm_event_signal(tm_event *event)
+{
+	pthread_mutex_lock(&event->lock);
+	event->signalled = 1;
+	pthread_cond_signal(&event->cond);
+	pthread_mutex_unlock(&event->lock);
+}
+
+void tm_event_wait(tm_event *event, int milliseconds)
+{
+	struct timeval now;
+	struct timespec deadline;
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + milliseconds / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000 + (milliseconds % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&event->lock);
+	while (!event->signalled) {
+		if (pthread_cond_timedwait(&event->cond, &event->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+	event->signalled = 0;
+	pthread_mutex_unlock(&event->lock);
+}
+#endif
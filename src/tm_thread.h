@@ -0,0 +1,84 @@
+/* A minimal wrapper around the platform's threads, so that the library can
+ * run background work without caring whether it's on Windows or POSIX.
+ *
+ * On Windows, we use CreateThread() and condition variables (Vista and up)
+ * Everywhere else, we use pthreads
+ *
+ * Atomics use the GCC/clang __atomic builtins, which every compiler that
+ * builds this library (including MinGW) provides.
+ */
+#ifndef __TM_THREAD_H__
+#define __TM_THREAD_H__
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+typedef HANDLE tm_thread;
+#else
+typedef pthread_t tm_thread;
+#endif
+
+typedef void (*tm_thread_func)(void *arg);
+
+// Run something exactly once per process, however many threads get there at
+// the same time.  Every caller returns only after it has finished.
+#ifdef _WIN32
+typedef INIT_ONCE tm_once;
+#define TM_ONCE_INIT INIT_ONCE_STATIC_INIT
+#else
+typedef pthread_once_t tm_once;
+#define TM_ONCE_INIT PTHREAD_ONCE_INIT
+#endif
+void tm_call_once(tm_once *once, void (*func)(void));
+
+// Start func(arg) on a new thread.  Returns 0 on success, -1 on error.
+int tm_thread_create(tm_thread *thread, tm_thread_func func, void *arg);
+// Wait for a thread to finish.
+void tm_thread_join(tm_thread thread);
+// Sleep for about milliseconds.
+void tm_sleep_ms(int milliseconds);
+
+// Something a thread can sleep on until another thread wakes it, or until a
+// timeout passes.  Wake-ups are not counted: waking an event nobody waits on
+// does nothing.
+typedef struct tm_event {
+#ifdef _WIN32
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE cond;
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+	int signalled;
+} tm_event;
+
+void tm_event_init(tm_event *event);
+void tm_event_destroy(tm_event *event);
+// Wake the thread sleeping in tm_event_wait(), or make its next wait return
+// immediately.
+void tm_event_signal(tm_event *event);
+// Sleep until the event is signalled or milliseconds pass.
+void tm_event_wait(tm_event *event, int milliseconds);
+
+#define TM_ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define TM_ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define TM_ATOMIC_CAS(p, expected, desired) \
+	__atomic_compare_exchange_n(p, expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define TM_ATOMIC_ADD(p, v) __atomic_add_fetch(p, v, __ATOMIC_ACQ_REL)
+// Orders every earlier load and store before every later one, for the rare
+// handshake where one thread stores then loads what another stores then
+// loads.
+#define TM_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+// For counters, which only need to be untorn.
+#define TM_ATOMIC_LOAD_RELAXED(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define TM_ATOMIC_STORE_RELAXED(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define TM_ATOMIC_ADD_RELAXED(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+// Bump a counter only one thread writes.  Cheaper than TM_ATOMIC_ADD_RELAXED,
+// since there's no need for a locked read-modify-write.
+#define TM_COUNTER_INC(p) TM_ATOMIC_STORE_RELAXED(p, TM_ATOMIC_LOAD_RELAXED(p) + 1)
+
+#endif // __TM_THREAD_H__
@@ -3,20 +3,198 @@
 
 #include <libtouchmouse/libtouchmouse.h>
 #include <stdarg.h>
+#include "hidapi.h"
+#include "image_unpack.h"
 
-struct touchmouse_device_ {
-	// HIDAPI handle
-	hid_device* dev;
+// Offset of the timestamp in an input report (see the report layout in
+// decoder.c).  Every report belonging to one image carries the same one.
+#define TM_REPORT_TIMESTAMP_OFFSET 6
+
+// Latency histogram: log-linear, in the style of HdrHistogram.  Values below
+// 2^TM_LATENCY_SUB_BITS nanoseconds get a bucket each; above that, each power
+// of two is split into 2^TM_LATENCY_SUB_BITS equal buckets, so every bucket is
+// within about 6% of its values.  Anything from 2^TM_LATENCY_MAX_BITS ns
+// (about 18 minutes) up shares the last bucket.
+#define TM_LATENCY_SUB_BITS 4
+#define TM_LATENCY_MAX_BITS 40
+#define TM_LATENCY_BUCKETS ((TM_LATENCY_MAX_BITS - TM_LATENCY_SUB_BITS + 1) << TM_LATENCY_SUB_BITS)
+
+// Only the thread processing events records into a histogram; any thread may
+// read it or ask for it to be reset.
+typedef struct {
+	uint64_t buckets[TM_LATENCY_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	// Set by tm_latency_reset(), and acted on by the next tm_latency_record()
+	int reset_requested;
+} tm_latency_histogram;
+
+// Add one latency of nanos to the histogram.
+void tm_latency_record(tm_latency_histogram *h, uint64_t nanos);
+// Empty the histogram.  Safe to call while another thread records.
+void tm_latency_reset(tm_latency_histogram *h);
+// Summarize the histogram.
+void tm_latency_summarize(const tm_latency_histogram *h, touchmouse_latency_stats *stats);
+// The latency that percentile percent of the recorded values are at or below.
+uint64_t tm_latency_percentile(const tm_latency_histogram *h, double percentile);
+
+// Device clock model: unwraps the device's 8-bit timestamps, and fits them to
+// the host arrival times over a window of recent images.
+#define TM_CLOCK_WINDOW 64
+
+typedef struct {
+	int have_frame;
+	uint8_t last_timestamp;
+	uint64_t last_arrival;
+	// Unwrapped device time, in ms
+	uint64_t device_time;
+	// Times the device counter has restarted
+	uint64_t series;
+	// (device time, arrival) pairs since the last restart
+	uint64_t window_device[TM_CLOCK_WINDOW];
+	uint64_t window_host[TM_CLOCK_WINDOW];
+	int window_count;
+	int window_next;
+	// The fit: host ns = offset + slope * device ms, and the RMS distance
+	// of the arrivals from it
+	double slope;
+	int64_t offset;
+	double jitter;
+} tm_clock_model;
+
+void tm_clock_model_init(tm_clock_model *m);
+// Account for an image with the given device timestamp, whose first report
+// arrived at arrival (0 if unknown).  Returns the unwrapped device time, and
+// sets *corrected to the fitted host time of the image, or 0 without arrival
+// times.
+uint64_t tm_clock_model_update(tm_clock_model *m, uint8_t timestamp, uint64_t arrival, uint64_t *corrected);
+
+// What a decoder has seen.  Only the thread feeding the decoder writes these,
+// but others may read them.
+typedef struct {
+	uint64_t reports;
+	uint64_t ignored;
+	uint64_t resets;
+	uint64_t errors;
+	uint64_t frames;
+} tm_decoder_counters;
+
+struct touchmouse_decoder_ {
 	// Callback information
 	void* userdata;
 	touchmouse_image_callback cb;
+	touchmouse_image_callback_ex cb_ex;
 	// Image decoder/reassembler state
+	touchmouse_decode_mode mode;
 	uint8_t timestamp_last_completed;
 	uint8_t timestamp_in_progress;
 	int buf_index;
 	int next_is_run_encoded;
-	uint8_t partial_image[181];
-	uint8_t image[195];
+	uint8_t partial_image[TM_PACKED_PIXELS + TM_PACKED_SLACK];
+	uint8_t image[TM_IMAGE_PIXELS];
+	tm_decoder_counters counters;
+	// When the report being decoded, and the first report of the image in
+	// progress, arrived (mono_timer_nanos()), or 0
+	uint64_t report_arrival;
+	uint64_t frame_first_arrival;
+	// Relates the device's timestamps to the host clock
+	tm_clock_model clock;
+	// Where to record how long completed images took to reach the callback
+	// after their last report arrived, if anywhere
+	tm_latency_histogram *latency;
+};
+
+// Writes a capture file (see capture.h) on a background thread.
+typedef struct tm_recorder_ tm_recorder;
+
+// Create the capture file at path and start its writer.  start_time is the
+// arrival time the first report's is recorded relative to.  Returns NULL on
+// error.
+tm_recorder *tm_recorder_open(const char *path, uint64_t start_time);
+// Record a report.  Never blocks: if the writer is too far behind, the
+// report is dropped.
+void tm_recorder_add(tm_recorder *r, const unsigned char *data, int length, uint64_t arrival);
+// Reports dropped so far.
+uint64_t tm_recorder_dropped(const tm_recorder *r);
+// Write out everything recorded and close the file.  Returns 0 on success,
+// -1 if anything failed to be written.
+int tm_recorder_close(tm_recorder *r);
+
+// Where a device's reports come from.  Each kind of device (a HIDAPI device,
+// a capture being replayed, ...) provides these operations, and touchmouse.c
+// only ever goes through them, so that everything from reading on is the
+// same whatever the source.
+typedef struct tm_transport_ops {
+	// For log messages
+	const char *name;
+	// Read one report, as hid_read_timestamped() does, and set *arrival to
+	// when it arrived (mono_timer_nanos()).  Returns its length, 0 if none
+	// came within milliseconds, or -1 on error.
+	int (*read)(void *handle, unsigned char *data, size_t length, int milliseconds, uint64_t *arrival);
+	// Feature reports, as hid_get_feature_report() and
+	// hid_send_feature_report().  NULL if the source has no device modes to
+	// set, in which case mode changes are accepted and ignored.
+	int (*get_feature_report)(void *handle, unsigned char *data, size_t length);
+	int (*send_feature_report)(void *handle, const unsigned char *data, size_t length);
+	// A descriptor that becomes readable when reports are waiting, or -1.
+	int (*get_pollable_fd)(void *handle);
+	// The report queue, as hid_set_input_queue() and
+	// hid_get_input_queue_stats().  NULL if there isn't one.
+	int (*set_input_queue)(void *handle, size_t capacity, hid_queue_policy policy, int frame_key_offset);
+	int (*get_input_queue_stats)(void *handle, struct hid_input_queue_stats *stats);
+	// What went wrong with the last operation.
+	const wchar_t *(*error)(void *handle);
+	void (*close)(void *handle);
+} tm_transport_ops;
+
+typedef struct {
+	const tm_transport_ops *ops;
+	void *handle;
+} tm_transport;
+
+// Open the HIDAPI device at path.  Returns 0 on success, -1 on error.
+int tm_hid_transport_open(tm_transport *transport, const char *path);
+// Load a capture file to replay.  Returns 0 on success, -1 on error.
+int tm_replay_transport_open(tm_transport *transport, const char *path, touchmouse_replay_pacing pacing);
+// Start a synthetic device.  Returns 0 on success, -1 on error.
+int tm_synthetic_transport_open(tm_transport *transport, const touchmouse_synthetic_params *params);
+
+// What touchmouse_device_info::opaque points to: where to find the device.
+typedef enum {
+	TM_DEVICE_HID,
+	TM_DEVICE_REPLAY,
+	TM_DEVICE_SYNTHETIC,
+} tm_device_type;
+
+typedef struct {
+	tm_device_type type;
+	// HID: the device, and the whole enumeration it came from, which all the
+	// HID entries share
+	struct hid_device_info *hid_info;
+	struct hid_device_info *hid_list;
+	// Replay: the capture file and how to pace it
+	char *replay_path;
+	touchmouse_replay_pacing pacing;
+	// Synthetic: its settings
+	touchmouse_synthetic_params synthetic;
+} tm_device_entry;
+
+struct touchmouse_device_ {
+	// Where reports come from
+	tm_transport transport;
+	// Reassembles images from this device's reports
+	touchmouse_decoder decoder;
+	// Counter values at the last touchmouse_reset_stats()
+	touchmouse_stats stats_baseline;
+	// Report arrival to callback latency
+	tm_latency_histogram latency;
+	// Where reports are being recorded, if anywhere
+	tm_recorder *recorder;
+	// Set once reading from the device has failed, after which
+	// touchmouse_process_events_multi() leaves it alone
+	int read_failed;
 };
 
 enum {
@@ -24,11 +202,42 @@ enum {
 	DECODER_IN_PROGRESS,
 	DECODER_COMPLETE,
 	DECODER_ERROR,
-} decoder_state;
+};
+
+// One-time setup shared by all decoders (picks the unpack kernels).
+void tm_decoder_global_init(void);
+// Prepare a decoder for use: empty state, no callback, buffered mode.
+void tm_decoder_setup(touchmouse_decoder *decoder);
+// Discard any partially decoded image.
+void tm_decoder_reset(touchmouse_decoder *decoder);
+// Feed one input report of length bytes to the decoder, triggering the
+// callback for each frame it completes.  Ordinarily whatever follows a
+// completed frame in the same report is dropped; with drain set it is decoded
+// as the start of the next frame instead.
+// arrival is when the report arrived, for latency measurement, or 0 if unknown.
+// Returns the number of frames completed, or -1 on a decoder error.
+int tm_decoder_feed(touchmouse_decoder *decoder, const unsigned char *data, int length, int drain, uint64_t arrival);
+
+// Messages more verbose than this are compiled out altogether.  Set through
+// the TOUCHMOUSE_LOG_MAX_LEVEL CMake cache variable.
+#ifndef TM_LOG_MAX_LEVEL
+#define TM_LOG_MAX_LEVEL TOUCHMOUSE_LOG_FLOOD
+#endif
+
+// The runtime log level (see touchmouse_set_log_level()).
+extern touchmouse_loglevel tm_log_level;
+
+// Whether messages at level are logged.  Both sides are cheap to test, and the
+// first is a compile-time constant, so guarding a whole block of logging with
+// this costs nothing when the level is compiled out.
+#define TM_LOG_ENABLED(level) ((level) <= TM_LOG_MAX_LEVEL && (level) <= tm_log_level)
 
 void tm_log(touchmouse_loglevel level, const char *fmt, ...);
+// Stop asynchronous logging, logging whatever is still queued.
+void tm_log_shutdown(void);
 
-#define TM_LOG(level, ...) tm_log(level, __VA_ARGS__)
+// The arguments are only evaluated if the message will actually be logged.
+#define TM_LOG(level, ...) do { if (TM_LOG_ENABLED(level)) tm_log(level, __VA_ARGS__); } while (0)
 
 #define TM_FATAL(...) TM_LOG(TOUCHMOUSE_LOG_FATAL, __VA_ARGS__)
 #define TM_ERROR(...) TM_LOG(TOUCHMOUSE_LOG_ERROR, __VA_ARGS__)
@@ -30,149 +30,24 @@
 #include "hidapi.h"
 #include <stdint.h>
 #include <stdarg.h>
+#include <errno.h>
 
 #include "touchmouse-internal.h"
 #include "mono_timer.h"
+#include "tm_thread.h"
 
-static touchmouse_loglevel touchmouse_current_loglevel = TOUCHMOUSE_LOG_INFO;
-
-#pragma pack(1)
-//  The USB HID reports that contain our data are always 32 bytes, with the
-//  following structure:
-typedef struct {
-	uint8_t report_id; // HID report ID.  In this case, we only care about the
-	                   //   ones that have report_id 0x27.
-	uint8_t length;    // Length of the useful data in this transfer, including
-	                   //   both timestamp and data[] buffer.
-	uint8_t magic[4];  // Four magic bytes.  These are always the same:
-	                   //   0x14 0x01 0x00 0x51
-	uint8_t timestamp; // Measured in milliseconds since the last series of
-	                   //   touch events began, but wraps at 256.  If two or
-	                   //   more consecutive transfers have the same timestamp,
-	                   //   it is likely that their data should be taken
-	                   //   together 
-	uint8_t data[25];  // Compressed touchmouse image data.  Only length-1
-	                   //   bytes of this buffer are useful.
-} report;
-#pragma pack()
-
-//  The image that we get is 181 bytes that are part of a 13x15 (195 pixel)
-//  grid laid out like this:
-//
-//  1 2 3 4 5 6 7 8 9 a b c d e f
-//  -----------------------------+
-//        0 0 0 0 0 0 0 0 0      | 1
-//      0 0 0 0 0 0 0 0 0 0 0    | 2
-//    0 0 0 0 0 0 0 0 0 0 0 0 0  | 3
-//    0 0 0 0 0 0 0 0 0 0 0 0 0  | 4
-//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 5
-//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 6
-//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 7
-//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 8
-//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 9
-//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 10
-//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 11
-//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 12
-//  0 0 0 0 0 0 0 0 0 0 0 0 0 0 0| 13
-//
-//  Each "pixel" in the image may have one of 15 values - 0 through 0xE.  We
-//  receive a stream of nybbles that encodes these 181 bytes, but should present
-//  the unpacked version to the client.
-//
-//  The data we receive is ordered as is English - left to right, top to bottom.
-//
-//  When processing nybbles, it turns out we should process the less-significant
-//  nybble first and the more-significant nybble second.
-//
-//  The compression scheme is simple - pixels are expressed with their raw value
-//  (0 - E) unless there is a run of at least three 0's, in which case two nybbles
-//  F, X encode a run of X+3 zeroes.  Since zeroes are the most common value, this
-//  results in a decent amount of compression.
-//
-//  Note that the usable touch area on the mouse may be even smaller than this 181
-//  pixel arrangement - some of even these pixels may always give a value of 0.
-
-static void reset_decoder(touchmouse_device *state)
-{
-	state->buf_index = 0;
-	state->next_is_run_encoded = 0;
-	memset(state->partial_image, 0, sizeof(state->partial_image));
-	memset(state->image, 0, sizeof(state->image));
-}
-
-// There are 15 possible values that each pixel can take on, but we'd like to
-// scale them up to the full range of a uint8_t for convenience.
-static uint8_t decoder_table[15] = {0, 18, 36, 55, 73, 91, 109, 128, 146, 164, 182, 200, 219, 237, 255 };
-
-static int process_nybble(touchmouse_device *state, uint8_t nybble)
-{
-	TM_FLOOD("process_nybble: buf_index = %d\t%01x\n", state->buf_index, nybble);
-	if (nybble >= 16) {
-		TM_ERROR("process_nybble: got nybble >= 16, wtf: %d\n", nybble);
-		return DECODER_ERROR;
-	}
-	if (state->next_is_run_encoded) {
-		// Previous nybble was 0xF, so this one is (the number of bytes to skip - 3)
-		if (state->buf_index + nybble + 3 > 181) {
-			// Completing this decode would overrun the buffer.  We've been
-			// given invalid data.  Abort.
-			TM_ERROR("process_nybble: run encoded would overflow buffer: got 0xF%X (%d zeros) with only %d bytes to fill in buffer\n", nybble, nybble + 3, 181 - state->buf_index);
-			return DECODER_ERROR;
-		}
-		int i;
-		for(i = 0 ; i < nybble + 3; i++) {
-			state->partial_image[state->buf_index] = 0;
-			state->buf_index++;
-		}
-		state->next_is_run_encoded = 0;
-	} else {
-		if (nybble == 0xf) {
-			state->next_is_run_encoded = 1;
-		} else {
-			state->partial_image[state->buf_index] = nybble;
-			state->buf_index++;
-		}
-	}
-	// If we're done collecting the data, unpack it into image as described above
-	// This could probably be reworked to unpack the image in-place reusing the
-	// image buffer, but right now I'm being lazy.
-	if (state->buf_index == 181) {
-		memset(state->image, 0, 195);
-		int row;
-		int i = 0;
-		int startcol;
-		int endcol;
-		for(row = 0; row < 13 ; row++) {
-			switch(row) {
-				// Note: inclusive bounds
-				case 0: startcol = 0x3;
-						endcol = 0xb;
-						break;
-				case 1: startcol = 0x2;
-						endcol = 0xc;
-						break;
-				case 2:
-				case 3: startcol = 0x1;
-						endcol = 0xd;
-						break;
-				default:
-						startcol = 0x0;
-						endcol = 0xe;
-						break;
-			}
-			int col;
-			for(col = startcol ; col <= endcol ; col++) {
-				state->image[row * 15 + col] = decoder_table[state->partial_image[i++]];
-			}
-		}
-		return DECODER_COMPLETE;
-	}
-	return DECODER_IN_PROGRESS;
-}
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+// How many queued reports touchmouse_process_events_multi() processes from
+// each device before moving on to the next: about one full report queue.
+#define TM_MULTI_REPORT_BUDGET 32
 
 // Initialize libtouchmouse.  Which mostly consists of calling hid_init();
 int touchmouse_init(void)
 {
+	tm_decoder_global_init();
 	return hid_init();
 }
 
@@ -182,26 +57,29 @@ int touchmouse_shutdown(void)
 	// TODO: add some checking to see if all device handles have been closed,
 	// and try to close them all?  This would involve keeping a list of
 	// currently-open devices.  Not hard.
+	tm_log_shutdown();
 	return hid_exit();
 }
 
-// Set global log level.  This should probably be pushed down into contexts,
-// but HIDAPI doesn't support contexts. :(
-void touchmouse_set_log_level(touchmouse_loglevel level)
+// Number of USB transfers to keep submitted per device.  Like the log level,
+// this is global, and only takes effect when a device is opened.
+int touchmouse_set_read_transfer_count(int count)
 {
-	touchmouse_current_loglevel = level;
+	if (hid_set_read_transfer_count(count) < 0) {
+		TM_ERROR("touchmouse_set_read_transfer_count: Can't use %d transfers\n", count);
+		return -1;
+	}
+	return 0;
 }
 
-// Emit a log message at the specified loglevel.  If the current loglevel is
-// lower than the one specified, do nothing.
-void tm_log(touchmouse_loglevel level, const char *fmt, ...)
+// Likewise global, and only takes effect when a device is opened.
+int touchmouse_set_event_threads(int count)
 {
-	va_list args;
-	if (level > touchmouse_current_loglevel)
-		return;
-	va_start(args, fmt);
-	vfprintf(stderr, fmt, args);
-	va_end(args);
+	if (hid_set_event_threads(count) < 0) {
+		TM_ERROR("touchmouse_set_event_threads: Can't use %d event threads\n", count);
+		return -1;
+	}
+	return 0;
 }
 
 // Enumeration.
@@ -241,12 +119,12 @@ touchmouse_device_info* touchmouse_enumerate_devices(void)
 			// We need to save both the pointer to this particular hid_device_info
 			// as well as the one from which it was initially allocated, so we can
 			// free it.
-			// Perhaps this would be better placed in a statically allocated list...
-			struct hid_device_info** pair = (struct hid_device_info**)malloc(2*sizeof(struct hid_device_info*));
-			TM_FLOOD("Allocated two hid_device_info* at address %p\n", pair);
-			(*prev_next_pointer)->opaque = (void*)pair;
-			pair[0] = cur_dev;
-			pair[1] = devs;
+			tm_device_entry* entry = (tm_device_entry*)calloc(1, sizeof(tm_device_entry));
+			TM_FLOOD("Allocated a tm_device_entry at address %p\n", entry);
+			(*prev_next_pointer)->opaque = (void*)entry;
+			entry->type = TM_DEVICE_HID;
+			entry->hid_info = cur_dev;
+			entry->hid_list = devs;
 			prev_next_pointer = &((*prev_next_pointer)->next);
 		}
 		cur_dev = cur_dev->next;
@@ -258,6 +136,35 @@ touchmouse_device_info* touchmouse_enumerate_devices(void)
 		TM_FLOOD("Found no devices, so calling hid_free_enumeration()\n");
 		hid_free_enumeration(devs);
 	}
+	// Offer a capture to replay, if there is one.
+	const char* replay_path = getenv("TOUCHMOUSE_REPLAY");
+	if (replay_path && *replay_path) {
+		const char* pacing = getenv("TOUCHMOUSE_REPLAY_PACING");
+		TM_DEBUG("Adding replay device for %s\n", replay_path);
+		*prev_next_pointer = (touchmouse_device_info*)calloc(1, sizeof(touchmouse_device_info));
+		tm_device_entry* entry = (tm_device_entry*)calloc(1, sizeof(tm_device_entry));
+		(*prev_next_pointer)->opaque = (void*)entry;
+		entry->type = TM_DEVICE_REPLAY;
+		entry->replay_path = strdup(replay_path);
+		entry->pacing = (pacing && strcmp(pacing, "fast") == 0) ? TOUCHMOUSE_REPLAY_FAST : TOUCHMOUSE_REPLAY_RECORDED;
+		prev_next_pointer = &((*prev_next_pointer)->next);
+	}
+	// And any synthetic devices asked for.
+	const char* synthetic_count = getenv("TOUCHMOUSE_SYNTHETIC");
+	const char* synthetic_rate = getenv("TOUCHMOUSE_SYNTHETIC_RATE");
+	int count = synthetic_count ? atoi(synthetic_count) : 0;
+	int i;
+	for(i = 0; i < count; i++) {
+		*prev_next_pointer = (touchmouse_device_info*)calloc(1, sizeof(touchmouse_device_info));
+		tm_device_entry* entry = (tm_device_entry*)calloc(1, sizeof(tm_device_entry));
+		(*prev_next_pointer)->opaque = (void*)entry;
+		entry->type = TM_DEVICE_SYNTHETIC;
+		entry->synthetic.seed = i + 1;
+		entry->synthetic.frame_rate = synthetic_rate ? atof(synthetic_rate) : 0;
+		prev_next_pointer = &((*prev_next_pointer)->next);
+	}
+	if (count > 0)
+		TM_DEBUG("Added %d synthetic devices\n", count);
 	return retval;
 }
 
@@ -265,36 +172,94 @@ void touchmouse_free_enumeration(touchmouse_device_info *devs)
 {
 	TM_FLOOD("touchmouse_free_enumeration: Freeing touchmouse device list\n");
 	touchmouse_device_info* prev;
-	if (devs) {
-		hid_free_enumeration(((struct hid_device_info**)devs->opaque)[1]);
-	}
+	struct hid_device_info* hid_list = NULL;
 	while (devs) {
+		tm_device_entry* entry = (tm_device_entry*)devs->opaque;
+		if (entry->type == TM_DEVICE_HID)
+			hid_list = entry->hid_list;
+		free(entry->replay_path);
 		prev = devs;
 		devs = devs->next;
 		free(prev->opaque);
 		free(prev);
 	}
+	// Every HID entry came from the same enumeration.
+	if (hid_list)
+		hid_free_enumeration(hid_list);
 }
 
-int touchmouse_open(touchmouse_device **dev, touchmouse_device_info *dev_info)
+// Allocate a device with its decoder set up, but nothing to read from yet.
+static touchmouse_device* new_device(void)
 {
 	touchmouse_device* t_dev = (touchmouse_device*)malloc(sizeof(touchmouse_device));
+	if (!t_dev)
+		return NULL;
 	memset(t_dev, 0, sizeof(touchmouse_device));
-	char* path = ((struct hid_device_info**)dev_info->opaque)[0]->path;
-	t_dev->dev = hid_open_path(path);
-	if (!t_dev->dev) {
-		TM_ERROR("hid_open() failed for device with path %s\n", path);
+	tm_decoder_setup(&t_dev->decoder);
+	t_dev->decoder.latency = &t_dev->latency;
+	return t_dev;
+}
+
+int touchmouse_open_replay(touchmouse_device **dev, const char *path, touchmouse_replay_pacing pacing)
+{
+	touchmouse_device* t_dev = new_device();
+	if (!t_dev) {
+		TM_ERROR("touchmouse_open_replay: out of memory\n");
+		return -1;
+	}
+	if (tm_replay_transport_open(&t_dev->transport, path, pacing) < 0) {
+		free(t_dev);
+		return -1;
+	}
+	*dev = t_dev;
+	return 0;
+}
+
+int touchmouse_open_synthetic(touchmouse_device **dev, const touchmouse_synthetic_params *params)
+{
+	touchmouse_synthetic_params defaults;
+	touchmouse_device* t_dev = new_device();
+	if (!t_dev) {
+		TM_ERROR("touchmouse_open_synthetic: out of memory\n");
+		return -1;
+	}
+	if (!params) {
+		memset(&defaults, 0, sizeof(defaults));
+		params = &defaults;
+	}
+	if (tm_synthetic_transport_open(&t_dev->transport, params) < 0) {
+		free(t_dev);
+		return -1;
+	}
+	*dev = t_dev;
+	return 0;
+}
+
+int touchmouse_open(touchmouse_device **dev, touchmouse_device_info *dev_info)
+{
+	tm_device_entry* entry = (tm_device_entry*)dev_info->opaque;
+	if (entry->type == TM_DEVICE_REPLAY)
+		return touchmouse_open_replay(dev, entry->replay_path, entry->pacing);
+	if (entry->type == TM_DEVICE_SYNTHETIC)
+		return touchmouse_open_synthetic(dev, &entry->synthetic);
+	touchmouse_device* t_dev = new_device();
+	if (!t_dev) {
+		TM_ERROR("touchmouse_open: out of memory\n");
+		return -1;
+	}
+	if (tm_hid_transport_open(&t_dev->transport, entry->hid_info->path) < 0) {
 		free(t_dev);
 		return -1;
 	}
-	hid_set_nonblocking(t_dev->dev, 1); // Enable nonblocking reads
 	*dev = t_dev;
 	return 0;
 }
 
 int touchmouse_close(touchmouse_device *dev)
 {
-	hid_close(dev->dev);
+	if (dev->recorder)
+		touchmouse_stop_recording(dev);
+	dev->transport.ops->close(dev->transport.handle);
 	free(dev);
 	return 0;
 }
@@ -304,11 +269,16 @@ int touchmouse_set_device_mode(touchmouse_device *dev, touchmouse_mode mode)
 	// We need to set two bits in a particular Feature report.  We first fetch
 	// the current state of the feature report, set the interesting bits, and
 	// write that feature report back to the device.
+	const tm_transport *transport = &dev->transport;
+	if (!transport->ops->get_feature_report) {
+		TM_DEBUG("touchmouse_set_device_mode: %s devices have no modes to set\n", transport->ops->name);
+		return 0;
+	}
 	TM_SPEW("touchmouse_set_device_mode: Reading current config flags\n");
 	unsigned char data[27] = {0x22};
 	int transferred = 0;
-	transferred = hid_get_feature_report(dev->dev, data, 27);
-	if (transferred > 0) {
+	transferred = transport->ops->get_feature_report(transport->handle, data, 27);
+	if (transferred > 0 && TM_LOG_ENABLED(TOUCHMOUSE_LOG_SPEW)) {
 		TM_SPEW("%d bytes received:\n", transferred);
 		int i;
 		for(i = 0; i < transferred; i++) {
@@ -334,7 +304,7 @@ int touchmouse_set_device_mode(touchmouse_device *dev, touchmouse_mode mode)
 			break;
 	}
 
-	transferred = hid_send_feature_report(dev->dev, data, 27);
+	transferred = transport->ops->send_feature_report(transport->handle, data, 27);
 	TM_SPEW("Wrote %d bytes\n", transferred);
 	if (transferred == 0x1B) {
 		TM_DEBUG("touchmouse_set_device_mode: Successfully set device mode.\n");
@@ -344,26 +314,70 @@ int touchmouse_set_device_mode(touchmouse_device *dev, touchmouse_mode mode)
 	return -1;
 }
 
+int touchmouse_set_decode_mode(touchmouse_device *dev, touchmouse_decode_mode mode)
+{
+	return touchmouse_decoder_set_mode(&dev->decoder, mode);
+}
+
 int touchmouse_set_image_update_callback(touchmouse_device *dev, touchmouse_image_callback callback)
 {
-	dev->cb = callback;
+	return touchmouse_decoder_set_image_update_callback(&dev->decoder, callback);
+}
+
+int touchmouse_set_image_update_callback_ex(touchmouse_device *dev, touchmouse_image_callback_ex callback)
+{
+	return touchmouse_decoder_set_image_update_callback_ex(&dev->decoder, callback);
+}
+
+uint64_t touchmouse_time_nanos(void)
+{
+	return mono_timer_nanos();
+}
+
+int touchmouse_get_clock_estimate(touchmouse_device *dev, touchmouse_clock_estimate *estimate)
+{
+	const tm_clock_model *clock = &dev->decoder.clock;
+	if (clock->window_count == 0)
+		return -1;
+	estimate->samples = clock->window_count;
+	// slope is host ns per device ms.
+	estimate->drift_ppm = (1000000.0 / clock->slope - 1.0) * 1e6;
+	estimate->offset_ns = clock->offset;
+	estimate->jitter_ns = clock->jitter;
+	estimate->series = clock->series;
 	return 0;
 }
 
 int touchmouse_set_device_userdata(touchmouse_device *dev, void *userdata)
 {
-	dev->userdata = userdata;
-	return 0;
+	return touchmouse_decoder_set_userdata(&dev->decoder, userdata);
+}
+
+// Read one report into data (at least 256 bytes), as hid_read_timeout()
+// does, also finding out when it arrived.
+static int read_report(touchmouse_device *dev, unsigned char *data, int milliseconds, uint64_t *arrival)
+{
+	int res = dev->transport.ops->read(dev->transport.handle, data, 255, milliseconds, arrival);
+	if (res > 0 && dev->recorder)
+		tm_recorder_add(dev->recorder, data, res, *arrival);
+	return res;
+}
+
+// What went wrong with the last read_report().
+static const wchar_t* read_error_string(touchmouse_device *dev)
+{
+	return dev->transport.ops->error(dev->transport.handle);
 }
 
 int touchmouse_process_events_timeout(touchmouse_device *dev, int milliseconds) {
 	unsigned char data[256] = {};
 	int res;
+	uint64_t arrival;
 	uint64_t deadline;
 	if(milliseconds < 0) {
 		deadline = (uint64_t)(-1);
 	} else {
-		deadline = mono_timer_nanos() + (milliseconds * 1000000);
+		deadline = mono_timer_nanos() + ((uint64_t)milliseconds * 1000000);
 	}
 	uint64_t nanos = mono_timer_nanos();
 	if (nanos == 0 || deadline == 0) {
@@ -371,77 +385,305 @@ int touchmouse_process_events_timeout(touchmouse_device *dev, int milliseconds)
 		return -1;
 	}
 	do {
-		res = hid_read_timeout(dev->dev, data, 255, (deadline - nanos) / 1000000 );
+		res = read_report(dev, data, (deadline - nanos) / 1000000, &arrival);
 		if (res < 0 ) {
-			TM_ERROR("hid_read() failed: %d - %ls\n", res, hid_error(dev->dev));
+			TM_ERROR("hid_read() failed: %d - %ls\n", res, read_error_string(dev));
 			return -2;
 		} else if (res > 0) {
-			// Dump contents of transfer
-			TM_SPEW("touchmouse_process_events_timeout: got report: %d bytes:", res);
-			int j;
-			for(j = 0; j < res; j++) {
-				TM_SPEW(" %02X", data[j]);
-			}
-			TM_SPEW("\n");
-			// Interpret contents.
-			report* r = (report*)data;
-			// We only care about report ID 39 (0x27), which should be 32 bytes long
-			if (res == 32 && r->report_id == 0x27) {
-				TM_FLOOD("Timestamp: %02X\t%02X bytes:", r->timestamp, r->length - 1);
-				int t;
-				for(t = 0; t < r->length - 1; t++) {
-					TM_FLOOD(" %02X", r->data[t]);
-				}
-				TM_FLOOD("\n");
-				// Reset the decoder if we've seen one timestamp already from earlier
-				// transfers, and this one doesn't match.
-				if (dev->buf_index != 0 && r->timestamp != dev->timestamp_in_progress) {
-					TM_FLOOD("touchmouse_process_events_timeout: timestamps don't match: got %d, expected %d\n", r->timestamp, dev->timestamp_in_progress);
-					reset_decoder(dev); // Reset decoder for next transfer
-				}
-				dev->timestamp_in_progress = r->timestamp;
-				for(t = 0; t < r->length - 1; t++) { // We subtract one byte because the length includes the timestamp byte.
-					int res;
-					// Yes, we process the low nybble first.  Embedded systems are funny like that.
-					res = process_nybble(dev, r->data[t] & 0xf);
-					if (res == DECODER_COMPLETE) {
-						TM_SPEW("Frame completed, triggering callback\n");
-						dev->timestamp_last_completed = r->timestamp;
-						touchmouse_callback_info cbinfo;
-						cbinfo.userdata = dev->userdata;
-						cbinfo.image = dev->image;
-						cbinfo.timestamp = dev->timestamp_last_completed;
-						dev->cb(&cbinfo);
-						reset_decoder(dev); // Reset decoder for next transfer
-						return 0;
-					}
-					if (res == DECODER_ERROR) {
-						TM_ERROR("Caught error in decoder, aborting decode!\n");
-						reset_decoder(dev);
-						return -1;
-					}
-					res = process_nybble(dev, (r->data[t] & 0xf0) >> 4);
-					if (res == DECODER_COMPLETE) {
-						TM_SPEW("Frame completed, triggering callback\n");
-						dev->timestamp_last_completed = r->timestamp;
-						touchmouse_callback_info cbinfo;
-						cbinfo.userdata = dev->userdata;
-						cbinfo.image = dev->image;
-						cbinfo.timestamp = dev->timestamp_last_completed;
-						dev->cb(&cbinfo);
-						reset_decoder(dev); // Reset decoder for next transfer
-						return 0;
-					}
-					if (res == DECODER_ERROR) {
-						TM_ERROR("Caught error in decoder, aborting decode!\n");
-						reset_decoder(dev);
-						return -1;
-					}
-				}
-			}
+			int frames = tm_decoder_feed(&dev->decoder, data, res, 0, arrival);
+			if (frames < 0)
+				return -1;
+			if (frames > 0)
+				return 0;
 		}
 		nanos = mono_timer_nanos();
 	} while(nanos < deadline);
 	return 0;
 }
 
+// Decode up to max_reports queued reports (all of them if negative), adding
+// the images completed to *frames.  Returns 0, -1 if some reports could not
+// be decoded, or -2 if reading failed, which also marks the device failed.
+static int process_queued_reports(touchmouse_device *dev, int max_reports, int *frames) {
+	unsigned char data[256] = {};
+	int res = 0;
+	int decode_error = 0;
+	uint64_t arrival;
+	while (max_reports-- != 0 && (res = read_report(dev, data, 0, &arrival)) > 0) {
+		int completed = tm_decoder_feed(&dev->decoder, data, res, 1, arrival);
+		if (completed < 0)
+			decode_error = 1;
+		else
+			*frames += completed;
+	}
+	if (res < 0) {
+		TM_ERROR("hid_read() failed: %d - %ls\n", res, read_error_string(dev));
+		dev->read_failed = 1;
+		return -2;
+	}
+	return decode_error ? -1 : 0;
+}
+
+int touchmouse_get_pollable_fd(touchmouse_device *dev)
+{
+	return dev->transport.ops->get_pollable_fd(dev->transport.handle);
+}
+
+int touchmouse_set_report_queue(touchmouse_device *dev, int capacity, touchmouse_queue_policy policy)
+{
+	hid_queue_policy hid_policy;
+	switch (policy) {
+		case TOUCHMOUSE_QUEUE_DROP_OLDEST:
+			hid_policy = HID_QUEUE_DROP_OLDEST;
+			break;
+		case TOUCHMOUSE_QUEUE_DROP_NEWEST:
+			hid_policy = HID_QUEUE_DROP_NEWEST;
+			break;
+		case TOUCHMOUSE_QUEUE_DROP_FRAME:
+			hid_policy = HID_QUEUE_DROP_OLDEST_FRAME;
+			break;
+		default:
+			TM_ERROR("touchmouse_set_report_queue: Unknown queue policy %d\n", policy);
+			return -1;
+	}
+	if (capacity < 0) {
+		TM_ERROR("touchmouse_set_report_queue: Invalid capacity %d\n", capacity);
+		return -1;
+	}
+	const tm_transport *transport = &dev->transport;
+	if (!transport->ops->set_input_queue) {
+		TM_ERROR("touchmouse_set_report_queue: %s devices have no report queue\n", transport->ops->name);
+		return -1;
+	}
+	// All the reports of one image carry the same timestamp, so that's what
+	// tells frames apart.
+	if (transport->ops->set_input_queue(transport->handle, capacity, hid_policy, TM_REPORT_TIMESTAMP_OFFSET) < 0) {
+		TM_ERROR("touchmouse_set_report_queue: Failed to configure the report queue\n");
+		return -1;
+	}
+	return 0;
+}
+
+// The transport's report queue counters.  Returns -1 if it has no queue.
+static int read_queue_stats(touchmouse_device *dev, struct hid_input_queue_stats *hid_stats)
+{
+	const tm_transport *transport = &dev->transport;
+	if (!transport->ops->get_input_queue_stats)
+		return -1;
+	return transport->ops->get_input_queue_stats(transport->handle, hid_stats);
+}
+
+int touchmouse_get_report_queue_stats(touchmouse_device *dev, touchmouse_queue_stats *stats)
+{
+	struct hid_input_queue_stats hid_stats;
+	if (read_queue_stats(dev, &hid_stats) < 0)
+		return -1;
+	stats->reports_received = hid_stats.reports_received;
+	stats->dropped_oldest = hid_stats.dropped_oldest;
+	stats->dropped_newest = hid_stats.dropped_newest;
+	stats->frames_dropped = hid_stats.frames_dropped;
+	stats->frame_reports_dropped = hid_stats.frame_reports_dropped;
+	stats->capacity = hid_stats.capacity;
+	stats->queued = hid_stats.queued;
+	stats->high_water = hid_stats.high_water;
+	return 0;
+}
+
+// The counters as they stand, not counting from any reset.
+static void read_stats(touchmouse_device *dev, touchmouse_stats *stats)
+{
+	const tm_decoder_counters *counters = &dev->decoder.counters;
+	struct hid_input_queue_stats hid_stats;
+	memset(stats, 0, sizeof(*stats));
+	stats->reports_received = TM_ATOMIC_LOAD_RELAXED(&counters->reports);
+	stats->reports_ignored = TM_ATOMIC_LOAD_RELAXED(&counters->ignored);
+	stats->decoder_resets = TM_ATOMIC_LOAD_RELAXED(&counters->resets);
+	stats->decoder_errors = TM_ATOMIC_LOAD_RELAXED(&counters->errors);
+	stats->frames_delivered = TM_ATOMIC_LOAD_RELAXED(&counters->frames);
+	// Backends without a report queue just don't drop anything.
+	if (read_queue_stats(dev, &hid_stats) == 0) {
+		stats->reports_dropped = hid_stats.dropped_oldest + hid_stats.dropped_newest + hid_stats.frame_reports_dropped;
+		stats->frames_dropped = hid_stats.frames_dropped;
+	}
+}
+
+int touchmouse_get_stats(touchmouse_device *dev, touchmouse_stats *stats)
+{
+	const touchmouse_stats *base = &dev->stats_baseline;
+	read_stats(dev, stats);
+	stats->reports_received -= base->reports_received;
+	stats->reports_ignored -= base->reports_ignored;
+	stats->decoder_resets -= base->decoder_resets;
+	stats->decoder_errors -= base->decoder_errors;
+	stats->frames_delivered -= base->frames_delivered;
+	stats->reports_dropped -= base->reports_dropped;
+	stats->frames_dropped -= base->frames_dropped;
+	return 0;
+}
+
+// The counters are only ever written by the thread processing events, so
+// rather than zero them under its feet, remember where they were.
+int touchmouse_reset_stats(touchmouse_device *dev)
+{
+	read_stats(dev, &dev->stats_baseline);
+	return 0;
+}
+
+int touchmouse_start_recording(touchmouse_device *dev, const char *path)
+{
+	if (dev->recorder) {
+		TM_ERROR("touchmouse_start_recording: already recording\n");
+		return -1;
+	}
+	dev->recorder = tm_recorder_open(path, mono_timer_nanos());
+	return dev->recorder ? 0 : -1;
+}
+
+int touchmouse_stop_recording(touchmouse_device *dev)
+{
+	int res;
+	if (!dev->recorder)
+		return -1;
+	res = tm_recorder_close(dev->recorder);
+	dev->recorder = NULL;
+	return res;
+}
+
+int touchmouse_get_latency_stats(touchmouse_device *dev, touchmouse_latency_stats *stats)
+{
+	tm_latency_summarize(&dev->latency, stats);
+	return 0;
+}
+
+uint64_t touchmouse_get_latency_percentile(touchmouse_device *dev, double percentile)
+{
+	return tm_latency_percentile(&dev->latency, percentile);
+}
+
+int touchmouse_reset_latency_stats(touchmouse_device *dev)
+{
+	tm_latency_reset(&dev->latency);
+	return 0;
+}
+
+int touchmouse_process_pending_events(touchmouse_device *dev) {
+	int frames = 0;
+	int res = process_queued_reports(dev, -1, &frames);
+	return res < 0 ? res : frames;
+}
+
+int touchmouse_process_events_multi(touchmouse_device **devs, int count, int milliseconds, int *status) {
+	int frames = 0;
+	int live = 0;
+	int next_wait = 0;
+	int i;
+	uint64_t deadline;
+	if(milliseconds < 0) {
+		deadline = (uint64_t)(-1);
+	} else {
+		deadline = mono_timer_nanos() + ((uint64_t)milliseconds * 1000000);
+	}
+	uint64_t nanos = mono_timer_nanos();
+	if (nanos == 0 || deadline == 0) {
+		TM_FATAL("touchmouse_process_events_multi: timer function returned an error, erroring out since we have no timer\n");
+		return -1;
+	}
+	// Devices that failed before are skipped, and keep saying so.
+	for(i = 0; i < count; i++) {
+		if (!devs[i]->read_failed)
+			live++;
+		if (status)
+			status[i] = devs[i]->read_failed ? -2 : 0;
+	}
+	if (live == 0)
+		return count > 0 ? -2 : 0;
+
+#ifndef _WIN32
+	// If every device has a descriptor to wait on, we can sleep until any of
+	// them has reports.  Failed devices get a negative fd, which poll()
+	// ignores.
+	struct pollfd stack_fds[16];
+	struct pollfd *fds = (count <= 16) ? stack_fds : (struct pollfd*)malloc(count * sizeof(struct pollfd));
+	int can_poll = (fds != NULL);
+	for(i = 0; can_poll && i < count; i++) {
+		fds[i].fd = devs[i]->read_failed ? -1 : touchmouse_get_pollable_fd(devs[i]);
+		fds[i].events = POLLIN;
+		if (fds[i].fd < 0 && !devs[i]->read_failed)
+			can_poll = 0;
+	}
+#endif
+
+	for(;;) {
+		// Give every device the same budget of reports per pass, so that a
+		// busy one can't hold up the rest; whatever it has left over gets
+		// processed next time.
+		for(i = 0; i < count; i++) {
+			if (devs[i]->read_failed)
+				continue;
+			int res = process_queued_reports(devs[i], TM_MULTI_REPORT_BUDGET, &frames);
+			if (res < 0 && status && status[i] == 0)
+				status[i] = res;
+			if (res == -2) {
+				live--;
+#ifndef _WIN32
+				if (can_poll)
+					fds[i].fd = -1;
+#endif
+			}
+		}
+		if (frames > 0 || live == 0)
+			break;
+		nanos = mono_timer_nanos();
+		if (nanos >= deadline)
+			break;
+
+		// Nothing to deliver yet: wait for more reports.
+		int wait_ms = (deadline == (uint64_t)(-1)) ? -1 : (int)((deadline - nanos + 999999) / 1000000);
+#ifndef _WIN32
+		if (can_poll) {
+			if (poll(fds, count, wait_ms) < 0 && errno != EINTR) {
+				TM_ERROR("touchmouse_process_events_multi: poll() failed\n");
+				frames = -1;
+				break;
+			}
+			continue;
+		}
+#endif
+		// Without descriptors, wait on one device at a time, taking turns,
+		// for a millisecond at most so the others aren't kept waiting.
+		unsigned char data[256] = {};
+		touchmouse_device *dev;
+		do {
+			dev = devs[next_wait];
+			i = next_wait;
+			next_wait = (next_wait + 1) % count;
+		} while (dev->read_failed);
+		uint64_t arrival;
+		int res = read_report(dev, data, (wait_ms < 0 || wait_ms > 1) ? 1 : wait_ms, &arrival);
+		if (res < 0) {
+			TM_ERROR("hid_read() failed: %d - %ls\n", res, read_error_string(dev));
+			dev->read_failed = 1;
+			if (status)
+				status[i] = -2;
+			live--;
+		} else if (res > 0) {
+			int completed = tm_decoder_feed(&dev->decoder, data, res, 1, arrival);
+			if (completed < 0) {
+				if (status && status[i] == 0)
+					status[i] = -1;
+			} else {
+				frames += completed;
+			}
+		}
+		if (frames > 0 || live == 0)
+			break;
+	}
+
+#ifndef _WIN32
+	if (fds != stack_fds)
+		free(fds);
+#endif
+	if (frames == 0 && live == 0)
+		return -2;
+	return frames;
+}
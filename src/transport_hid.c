@@ -0,0 +1,77 @@
+/* The HIDAPI transport: reports from a real TouchMouse, through whichever
+ * HIDAPI backend the library was built with.
+ */
+#include <stdint.h>
+
+#include "touchmouse-internal.h"
+#include "mono_timer.h"
+
+static int hid_transport_read(void *handle, unsigned char *data, size_t length, int milliseconds, uint64_t *arrival)
+{
+	unsigned long long hid_arrival;
+	int res = hid_read_timestamped((hid_device*)handle, data, length, milliseconds, &hid_arrival);
+	// Backends that can't tell when a report arrived get the time it was
+	// read instead.
+	*arrival = (res > 0 && hid_arrival == 0) ? mono_timer_nanos() : hid_arrival;
+	return res;
+}
+
+static int hid_transport_get_feature_report(void *handle, unsigned char *data, size_t length)
+{
+	return hid_get_feature_report((hid_device*)handle, data, length);
+}
+
+static int hid_transport_send_feature_report(void *handle, const unsigned char *data, size_t length)
+{
+	return hid_send_feature_report((hid_device*)handle, data, length);
+}
+
+static int hid_transport_get_pollable_fd(void *handle)
+{
+	return hid_get_pollable_fd((hid_device*)handle);
+}
+
+static int hid_transport_set_input_queue(void *handle, size_t capacity, hid_queue_policy policy, int frame_key_offset)
+{
+	return hid_set_input_queue((hid_device*)handle, capacity, policy, frame_key_offset);
+}
+
+static int hid_transport_get_input_queue_stats(void *handle, struct hid_input_queue_stats *stats)
+{
+	return hid_get_input_queue_stats((hid_device*)handle, stats);
+}
+
+static const wchar_t *hid_transport_error(void *handle)
+{
+	return hid_error((hid_device*)handle);
+}
+
+static void hid_transport_close(void *handle)
+{
+	hid_close((hid_device*)handle);
+}
+
+static const tm_transport_ops hid_ops = {
+	"hid",
+	hid_transport_read,
+	hid_transport_get_feature_report,
+	hid_transport_send_feature_report,
+	hid_transport_get_pollable_fd,
+	hid_transport_set_input_queue,
+	hid_transport_get_input_queue_stats,
+	hid_transport_error,
+	hid_transport_close,
+};
+
+int tm_hid_transport_open(tm_transport *transport, const char *path)
+{
+	hid_device *dev = hid_open_path(path);
+	if (!dev) {
+		TM_ERROR("hid_open() failed for device with path %s\n", path);
+		return -1;
+	}
+	hid_set_nonblocking(dev, 1); // Enable nonblocking reads
+	transport->ops = &hid_ops;
+	transport->handle = dev;
+	return 0;
+}